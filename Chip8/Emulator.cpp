@@ -1,4 +1,8 @@
 #include "Emulator.h"
+#include "tracer.h"
+#include "analysis.h"
+#include "metrics.h"
+#include "blitter.h"
 
 #include <sstream>
 #include <iostream>
@@ -9,120 +13,558 @@
 //
 // Emulator::Screen class
 
+Emulator::Screen::SlotKeys::SlotKeys()
+{
+  for (size_t idx = 0; idx < sizeof(keys) / sizeof(keys[0]); idx++)
+    keys[idx] = HashMix(HashScreen + idx + 0x9E3779B97F4A7C15ULL);
+}
+
+const Emulator::Screen::SlotKeys Emulator::Screen::slotKeys;
+
+inline uint64_t Emulator::Screen::WordKey(int pl, size_t idx, uint64_t word)
+{
+  // the same as HashKey(HashScreen + pl * maxWordsPerLine * maxHeight + idx, word)
+  return word == 0 ? 0 : HashMix(word ^ slotKeys.keys[pl * maxWordsPerLine * maxHeight + idx]);
+}
+
+inline uint64_t Emulator::Screen::WordChange(int pl, size_t idx, uint64_t oldWord, uint64_t newWord)
+{
+  return WordKey(pl, idx, oldWord) ^ WordKey(pl, idx, newWord);
+}
+
 Emulator::Screen::Screen()
+: colour(NULL), colourOn(false)
 {
+  for (int pl = 0; pl < maxPlanes; pl++) {
+    planes[pl] = SharedPage::Zero();
+    planeHash[pl] = 0;
+  }
   Init(CHIP8);
-  Clear();
+}
+
+Emulator::Screen::Screen(const Screen &other)
+: colour(NULL), colourOn(false)
+{
+  for (int pl = 0; pl < maxPlanes; pl++) {
+    planes[pl] = SharedPage::Zero();
+    planeHash[pl] = 0;
+  }
+  *this = other;
+}
+
+Emulator::Screen &Emulator::Screen::operator=(const Screen &other)
+{
+  width = other.width;
+  height = other.height;
+  wordsPerLine = other.wordsPerLine;
+  for (int pl = 0; pl < maxPlanes; pl++) {
+    SharedPage *old = planes[pl];
+    planes[pl] = other.planes[pl]->AddRef();
+    planeHash[pl] = other.planeHash[pl];
+    old->Release();
+  }
+  // classic roms have no colour screen, and pay nothing for it
+  if (colour != NULL || other.colour != NULL)
+    CopyColour(other.colour);
+  colourOn = other.colourOn;
+  return *this;
+}
+
+Emulator::Screen::~Screen()
+{
+  for (int pl = 0; pl < maxPlanes; pl++)
+    planes[pl]->Release();
+  CopyColour(NULL);
+}
+
+uint64_t *Emulator::Screen::Plane(int pl)
+{
+  planes[pl] = SharedPage::MakeWritable(planes[pl]);
+  return planes[pl]->words;
 }
 
 void Emulator::Screen::Init(Emulator::ChipMode mode)
 {
-  switch (mode) {
-  default:
-  case CHIP8:
-    this->width = 64; this->height = 32;
-    break;
-  case SCHIP:
+  SetHires(mode == SCHIP);
+  CopyColour(NULL);
+  colourOn = false;
+}
+
+void Emulator::Screen::SetHires(bool hires)
+{
+  if (hires) {
     this->width = 128; this->height = 64;
-    break;
   }
-  this->lineSize = width;
-  memory.resize(lineSize*height);
-  Clear();
+  else {
+    this->width = 64; this->height = 32;
+  }
+  this->wordsPerLine = width / 64;
+  Clear((1 << maxPlanes) - 1);
 }
 
-void Emulator::Screen::Clear()
+void Emulator::Screen::Clear(int planeMask)
 {
-  std::fill(memory.begin(), memory.end(), 0);
+  for (int pl = 0; pl < maxPlanes; pl++) {
+    if (planeMask & (1 << pl)) {
+      // a cleared plane shares the zero page, until it is drawn to
+      planes[pl]->Release();
+      planes[pl] = SharedPage::Zero();
+      planeHash[pl] = 0;
+    }
+  }
 }
 
-void Emulator::Screen::SetPixel(int x, int y, bool on)
+void Emulator::Screen::SetPixel(int x, int y, bool on, int plane, bool wrap)
 {
+  if (wrap) {
+    x = ((x % static_cast<int>(width)) + static_cast<int>(width)) % static_cast<int>(width);
+    y = ((y % static_cast<int>(height)) + static_cast<int>(height)) % static_cast<int>(height);
+  }
   if (x < 0 || x >= static_cast<int>(width) ||
     y < 0 || y >= static_cast<int>(height)
     )
   {
-    return;   // todo: check wraparound
+    return;   // clipped
   }
 
+  size_t idx = y*wordsPerLine + x / 64;
+  uint64_t &word = Plane(plane)[idx];
+  uint64_t bit = 0x8000000000000000ULL >> (x % 64);
+  uint64_t old = word;
   if (on)
-    memory[y*lineSize + x] = 1;
+    word |= bit;
   else
-    memory[y*lineSize + x] = 0;
+    word &= ~bit;
+  planeHash[plane] ^= WordChange(plane, idx, old, word);
 }
 
-bool Emulator::Screen::GetPixel(int x, int y)
+bool Emulator::Screen::GetPixel(int x, int y, int plane) const
 {
-  if (x<0 || x>=width || y<0 || y>=height)
+  if (x < 0 || x >= static_cast<int>(width) || y < 0 || y >= static_cast<int>(height))
     return false;
-  if (memory[y*lineSize + x] != 0)
-    return true;
-  else
+  uint64_t word = Plane(plane)[y*wordsPerLine + x / 64];
+  return (word & (0x8000000000000000ULL >> (x % 64))) != 0;
+}
+
+void Emulator::Screen::ScrollHor(int delta, int planeMask)
+{
+  if (delta == 0 || delta >= 64 || delta <= -64)
+    return;
+
+  for (int pl = 0; pl < maxPlanes; pl++) {
+    if (!(planeMask & (1 << pl)))
+      continue;
+    uint64_t *data = Plane(pl);
+    for (size_t y = 0; y < height; y++) {
+      uint64_t *line = &data[y*wordsPerLine];
+      if (delta > 0) {
+        // scroll right: bits move towards the lsb, and into the next word
+        for (size_t w = wordsPerLine; w-- > 0; )
+          line[w] = (line[w] >> delta) | (w > 0 ? line[w - 1] << (64 - delta) : 0);
+      }
+      else {
+        // scroll left
+        for (size_t w = 0; w < wordsPerLine; w++)
+          line[w] = (line[w] << -delta) | (w + 1 < wordsPerLine ? line[w + 1] >> (64 + delta) : 0);
+      }
+    }
+    // every word may have changed, rehashing is as cheap as tracking them
+    planeHash[pl] = PlaneHash(pl);
+  }
+}
+
+void Emulator::Screen::ScrollVer(int delta, int planeMask)
+{
+  if (delta == 0)
+    return;
+  size_t lines = static_cast<size_t>(delta > 0 ? delta : -delta);
+  if (lines > height)
+    lines = height;
+  size_t moved = (height - lines) * wordsPerLine;
+  size_t cleared = lines * wordsPerLine;
+
+  for (int pl = 0; pl < maxPlanes; pl++) {
+    if (!(planeMask & (1 << pl)))
+      continue;
+    uint64_t *data = Plane(pl);
+    if (delta > 0) {
+      // scroll down
+      memmove(data + cleared, data, moved * sizeof(uint64_t));
+      memset(data, 0, cleared * sizeof(uint64_t));
+    }
+    else {
+      // scroll up
+      memmove(data, data + cleared, moved * sizeof(uint64_t));
+      memset(data + moved, 0, cleared * sizeof(uint64_t));
+    }
+    planeHash[pl] = PlaneHash(pl);
+  }
+}
+
+bool Emulator::Screen::DrawSprite(const uint8_t* sprite, int xpos, int ypos, size_t nr_bytes, int planeMask, bool wrap)
+{
+  bool collision = false;
+  if (wrap) {
+    xpos = ((xpos % static_cast<int>(width)) + static_cast<int>(width)) % static_cast<int>(width);
+    ypos = ((ypos % static_cast<int>(height)) + static_cast<int>(height)) % static_cast<int>(height);
+  }
+  if (xpos < 0 || xpos >= static_cast<int>(width))
     return false;
+
+  // a sprite line is placed left aligned in a 64 bit word, then shifted
+  // to its x position. it covers at most two screen words.
+  size_t lines = nr_bytes > 0 ? nr_bytes : 16;
+  size_t spriteWidth = nr_bytes > 0 ? 8 : 16;
+  size_t word = xpos / 64;
+  int shift = xpos % 64;
+  bool spill = shift + spriteWidth > 64 && (word + 1 < wordsPerLine || wrap);
+  size_t spillWord = (word + 1) % wordsPerLine;   // when wrapping, the first word of the line again
+
+  for (int pl = 0; pl < maxPlanes; pl++) {
+    if (!(planeMask & (1 << pl)))
+      continue;
+
+    // every selected plane takes the next block of sprite data
+    uint64_t *data = Plane(pl);
+    uint64_t hash = planeHash[pl];
+    for (size_t line = 0; line < lines; line++)
+    {
+      uint64_t bits = spriteWidth == 8 ?
+        static_cast<uint64_t>(sprite[line]) << 56 :
+        static_cast<uint64_t>((sprite[2 * line] << 8) | sprite[2 * line + 1]) << 48;
+      int y = ypos + static_cast<int>(line);
+      if (wrap)
+        y %= static_cast<int>(height);
+      if (bits == 0 || y < 0 || y >= static_cast<int>(height))
+        continue;   // clipped
+
+      uint64_t *dst = &data[y*wordsPerLine];
+      uint64_t part = bits >> shift;
+      collision |= (dst[word] & part) != 0;
+      hash ^= WordChange(pl, y*wordsPerLine + word, dst[word], dst[word] ^ part);
+      dst[word] ^= part;
+      if (spill) {
+        part = bits << (64 - shift);
+        collision |= (dst[spillWord] & part) != 0;
+        hash ^= WordChange(pl, y*wordsPerLine + spillWord, dst[spillWord], dst[spillWord] ^ part);
+        dst[spillWord] ^= part;
+      }
+    }
+    planeHash[pl] = hash;
+    sprite += lines * spriteWidth / 8;
+  }
+  return collision;
+}
+
+uint64_t Emulator::Screen::PlaneHash(int pl) const
+{
+  const uint64_t *data = Plane(pl);
+  uint64_t hash = 0;
+  for (size_t idx = 0; idx < height * wordsPerLine; idx++)
+    hash ^= WordKey(pl, idx, data[idx]);
+  return hash;
 }
 
-void Emulator::Screen::ScrollHor(int delta)
+uint64_t Emulator::Screen::ComputeHash() const
 {
-  if (delta > 0) {
-    // scroll right
-    for (int x = static_cast<int>(width)-1; x >= delta; x--) {
-      for (int y = 0; y < static_cast<int>(height); y++) {
-        SetPixel(x, y, GetPixel(x - delta, y));
+  uint64_t hash = HashKey(HashScreenSize, width);
+  for (int pl = 0; pl < maxPlanes; pl++)
+    hash ^= PlaneHash(pl);
+  if (colour != NULL)
+    hash ^= ColourHash(true);
+  return hash;
+}
+
+// expands eight pixels of one plane into eight bytes, holding 0 or 1.
+struct ExpandTable {
+  uint64_t bytes[256];
+  ExpandTable() {
+    for (int bt = 0; bt < 256; bt++) {
+      uint8_t px[8];
+      for (int idx = 0; idx < 8; idx++)
+        px[idx] = (bt >> (7 - idx)) & 1;
+      memcpy(&bytes[bt], px, 8);
+    }
+  }
+};
+static const ExpandTable expandTable;
+
+void Emulator::Screen::Render(uint8_t *dst, size_t bytesPerLine) const
+{
+  // the palette index of a pixel is plane0 | plane1 << 1.
+  const uint64_t *plane0 = Plane(0);
+  const uint64_t *plane1 = Plane(1);
+  for (size_t y = 0; y < height; y++) {
+    uint8_t *out = dst + y * bytesPerLine;
+    for (size_t w = 0; w < wordsPerLine; w++) {
+      uint64_t p0 = plane0[y*wordsPerLine + w];
+      uint64_t p1 = plane1[y*wordsPerLine + w];
+      for (int shift = 56; shift >= 0; shift -= 8) {
+        uint64_t px = expandTable.bytes[(p0 >> shift) & 0xFF] | (expandTable.bytes[(p1 >> shift) & 0xFF] << 1);
+        memcpy(out, &px, 8);
+        out += 8;
       }
     }
   }
-  else if (delta < 0)
+}
+
+// the colour screen: back and front buffer, and the palette. a page is
+// hashed as a whole by UpdateColourHash, after a sprite or a scroll drew
+// to it, so the blitter does not pay for the state hash per pixel.
+struct Emulator::Screen::ColourScreen {
+  static const size_t linesPerPage = SharedPage::size / colourWidth;
+  static const size_t nrPages = colourHeight / linesPerPage;
+
+  SharedPage *back[nrPages];
+  SharedPage *front[nrPages];
+  SharedPage *palette;              // 256 colours of 4 bytes, 0xAARRGGBB
+  uint64_t backDigest[nrPages];     // contents of each page, see PageDigest
+  uint64_t frontDigest[nrPages];
+  uint64_t paletteDigest;
+  uint64_t backStale;               // bit n: back page n changed since its digest
+  uint64_t frontStale;
+  bool paletteStale;
+  uint64_t backHash;                // xor of the slot keys of the digests
+  uint64_t frontHash;
+
+  ColourScreen()
   {
-    // scroll left
-    for (int x = 0; x < static_cast<int>(width)-1 + delta; x++) {
-      for (int y = 0; y < static_cast<int>(height); y++) {
-        SetPixel(x, y, GetPixel(x - delta, y));
-      }
+    for (size_t pg = 0; pg < nrPages; pg++) {
+      back[pg] = front[pg] = SharedPage::Zero();
+      backDigest[pg] = frontDigest[pg] = 0;
+    }
+    palette = SharedPage::Zero();
+    paletteDigest = 0;
+    backStale = frontStale = 0;
+    paletteStale = false;
+    backHash = frontHash = 0;
+  }
+};
+
+// contents of a page. zero for a page of zeros, shared or not.
+static uint64_t PageDigest(const SharedPage *page)
+{
+  if (page == SharedPage::Zero())
+    return 0;
+  // four independent lanes, so the multiplies overlap. a page is hashed
+  // after every sprite that draws to it.
+  uint64_t lanes[4] = { 0, 0, 0, 0 };
+  for (size_t idx = 0; idx < SharedPage::size / 8; idx += 4) {
+    for (int ln = 0; ln < 4; ln++) {
+      lanes[ln] = (lanes[ln] ^ page->words[idx + ln]) * 0x9E3779B97F4A7C15ULL;
+      lanes[ln] ^= lanes[ln] >> 32;
     }
   }
+  uint64_t hash = lanes[0];
+  for (int ln = 1; ln < 4; ln++) {
+    hash = (hash ^ lanes[ln]) * 0x9E3779B97F4A7C15ULL;
+    hash ^= hash >> 32;
+  }
+  return hash;
 }
 
-void Emulator::Screen::ScrollVer(int delta)
+void Emulator::Screen::CopyColour(const ColourScreen *other)
 {
-  if (delta > 0) {
-    // scroll down
-    for (int y = static_cast<int>(height)-1; y >= delta; y--)
-      for (int x = 0; x < static_cast<int>(width); x++)
-        SetPixel(x, y, GetPixel(x, y - delta));
+  if (other == NULL) {
+    if (colour != NULL) {
+      ClearColour(true);
+      colour->palette->Release();
+      delete colour;
+      colour = NULL;
+    }
+    return;
   }
-  else if (delta < 0) {
-    // scroll up
-    for (int y = 0; y < static_cast<int>(height)-1 + delta; y++)
-      for (int x = 0; x < static_cast<int>(width); x++)
-        SetPixel(x, y, GetPixel(x, y - delta));
+  if (colour == NULL)
+    colour = new ColourScreen;
+  // new references first, the pages may be the same
+  for (size_t pg = 0; pg < ColourScreen::nrPages; pg++) {
+    other->back[pg]->AddRef();
+    other->front[pg]->AddRef();
   }
+  other->palette->AddRef();
+  ClearColour(true);
+  colour->palette->Release();
+  *colour = *other;
 }
 
-bool Emulator::Screen::DrawSprite(uint8_t* sprite, int xpos, int ypos, size_t nr_bytes)
+void Emulator::Screen::ClearColour(bool front)
 {
-  bool collision = false;
-  if (nr_bytes > 0)
-  {
-    for (size_t line = 0; line < nr_bytes; line++)
-      for (size_t pixel = 0; pixel < 8; pixel++)
-      {
-      if (sprite[line] & (0x80 >> pixel))   // is the pixel set in the sprite?
-      {
-        if (GetPixel(xpos + pixel, ypos + line)) {  // is the pixel set on the screen?
-          // set it to off, this is a collison.
-          SetPixel(xpos + pixel, ypos + line, false);
-          collision = true;
-        }
-        else
-        {
-          // pixel was not yet on, do that now.
-          SetPixel(xpos + pixel, ypos + line, true);
-        }
+  for (size_t pg = 0; pg < ColourScreen::nrPages; pg++) {
+    colour->back[pg]->Release();
+    colour->back[pg] = SharedPage::Zero();
+    colour->backDigest[pg] = 0;
+    if (front) {
+      colour->front[pg]->Release();
+      colour->front[pg] = SharedPage::Zero();
+      colour->frontDigest[pg] = 0;
+    }
+  }
+  colour->backStale = 0;
+  colour->backHash = 0;
+  if (front) {
+    colour->frontStale = 0;
+    colour->frontHash = 0;
+  }
+}
+
+void Emulator::Screen::SetColour(bool on)
+{
+  if (colour == NULL) {
+    if (!on)
+      return;
+    colour = new ColourScreen;
+  }
+  ClearColour(true);
+  colourOn = on;
+}
+
+uint8_t *Emulator::Screen::ColourLine(size_t y)
+{
+  size_t pg = y / ColourScreen::linesPerPage;
+  colour->back[pg] = SharedPage::MakeWritable(colour->back[pg]);
+  colour->backStale |= 1ULL << pg;
+  return colour->back[pg]->bytes + (y % ColourScreen::linesPerPage) * colourWidth;
+}
+
+bool Emulator::Screen::BlitColourLine(int xpos, int ypos, const uint8_t *pixels, size_t count, uint8_t collisionColour)
+{
+  if (!colourOn || ypos < 0 || ypos >= static_cast<int>(colourHeight) || xpos >= static_cast<int>(colourWidth))
+    return false;
+  if (xpos < 0) {
+    if (static_cast<size_t>(-xpos) >= count)
+      return false;
+    pixels += -xpos;
+    count -= -xpos;
+    xpos = 0;
+  }
+  if (count > colourWidth - xpos)
+    count = colourWidth - xpos;
+  return Blitter::BlitLine(ColourLine(ypos) + xpos, pixels, count, collisionColour);
+}
+
+void Emulator::Screen::ScrollColour(int dx, int dy)
+{
+  if (!colourOn)
+    return;
+  if (dy != 0) {
+    // whole lines move, from the far end so none is overwritten before it moved
+    size_t lines = static_cast<size_t>(dy > 0 ? dy : -dy);
+    if (lines > colourHeight)
+      lines = colourHeight;
+    for (size_t idx = 0; idx < colourHeight - lines; idx++) {
+      size_t y = dy > 0 ? colourHeight - 1 - idx : idx;
+      Blitter::MoveLine(ColourLine(y), ColourLine(dy > 0 ? y - lines : y + lines), colourWidth);
+    }
+    for (size_t idx = 0; idx < lines; idx++)
+      Blitter::FillLine(ColourLine(dy > 0 ? idx : colourHeight - 1 - idx), 0, colourWidth);
+  }
+  if (dx != 0) {
+    size_t pixels = static_cast<size_t>(dx > 0 ? dx : -dx);
+    if (pixels > colourWidth)
+      pixels = colourWidth;
+    for (size_t y = 0; y < colourHeight; y++) {
+      uint8_t *line = ColourLine(y);
+      if (dx > 0) {
+        Blitter::MoveLine(line + pixels, line, colourWidth - pixels);
+        Blitter::FillLine(line, 0, pixels);
       }
+      else {
+        Blitter::MoveLine(line, line + pixels, colourWidth - pixels);
+        Blitter::FillLine(line + colourWidth - pixels, 0, pixels);
       }
+    }
+  }
+  UpdateColourHash();
+}
 
+void Emulator::Screen::Present()
+{
+  // the shown frame shares the pages of the back buffer, which starts
+  // over as zero pages: no pixel is copied or cleared.
+  if (!colourOn)
+    return;
+  for (size_t pg = 0; pg < ColourScreen::nrPages; pg++) {
+    SharedPage *old = colour->front[pg];
+    colour->front[pg] = colour->back[pg];
+    colour->back[pg] = SharedPage::Zero();
+    old->Release();
   }
-  return collision;
+  memcpy(colour->frontDigest, colour->backDigest, sizeof(colour->frontDigest));
+  memset(colour->backDigest, 0, sizeof(colour->backDigest));
+  colour->frontStale = colour->backStale;
+  colour->frontHash = colour->backHash;
+  colour->backStale = 0;
+  colour->backHash = 0;
+  UpdateColourHash();
+}
+
+void Emulator::Screen::SetPaletteColour(int idx, uint32_t argb)
+{
+  // roms may load the palette before switching the screen on
+  if (colour == NULL)
+    colour = new ColourScreen;
+  colour->palette = SharedPage::MakeWritable(colour->palette);
+  memcpy(colour->palette->bytes + 4 * (idx & 0xFF), &argb, 4);
+  colour->paletteStale = true;
+}
+
+uint32_t Emulator::Screen::PaletteColour(int idx) const
+{
+  uint32_t argb = 0;
+  if (colour != NULL)
+    memcpy(&argb, colour->palette->bytes + 4 * (idx & 0xFF), 4);
+  return argb;
+}
+
+void Emulator::Screen::RenderColour(uint8_t *dst, size_t bytesPerLine) const
+{
+  for (size_t y = 0; y < colourHeight; y++) {
+    const SharedPage *page = colour != NULL ? colour->front[y / ColourScreen::linesPerPage] : SharedPage::Zero();
+    memcpy(dst + y * bytesPerLine, page->bytes + (y % ColourScreen::linesPerPage) * colourWidth, colourWidth);
+  }
+}
+
+void Emulator::Screen::UpdateColourHash()
+{
+  // only the pages drawn to since the last update are hashed again
+  if (colour == NULL)
+    return;
+  ColourScreen &cs = *colour;
+  for (size_t pg = 0; pg < ColourScreen::nrPages; pg++) {
+    if (cs.backStale & (1ULL << pg)) {
+      uint64_t digest = PageDigest(cs.back[pg]);
+      cs.backHash ^= HashKey(HashColour + pg, cs.backDigest[pg]) ^ HashKey(HashColour + pg, digest);
+      cs.backDigest[pg] = digest;
+    }
+    if (cs.frontStale & (1ULL << pg)) {
+      uint64_t digest = PageDigest(cs.front[pg]);
+      cs.frontHash ^= HashKey(HashColour + pg, cs.frontDigest[pg]) ^ HashKey(HashColour + pg, digest);
+      cs.frontDigest[pg] = digest;
+    }
+  }
+  if (cs.paletteStale)
+    cs.paletteDigest = PageDigest(cs.palette);
+  cs.backStale = cs.frontStale = 0;
+  cs.paletteStale = false;
+}
+
+uint64_t Emulator::Screen::ColourHash(bool fromPixels) const
+{
+  // the kept digests, or all of them computed again. the front buffer is
+  // a copy of an earlier back buffer, so its keys are mixed once more to
+  // tell the two apart.
+  const ColourScreen &cs = *colour;
+  uint64_t backHash = cs.backHash, frontHash = cs.frontHash, paletteDigest = cs.paletteDigest;
+  if (fromPixels) {
+    backHash = frontHash = 0;
+    for (size_t pg = 0; pg < ColourScreen::nrPages; pg++) {
+      backHash ^= HashKey(HashColour + pg, PageDigest(cs.back[pg]));
+      frontHash ^= HashKey(HashColour + pg, PageDigest(cs.front[pg]));
+    }
+    paletteDigest = PageDigest(cs.palette);
+  }
+  return backHash ^ (frontHash != 0 ? HashMix(frontHash ^ HashFrontBuffer) : 0) ^
+    HashKey(HashPalette, paletteDigest) ^ HashKey(HashColourOn, colourOn);
 }
 
 
@@ -131,13 +573,75 @@ bool Emulator::Screen::DrawSprite(uint8_t* sprite, int xpos, int ypos, size_t nr
 // Emulator class
 
 Emulator::Emulator(void)
+: pages(smallPages), nrPages(0), tracer(NULL), analysis(NULL)
 {
+  for (size_t pg = 0; pg < nrMemoryPages; pg++)
+    smallPages[pg] = SharedPage::Zero();
+  quirks = 0;
+  hashCheck = false;
   Init(CHIP8);
 }
 
+Emulator::Emulator(const Emulator &other)
+: pages(smallPages), nrPages(0), tracer(NULL), analysis(NULL)
+{
+  for (size_t pg = 0; pg < nrMemoryPages; pg++)
+    smallPages[pg] = SharedPage::Zero();
+  other.Fork(*this);
+}
+
+Emulator &Emulator::operator=(const Emulator &other)
+{
+  if (this != &other)
+    other.Fork(*this);
+  return *this;
+}
 
 Emulator::~Emulator(void)
 {
+  ReleasePages();
+  SetPageTable(0);
+}
+
+void Emulator::ReleasePages()
+{
+  for (size_t pg = 0; pg < nrPages; pg++) {
+    pages[pg]->Release();
+    pages[pg] = SharedPage::Zero();
+  }
+  nrPages = 0;
+}
+
+void Emulator::SetPageTable(size_t count)
+{
+  // the megachip table stays while the emulator runs megachip, forks
+  // into it reuse it. pages must be released.
+  if (count > nrMemoryPages && pages == smallPages) {
+    pages = new SharedPage *[megaMemorySize / SharedPage::size];
+    for (size_t pg = 0; pg < megaMemorySize / SharedPage::size; pg++)
+      pages[pg] = SharedPage::Zero();
+  }
+  else if (count <= nrMemoryPages && pages != smallPages) {
+    delete[] pages;
+    pages = smallPages;
+  }
+}
+
+void Emulator::Fork(Emulator &child) const
+{
+  // take the new references before dropping the old ones, the child may
+  // already share pages with this emulator.
+  for (size_t pg = 0; pg < nrPages; pg++)
+    pages[pg]->AddRef();
+  child.ReleasePages();
+  child.SetPageTable(memoryLimit / SharedPage::size);
+  memcpy(child.pages, pages, nrPages * sizeof(pages[0]));
+  child.nrPages = nrPages;
+
+  static_cast<EmulatorCore &>(child) = *this;
+  child.SCR = SCR;
+  child.tracer = NULL;
+  child.analysis = analysis;
 }
 
 void Emulator::Init(ChipMode m)
@@ -146,8 +650,16 @@ void Emulator::Init(ChipMode m)
 
   SCR.Init(mode);
 
-  // zero all memory and registers
-  memset(memory, 0, memorySize);
+  // zero all memory and registers. memory starts out as zero pages, so
+  // classic roms do not pay for the 64k of xo-chip.
+  memoryLimit = mode == XOCHIP ? memorySize : (mode == MEGACHIP ? megaMemorySize : 4096);
+  memoryMask = static_cast<uint32_t>(memoryLimit - 1);
+  ReleasePages();
+  stateHash = 0;                    // zeroed memory, the registers are added below
+  analysis = NULL;
+  idleLoopsValid = 0;
+  codeDirtyPages = 0;
+  SetPageTable(memoryLimit / SharedPage::size);
   memset(V, 0, nrRegisters);
   I = 0;
 
@@ -155,7 +667,7 @@ void Emulator::Init(ChipMode m)
   PC = 0x200;
 
   // make stack empty
-  memset(stack, 0, _countof(stack));
+  memset(stack, 0, sizeof(stack));
   SP = 0;
 
   // reset HP48 flags
@@ -169,10 +681,21 @@ void Emulator::Init(ChipMode m)
   {
     for (size_t bt = 0; bt < 5; ++bt)
     {
-      memory[offset++] = chip8_font[sind][bt];
+      WriteMemory(static_cast<uint32_t>(offset++), chip8_font[sind][bt]);
     }
   }
 
+  // xo-chip
+  planes = 1;
+  memset(audioPattern, 0, sizeof(audioPattern));
+  pitch = 64;
+
+  // megachip
+  spriteWidth = spriteHeight = 16;
+  collisionColour = 0;
+  blendMode = 0;
+  screenAlpha = 0xFF;
+
   // timers
   DT = ST = 0;
 
@@ -183,25 +706,210 @@ void Emulator::Init(ChipMode m)
   errorOccured = false;
   exitCalled = false;
   screenInvalidated = false;
-  errorMessage.clear();
+  errorType = ErrorNone;
+  errorPC = 0;
+  errorArg = 0;
 
   // randomizer. set to fixed seed for easier debugging.
-  srand(42);
+  randomState = 42;
+
+  stateHash ^= RegisterHash();
 }
 
 
 void Emulator::storeProgram(uint8_t* data, size_t len)
 {
-  if (len <= (4096 - 512))
+  if (len <= (memoryLimit - 512))
   {
-    std::memcpy(&memory[0x200], data, len);
+    for (size_t idx = 0; idx < len; idx++)
+      WriteMemory(static_cast<uint32_t>(0x200 + idx), data[idx]);
   }
 }
 
-void Emulator::SetError(const wchar_t *szText)
+void Emulator::WriteMemory(uint32_t addr, uint8_t value)
+{
+  addr &= memoryMask;
+  SharedPage *&page = pages[addr >> SharedPage::shift];
+  page = SharedPage::MakeWritable(page);
+  if ((addr >> SharedPage::shift) >= nrPages)
+    nrPages = (addr >> SharedPage::shift) + 1;
+  uint8_t &cell = page->bytes[addr & (SharedPage::size - 1)];
+  HashChange(HashMemory + addr, cell, value);
+  cell = value;
+  if (analysis != NULL && addr < memorySize)
+    InvalidateCode(static_cast<uint16_t>(addr));
+}
+
+uint64_t Emulator::HashWords(uint64_t slot, const void *data, size_t words)
 {
+  uint64_t hash = 0;
+  for (size_t idx = 0; idx < words; idx++) {
+    uint64_t word;
+    memcpy(&word, static_cast<const uint8_t *>(data) + idx * 8, 8);
+    hash ^= HashKey(slot + idx, word);
+  }
+  return hash;
+}
+
+uint64_t Emulator::RegisterHash() const
+{
+  uint64_t hash = HashKey(HashDT, DT) ^ HashKey(HashST, ST) ^ HashWords(HashHP48, HP48, 1);
+  for (size_t idx = 0; idx < stackSize; idx++)
+    hash ^= HashKey(HashStack + idx, stack[idx]);
+  hash ^= HashKey(HashPlanes, planes) ^ HashKey(HashPitch, pitch) ^ HashWords(HashAudio, audioPattern, 2);
+  hash ^= HashKey(HashKeys, keys) ^ HashKey(HashRandom, randomState) ^ HashKey(HashMode, mode) ^ HashKey(HashQuirks, quirks);
+  hash ^= HashKey(HashMegaChip, MegaChipWord());
+  return hash;
+}
+
+uint64_t Emulator::ComputeStateHash() const
+{
+  uint64_t hash = RegisterHash() ^ HotRegisterHash() ^ SCR.ComputeHash();
+  for (size_t pg = 0; pg < nrPages; pg++) {
+    if (pages[pg] == SharedPage::Zero())
+      continue;
+    for (size_t idx = 0; idx < SharedPage::size; idx++)
+      hash ^= HashKey(HashMemory + pg * SharedPage::size + idx, pages[pg]->bytes[idx]);
+  }
+  return hash;
+}
+
+void Emulator::CheckStateHash()
+{
+  uint64_t full = ComputeStateHash();
+  if (StateHash() == full)
+    return;
+  Metrics::Add(MetricStateHashMismatches);
+  stateHash ^= StateHash() ^ full;  // counts every faulty change once
+}
+
+void Emulator::SetAnalysis(const CodeAnalysis *a)
+{
+  analysis = a;
+  size_t nrLoops = a != NULL ? a->NrIdleLoops() : 0;
+  idleLoopsValid = nrLoops < 32 ? (1u << nrLoops) - 1 : ~0u;
+  codeDirtyPages = 0;
+}
+
+void Emulator::InvalidateCode(uint16_t addr)
+{
+  // self modifying code: drop what the analysis knows about the address
+  if (!(analysis->Flags(addr) & CodeAnalysis::FlagCode))
+    return;
+  codeDirtyPages |= 1ULL << (addr >> SharedPage::shift);
+  const CodeAnalysis::IdleLoop *loops = analysis->IdleLoops();
+  for (size_t idx = 0; idx < analysis->NrIdleLoops(); idx++)
+    if (addr >= loops[idx].start && addr < loops[idx].end)
+      idleLoopsValid &= ~(1u << idx);
+}
+
+const uint8_t *Emulator::MemoryBlock(uint32_t addr, size_t len, uint8_t *scratch) const
+{
+  // returns a pointer into the page if the block does not cross a page
+  // boundary or the end of memory, otherwise gathers it into scratch.
+  addr &= memoryMask;
+  size_t offset = addr & (SharedPage::size - 1);
+  if (offset + len <= SharedPage::size)
+    return &pages[addr >> SharedPage::shift]->bytes[offset];
+  for (size_t idx = 0; idx < len; idx++)
+    scratch[idx] = ReadMemory(static_cast<uint32_t>(addr + idx));
+  return scratch;
+}
+
+void Emulator::CopyMemory(uint8_t *dst, size_t addr, size_t len) const
+{
+  // page by page, untouched pages copy the zero page
+  while (len > 0 && addr < memoryLimit) {
+    size_t offset = addr & (SharedPage::size - 1);
+    size_t chunk = SharedPage::size - offset;
+    if (chunk > len)
+      chunk = len;
+    memcpy(dst, &pages[addr >> SharedPage::shift]->bytes[offset], chunk);
+    dst += chunk;
+    addr += chunk;
+    len -= chunk;
+  }
+}
+
+uint8_t Emulator::Random()
+{
+  // xorshift32
+  uint32_t x = randomState;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  HashChange(HashRandom, randomState, x);
+  randomState = x;
+  return static_cast<uint8_t>(x >> 24);
+}
+
+void Emulator::Seed(uint32_t seed)
+{
+  // spread the seed over all bits. xorshift must not start at zero.
+  uint32_t state = (seed ^ 0x9E3779B9u) * 2654435761u;
+  if (state == 0)
+    state = 42;
+  HashChange(HashRandom, randomState, state);
+  randomState = state;
+}
+
+void Emulator::SetQuirks(int bits)
+{
+  uint8_t value = static_cast<uint8_t>(bits & (nrQuirkProfiles - 1));
+  HashChange(HashQuirks, quirks, value);
+  quirks = value;
+}
+
+void Emulator::SetError(ErrorType type, uint16_t arg)
+{
+  Metrics::Add(static_cast<Metric>(MetricErrors + type));
   errorOccured = true;
-  errorMessage = szText;
+  errorType = type;
+  errorPC = PC;
+  errorArg = arg;
+}
+
+std::wstring Emulator::ErrorMessage() const
+{
+  std::wstringstream ss;
+  ss << std::hex << std::showbase;
+  switch (errorType) {
+  case ErrorNone:
+    break;
+  case ErrorStackUnderflow:
+    ss << "Stack underflow at PC=" << std::setw(4) << errorPC;
+    break;
+  case ErrorStackOverflow:
+    ss << "Stack overflow at PC=" << std::setw(4) << errorPC;
+    break;
+  case ErrorMemoryOverflow:
+    ss << "Memory overflow at PC=" << std::setw(4) << errorPC;
+    break;
+  case ErrorHP48Flags:
+    ss << "HP48 flag " << std::dec << errorArg << std::hex << " accessed at PC=" << std::setw(4) << errorPC;
+    break;
+  case ErrorQuit:
+    ss << "Quit (00FD) called.";
+    break;
+  default:
+  case ErrorInvalidInstruction:
+    ss << "Unsupported instruction " << std::setw(4) << errorArg << " at PC=" << errorPC;
+    break;
+  }
+  return ss.str();
+}
+
+void Emulator::SkipNextInstruction()
+{
+  // called while PC still points to the current instruction. the long
+  // loads F000 NNNN of xo-chip and 01NN NNNN of megachip are skipped as a
+  // whole.
+  uint16_t next = PC + 2;
+  if ((mode == XOCHIP && ReadMemory(next) == 0xF0 && ReadMemory(next + 1) == 0x00) ||
+    (mode == MEGACHIP && ReadMemory(next) == 0x01))
+    PC += 4;
+  else
+    PC += 2;
 }
 
 bool Emulator::ScreenIsInvalidated(bool reset/*=true*/)
@@ -217,6 +925,7 @@ void Emulator::DoInstruction()
 {
   uint16_t instruction;
   int parmX, parmY, parmN, parmKK;
+  uint8_t scratch[64];                  // memory blocks that cross a page boundary
 
   bool incrementPC = true;              // code sets this false if the program counter (PC)
   // should not be increased, for example if a jump is executed
@@ -225,23 +934,28 @@ void Emulator::DoInstruction()
 
   // execute the instruction at memory[SP].
   // instructions are 16 bit, stored as MSB-LSB.
-  instruction = (memory[PC] << 8) | memory[PC + 1];
+  instruction = (ReadMemory(PC) << 8) | ReadMemory(PC + 1);
+  uint16_t instructionPC = PC;
+
+  if (tracer)
+    tracer->BeginInstruction(V, I);
 
   switch (instruction & 0xF000) {
   case 0x0000: // 00XX, several instructions
     switch (instruction & 0x0FFF)
     {
-    case 0x00E0:  //00E0 Erase the screen
-      SCR.Clear();
+    case 0x00E0:  //00E0 Erase the screen. megachip shows the drawn frame, then erases.
+      if (SCR.IsColour())
+        SCR.Present();
+      else
+        SCR.Clear(planes);
       SetScreenInvalidated();
       break;
 
     case 0x00EE:  //00EE Return from a CHIP-8 sub-routine
       if (SP == 0) {
         // stack underflow
-        std::wstringstream ss;
-        ss << std::hex << std::setw(4) << std::showbase << "Stack underflow, PC=" << SP;
-        SetError(ss.str().c_str());
+        SetError(ErrorStackUnderflow);
       }
       else
       {
@@ -254,28 +968,46 @@ void Emulator::DoInstruction()
 
 
     case 0x00FB:  //00FB Scroll 4 pixels right (***)
-      SCR.ScrollHor(+4);
+      if (SCR.IsColour())
+        SCR.ScrollColour(+4, 0);
+      else
+        SCR.ScrollHor(+4, planes);
       SetScreenInvalidated();
       break;
 
     case 0x00FC:  //00FC Scroll 4 pixels left (***)
-      SCR.ScrollHor(-4);
+      if (SCR.IsColour())
+        SCR.ScrollColour(-4, 0);
+      else
+        SCR.ScrollHor(-4, planes);
       SetScreenInvalidated();
       break;
 
     case 0x00FD:  //00FD Quit the emulator (***)
-      SetError(L"Quit (00FD) called.");
+      SetError(ErrorQuit);
       break;
 
     case 0x00FE:  //00FE Set CHIP-8 graphic mode (***)
-      mode = CHIP8;
-      SCR.Init(mode);
+      if (mode == XOCHIP || mode == MEGACHIP) {
+        SCR.SetHires(false);
+      }
+      else {
+        HashChange(HashMode, mode, CHIP8);
+        mode = CHIP8;
+        SCR.Init(mode);
+      }
       SetScreenInvalidated();
       break;
 
     case 0x00FF:  //00FF Set SCHIP graphic mode (***)
-      mode = SCHIP;
-      SCR.Init(mode);
+      if (mode == XOCHIP || mode == MEGACHIP) {
+        SCR.SetHires(true);
+      }
+      else {
+        HashChange(HashMode, mode, SCHIP);
+        mode = SCHIP;
+        SCR.Init(mode);
+      }
       SetScreenInvalidated();
       break;
 
@@ -283,9 +1015,22 @@ void Emulator::DoInstruction()
       if ((instruction & 0x0FF0) == 0x00C0)
       {
         // 00CN Scroll down N lines (***)
-        SCR.ScrollVer(instruction & 0x000F);
+        if (SCR.IsColour())
+          SCR.ScrollColour(0, instruction & 0x000F);
+        else
+          SCR.ScrollVer(instruction & 0x000F, planes);
+        screenInvalidated = true;
+      }
+      else if (mode == XOCHIP && (instruction & 0x0FF0) == 0x00D0)
+      {
+        // 00DN Scroll up N lines (xo-chip)
+        SCR.ScrollVer(-(instruction & 0x000F), planes);
         screenInvalidated = true;
       }
+      else if (mode == MEGACHIP && MegaChipInstruction(instruction))
+      {
+        // 0010, 0011, 00BN, 01NN NNNN and 02NN..09NN (megachip)
+      }
       else
       {
         invalidInstruction = true;
@@ -301,14 +1046,13 @@ void Emulator::DoInstruction()
 
   case 0x2000:  // 2NNN Call CHIP-8 sub-routine at NNN (16 successive calls max)
     if (SP >= stackSize) {
-      std::wstringstream ss;
-      ss << "Stack overflow at PC=" << std::hex << std::showbase << std::setw(4) << SP;
-      SetError(ss.str().c_str());
+      SetError(ErrorStackOverflow);
     }
     else
     {
       // store current program counter an the stack
       // and jump to location provided in lower 3 nibbles of instruction
+      HashChange(HashStack + SP, stack[SP], PC);
       stack[SP++] = PC;
       PC = instruction & 0x0FFF;
       incrementPC = false;
@@ -320,7 +1064,7 @@ void Emulator::DoInstruction()
     parmKK = (instruction & 0x00FF);
     if (V[parmX] == parmKK)
     {
-      PC += 2;
+      SkipNextInstruction();
     }
     break;
 
@@ -329,7 +1073,7 @@ void Emulator::DoInstruction()
     parmKK = (instruction & 0x00FF);
     if (V[parmX] != parmKK)
     {
-      PC += 2;
+      SkipNextInstruction();
     }
     break;
 
@@ -341,7 +1085,39 @@ void Emulator::DoInstruction()
       parmY = (instruction & 0x00F0) >> 4;
       if (V[parmX] == V[parmY])
       {
-        PC += 2;
+        SkipNextInstruction();
+      }
+      break;
+
+    case 0x2:  //5XY2 Save VX..VY in memory starting at M(I) (xo-chip)
+    case 0x3:  //5XY3 Load VX..VY from memory starting at M(I) (xo-chip)
+      if (mode != XOCHIP) {
+        invalidInstruction = true;
+        break;
+      }
+      parmX = (instruction & 0x0F00) >> 8;
+      parmY = (instruction & 0x00F0) >> 4;
+      parmN = (parmX < parmY ? parmY - parmX : parmX - parmY) + 1;
+      if (I + parmN > memoryLimit)
+      {
+        SetError(ErrorMemoryOverflow);
+      }
+      else
+      {
+        // registers are stored in the order given, so X > Y is reversed
+        int step = parmX < parmY ? 1 : -1;
+        uint8_t saved[nrRegisters];
+        for (int idx = 0; idx < parmN; idx++) {
+          if ((instruction & 0x000F) == 0x2) {
+            saved[idx] = V[parmX + idx * step];
+            WriteMemory(I + idx, saved[idx]);
+          }
+          else {
+            V[parmX + idx * step] = ReadMemory(I + idx);
+          }
+        }
+        if (tracer && (instruction & 0x000F) == 0x2)
+          tracer->MemoryWrite(I, saved, parmN);
       }
       break;
 
@@ -409,6 +1185,8 @@ void Emulator::DoInstruction()
     case 0x6:  //8XY6 VX = VX SHR 1 (VX=VX/2), VF = carry
       parmX = (instruction & 0x0F00) >> 8;
       parmY = (instruction & 0x00F0) >> 4;
+      if (quirks & QuirkShiftVY)
+        V[parmX] = V[parmY];
       V[0xF] = V[parmX] & 0x01 ? 1 : 0;   // shift LSB out to VF
       V[parmX] = V[parmX] >> 1;
       break;
@@ -424,6 +1202,8 @@ void Emulator::DoInstruction()
     case 0xE:  //8XYE VX = VX SHL 1 (VX=VX*2), VF = carry
       parmX = (instruction & 0x0F00) >> 8;
       parmY = (instruction & 0x00F0) >> 4;
+      if (quirks & QuirkShiftVY)
+        V[parmX] = V[parmY];
       V[0xF] = V[parmX] & 0x80 ? 1 : 0;   // shift LSB out to VF
       V[parmX] = V[parmX] << 1;
       break;
@@ -442,7 +1222,7 @@ void Emulator::DoInstruction()
       parmY = (instruction & 0x00F0) >> 4;
       if (V[parmX] != V[parmY])
       {
-        PC += 2;
+        SkipNextInstruction();
       }
       break;
 
@@ -457,26 +1237,31 @@ void Emulator::DoInstruction()
     I = instruction & 0x0FFF;
     break;
 
-  case 0xB000:  //BNNN Jump to NNN + V0
-    PC = (instruction & 0x0FFF) + V[0x0];
+  case 0xB000:  //BNNN Jump to NNN + V0, or XNN + VX
+    PC = (instruction & 0x0FFF) + V[(quirks & QuirkJumpVX) ? (instruction & 0x0F00) >> 8 : 0x0];
     incrementPC = false;
     break;
 
   case 0xC000:  //CXKK VX = Random number AND KK
     parmX = (instruction & 0x0F00) >> 8;
     parmKK = (instruction & 0x00FF);
-    V[parmX] = rand() & parmKK;
+    V[parmX] = Random() & parmKK;
     break;
 
   case 0xD000:  //DXYN Draws a sprite at (VX,VY) starting at M(I). VF = collision.
-    //If N=0, draws the 16 x 16 sprite, else an 8 x N sprite.
+    //If N=0, draws the 16 x 16 sprite, else an 8 x N sprite. on the megachip
+    //colour screen, a sprite of the size set by 03NN and 04NN.
     parmX = (instruction & 0x0F00) >> 8;
     parmY = (instruction & 0x00F0) >> 4;
     parmN = (instruction & 0x000F);
-    if (SCR.DrawSprite(
-      &memory[I],                     // memory location of sprite to draw
+    // sprite size in bytes: every selected plane has its own data
+    parmKK = (parmN > 0 ? parmN : 32) * ((planes & 1) + ((planes >> 1) & 1));
+    if (SCR.IsColour() ? DrawColourSprite(V[parmX], V[parmY]) : SCR.DrawSprite(
+      MemoryBlock(I, parmKK, scratch),  // memory location of sprite to draw
       V[parmX], V[parmY],             // position on screen
-      parmN))                       // byte size of sprite. if 0, sprite is 16x16
+      parmN,                          // byte size of sprite. if 0, sprite is 16x16
+      planes,                         // bitplanes to draw in
+      (quirks & QuirkWrapSprites) != 0))
     {
       // there was a collision.
       V[0xF] = 1;
@@ -485,7 +1270,9 @@ void Emulator::DoInstruction()
     {
       V[0xF] = 0;
     }
-    screenInvalidated = true;
+    // colour sprites are shown by the next 00E0
+    if (!SCR.IsColour())
+      screenInvalidated = true;
     break;
 
   case 0xE000:
@@ -495,7 +1282,7 @@ void Emulator::DoInstruction()
       parmX = (instruction & 0x0F00) >> 8;
       if (IsKeyPressed(V[parmX]))
       {
-        PC += 2;
+        SkipNextInstruction();
       }
       break;
 
@@ -503,7 +1290,7 @@ void Emulator::DoInstruction()
       parmX = (instruction & 0x0F00) >> 8;
       if (!IsKeyPressed(V[parmX]))
       {
-        PC += 2;
+        SkipNextInstruction();
       }
       break;
 
@@ -516,6 +1303,35 @@ void Emulator::DoInstruction()
   case 0xF000:
     switch (instruction & 0x00FF)
     {
+    case 0x00: //F000 NNNN I = NNNN (xo-chip)
+      if (mode != XOCHIP || (instruction & 0x0F00) != 0) {
+        invalidInstruction = true;
+        break;
+      }
+      I = (ReadMemory(PC + 2) << 8) | ReadMemory(PC + 3);
+      PC += 2;                          // skip the address word
+      break;
+
+    case 0x01: //FN01 Select bitplanes N (xo-chip)
+      if (mode != XOCHIP) {
+        invalidInstruction = true;
+        break;
+      }
+      HashChange(HashPlanes, planes, ((instruction & 0x0F00) >> 8) & ((1 << Screen::maxPlanes) - 1));
+      planes = (instruction & 0x0F00) >> 8;
+      planes &= (1 << Screen::maxPlanes) - 1;
+      break;
+
+    case 0x02: //F002 Load audio pattern from M(I)..M(I+15) (xo-chip)
+      if (mode != XOCHIP || (instruction & 0x0F00) != 0) {
+        invalidInstruction = true;
+        break;
+      }
+      stateHash ^= HashWords(HashAudio, audioPattern, 2);
+      memcpy(audioPattern, MemoryBlock(I, sizeof(audioPattern), scratch), sizeof(audioPattern));
+      stateHash ^= HashWords(HashAudio, audioPattern, 2);
+      break;
+
     case 0x07: //FX07 VX = Delay timer
       parmX = (instruction & 0x0F00) >> 8;
       V[parmX] = DT;
@@ -526,19 +1342,31 @@ void Emulator::DoInstruction()
 
       break;
 
+    case 0x3A:  //FX3A Audio pitch = VX (xo-chip)
+      if (mode != XOCHIP) {
+        invalidInstruction = true;
+        break;
+      }
+      parmX = (instruction & 0x0F00) >> 8;
+      HashChange(HashPitch, pitch, V[parmX]);
+      pitch = V[parmX];
+      break;
+
     case 0x15:  //FX15 Delay timer = VX
       parmX = (instruction & 0x0F00) >> 8;
+      HashChange(HashDT, DT, V[parmX]);
       DT = V[parmX];
       break;
 
     case 0x18:  //FX18 Sound timer = VX
       parmX = (instruction & 0x0F00) >> 8;
+      HashChange(HashST, ST, V[parmX]);
       ST = V[parmX];
       break;
 
     case 0x1E:  //FX1E I = I + VX
       parmX = (instruction & 0x0F00) >> 8;
-      I += V[parmX];
+      AddI(V[parmX]);
       break;
 
     case 0x29: //FX29 I points to the 4 x 5 font sprite of hex char in VX
@@ -549,38 +1377,47 @@ void Emulator::DoInstruction()
     case 0x33:  //FX33 Store BCD representation of VX in M(I)M(I+2)
       parmX = (instruction & 0x0F00) >> 8;
       parmKK = V[parmX];
-      memory[I] = parmKK % 100; parmKK -= parmKK % 100;
-      memory[I + 1] = parmKK % 10; parmKK -= parmKK % 10;
-      memory[I + 2] = parmKK;
+      {
+        uint8_t bcd[3];
+        bcd[0] = parmKK % 100; parmKK -= parmKK % 100;
+        bcd[1] = parmKK % 10; parmKK -= parmKK % 10;
+        bcd[2] = parmKK;
+        for (int idx = 0; idx < 3; idx++)
+          WriteMemory(I + idx, bcd[idx]);
+        if (tracer)
+          tracer->MemoryWrite(I, bcd, 3);
+      }
       break;
 
     case 0x55: //FX55 Save V0VX in memory starting at M(I)
       parmX = (instruction & 0x0F00) >> 8;
-      if (I + parmX >= memorySize)
+      if (I + parmX >= memoryLimit)
       {
-        std::wstringstream ss;
-        ss << "Memory overflow at PC=" << std::hex << std::showbase << std::setw(4) << SP;
-        SetError(ss.str().c_str());
+        SetError(ErrorMemoryOverflow);
       }
       else
       {
         for (int idx = 0; idx <= parmX; idx++)
-          memory[I + idx] = V[idx];
+          WriteMemory(I + idx, V[idx]);
+        if (tracer)
+          tracer->MemoryWrite(I, V, parmX + 1);
+        if (quirks & QuirkIncrementI)
+          AddI(parmX + 1);
       }
       break;
 
     case 0x65:  //FX65 Load V0VX from memory starting at M(I)
       parmX = (instruction & 0x0F00) >> 8;
-      if (I + parmX >= memorySize)
+      if (I + parmX >= memoryLimit)
       {
-        std::wstringstream ss;
-        ss << "Memory overflow at PC=" << std::hex << std::showbase << std::setw(4) << SP;
-        SetError(ss.str().c_str());
+        SetError(ErrorMemoryOverflow);
       }
       else
       {
         for (int idx = 0; idx <= parmX; idx++)
-          V[idx] = memory[I + idx];
+          V[idx] = ReadMemory(I + idx);
+        if (quirks & QuirkIncrementI)
+          AddI(parmX + 1);
       }
       break;
 
@@ -588,31 +1425,28 @@ void Emulator::DoInstruction()
       parmX = (instruction & 0x0F00) >> 8;
       if (parmX >= nrHPFlags)
       {
-        std::wstringstream ss;
-        ss << "HP48 flag " << parmX << "being written at PC=" << std::hex << std::showbase << std::setw(4) << SP;
-        SetError(ss.str().c_str());
+        SetError(ErrorHP48Flags, parmX);
       }
       else
       {
+        stateHash ^= HashWords(HashHP48, HP48, 1);
         for (int idx = 0; idx <= parmX; idx++)
           HP48[idx] = V[idx];
+        stateHash ^= HashWords(HashHP48, HP48, 1);
       }
       break;
 
     case 0x85:  //FX85 Load V0VX (X<8) from the HP48 flags (***)
       parmX = (instruction & 0x0F00) >> 8;
-      if (I + parmX >= memorySize)
-        if (parmX >= nrHPFlags)
-        {
-        std::wstringstream ss;
-        ss << "HP48 flag " << parmX << "being read at PC=" << std::hex << std::showbase << std::setw(4) << SP;
-        SetError(ss.str().c_str());
-        }
-        else
-        {
-          for (int idx = 0; idx <= parmX; idx++)
-            V[idx] = HP48[idx];
-        }
+      if (parmX >= nrHPFlags)
+      {
+        SetError(ErrorHP48Flags, parmX);
+      }
+      else
+      {
+        for (int idx = 0; idx <= parmX; idx++)
+          V[idx] = HP48[idx];
+      }
       break;
 
     default:
@@ -624,9 +1458,7 @@ void Emulator::DoInstruction()
 
   if (invalidInstruction)
   {
-    std::wstringstream ss;
-    ss << "Unsupported instruction " << std::hex << std::showbase << std::setw(4) << instruction << " at PC=" << SP;
-    SetError(ss.str().c_str());
+    SetError(ErrorInvalidInstruction, instruction);
   }
   else
   {
@@ -636,7 +1468,11 @@ void Emulator::DoInstruction()
     }
   }
 
+  if (hashCheck)
+    CheckStateHash();
 
+  if (tracer)
+    tracer->EndInstruction(instructionPC, instruction, V, I);
 
   // Handle timers. The delay timer DT and the sound timer DS
   // both count down at 60 Hz, if they are set by code.
@@ -651,22 +1487,150 @@ void Emulator::DoInstruction()
   //}
 }
 
+bool Emulator::MegaChipInstruction(uint16_t instruction)
+{
+  int parmNN = instruction & 0x00FF;
+  uint64_t oldState = MegaChipWord();
+  switch (instruction & 0x0F00) {
+  case 0x0000:
+    if (instruction == 0x0010 || instruction == 0x0011) {
+      //0010 Megachip mode off, 0011 on. both clear the colour screen.
+      SCR.SetColour(instruction == 0x0011);
+      SetScreenInvalidated();
+      return true;
+    }
+    if ((instruction & 0x00F0) == 0x00B0) {
+      //00BN Scroll up N lines
+      if (SCR.IsColour())
+        SCR.ScrollColour(0, -(instruction & 0x000F));
+      else
+        SCR.ScrollVer(-(instruction & 0x000F), planes);
+      SetScreenInvalidated();
+      return true;
+    }
+    return false;
+
+  case 0x0100:  //01NN NNNN I = NNNNNN
+    I = (parmNN << 16) | (ReadMemory(PC + 2) << 8) | ReadMemory(PC + 3);
+    PC += 2;                            // skip the address word
+    return true;
+
+  case 0x0200:  //02NN Load colours 1..NN from M(I), 4 bytes each: alpha, red, green, blue
+    for (int idx = 0; idx < parmNN; idx++) {
+      uint8_t scratch[4];
+      const uint8_t *argb = MemoryBlock(I + 4 * idx, 4, scratch);
+      SCR.SetPaletteColour(idx + 1, static_cast<uint32_t>(argb[0]) << 24 | argb[1] << 16 | argb[2] << 8 | argb[3]);
+    }
+    SCR.UpdateColourHash();
+    return true;
+
+  case 0x0300:  //03NN Sprite width NN, 0 is 256
+    spriteWidth = parmNN > 0 ? parmNN : 256;
+    break;
+
+  case 0x0400:  //04NN Sprite height NN, 0 is 256
+    spriteHeight = parmNN > 0 ? parmNN : 256;
+    break;
+
+  case 0x0500:  //05NN Screen alpha NN
+    screenAlpha = static_cast<uint8_t>(parmNN);
+    break;
+
+  case 0x0600:  //060N Play digitised sound at M(I). not supported, the sound timer still beeps.
+  case 0x0700:  //0700 Stop digitised sound
+    return true;
+
+  case 0x0800:  //080N Sprite blend mode N
+    blendMode = static_cast<uint8_t>(parmNN & 0x0F);
+    break;
+
+  case 0x0900:  //09NN Collision colour NN
+    collisionColour = static_cast<uint8_t>(parmNN);
+    break;
+
+  default:
+    return false;
+  }
+  HashChange(HashMegaChip, oldState, MegaChipWord());
+  return true;
+}
+
+bool Emulator::DrawColourSprite(int xpos, int ypos)
+{
+  // spriteWidth x spriteHeight palette indices at M(I), line after line
+  uint8_t scratch[Screen::colourWidth];
+  bool collision = false;
+  for (int line = 0; line < spriteHeight && ypos + line < static_cast<int>(Screen::colourHeight); line++) {
+    const uint8_t *pixels = MemoryBlock(I + line * spriteWidth, spriteWidth, scratch);
+    collision |= SCR.BlitColourLine(xpos, ypos + line, pixels, spriteWidth, collisionColour);
+  }
+  SCR.UpdateColourHash();
+  return collision;
+}
+
+int Emulator::DoFrame()
+{
+  int count = instructionsPerFrame;
+  int executed = 0;
+  while (count > 0) {
+    if (analysis != NULL && tracer == NULL && (analysis->Flags(PC) & CodeAnalysis::FlagIdleLoop)) {
+      count = RunIdleLoop(count, executed);
+    }
+    else {
+      DoInstruction();
+      executed++;
+      count--;
+    }
+  }
+  DecreaseTimers();
+  return executed;
+}
+
+int Emulator::RunIdleLoop(int count, int &executed)
+{
+  // runs one iteration of the loop. if that ends at the start again, the
+  // next iterations in this frame do exactly the same, so they are skipped.
+  // the loop ends in the same place as when all iterations had run.
+  int loop = analysis->FindIdleLoop(PC);
+  int length = loop >= 0 ? analysis->IdleLoops()[loop].length : 0;
+  if (loop < 0 || !(idleLoopsValid & (1u << loop)) || count < 2 * length) {
+    DoInstruction();
+    executed++;
+    return count - 1;
+  }
+
+  uint16_t start = PC;
+  for (int idx = 0; idx < length; idx++)
+    DoInstruction();
+  executed += length;
+  count -= length;
+  if (PC == start && !errorOccured)
+    count %= length;
+  return count;
+}
+
 void Emulator::DecreaseTimers()
 {
   if (DT > 0) {
+    HashChange(HashDT, DT, DT - 1);
     DT--;
   }
   if (ST > 0) {
+    HashChange(HashST, ST, ST - 1);
     ST--;
   }
+  if (hashCheck)
+    CheckStateHash();
 }
 
 void Emulator::SetKey(int idx, bool on)
 {
+  uint16_t old = keys;
   if (on)
     keys |=  (1 << idx);
   else
     keys &= ~(1 << idx);
+  HashChange(HashKeys, old, keys);
 }
 
 bool Emulator::IsKeyPressed(int idx)
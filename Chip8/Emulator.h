@@ -1,10 +1,17 @@
 #pragma once
 
 #include <stdint.h>
+#include <string.h>
 #include <vector>
+#include <string>
+
+#include "sharedpage.h"
 
 #define HINIBBLE(x) ((x&0xF0)>>4)
 
+class TraceWriter;
+class CodeAnalysis;
+
 static const uint8_t chip8_font[16][5] =
 {
   { 0xF0, 0x90, 0x90, 0x90, 0xF0 },     // sprite '0'
@@ -25,52 +32,66 @@ static const uint8_t chip8_font[16][5] =
   { 0xF0, 0x80, 0xF0, 0x80, 0x80 }      // sprite 'F'
 };
 
-class Emulator
+// the hot part of the emulator state: registers, stack, timers and keys.
+// it is trivially copyable, so forking an emulator is a plain copy of this
+// block, plus reference counting of the memory and screen pages.
+class EmulatorCore
 {
 public:
   // working mode
   enum ChipMode {
     CHIP8,							// normal mode
-    SCHIP							// super chip mode
+    SCHIP,							// super chip mode
+    XOCHIP,							// xo-chip mode: 64k memory, two bitplanes
+    MEGACHIP						// megachip mode: 16m memory, 256x192 colour screen
   } mode;
 
-private:
+  // error types, see Emulator::ErrorMessage
+  enum ErrorType {
+    ErrorNone,
+    ErrorStackUnderflow,
+    ErrorStackOverflow,
+    ErrorMemoryOverflow,
+    ErrorHP48Flags,
+    ErrorQuit,
+    ErrorInvalidInstruction,
+    nrErrorTypes
+  };
 
+  // behaviours that differ between interpreters, and that roms depend on.
+  // each bit off is the original behaviour of this emulator. see quirks.h
+  // for finding the ones a rom needs.
+  enum Quirk {
+    QuirkShiftVY = 1,               // 8XY6/8XYE shift VY into VX, instead of shifting VX
+    QuirkIncrementI = 2,            // FX55/FX65 leave I past the last register
+    QuirkJumpVX = 4,                // BNNN jumps to XNN + VX, instead of NNN + V0
+    QuirkWrapSprites = 8,           // sprites wrap around the screen edges, instead of being clipped
+    nrQuirkProfiles = 16            // all combinations
+  };
+
+protected:
   // registers, V0..VF and I
   static const int nrRegisters = 16;
   uint8_t V[nrRegisters];				// V0 to VF
-  uint16_t I;							// special register I
+  uint32_t I;							// special register I, 24 bits in megachip mode
   uint16_t PC;						// program counter
 
-  // screen
-  class Screen {
-  private:
-    size_t width;
-    size_t height;
-    size_t lineSize;
-    std::vector<uint8_t> memory;
+  // memory size in current mode. xo-chip uses 64k, megachip 16m, the
+  // other modes 4k.
+  size_t memoryLimit;
+  uint32_t memoryMask;
 
-  public:
-    Screen();
-    size_t Width() const { return width; }
-    size_t Height() const { return height; }
-    size_t BytesPerLine() const { return width; }
-    uint8_t* Data() const { return (uint8_t*)&memory[0]; }
-    void Init(Emulator::ChipMode mode);
-    void Clear();
-    void SetPixel(int x, int y, bool on);
-    bool GetPixel(int x, int y);
-    void ScrollHor(int delta);                    // call with positive delta to scroll right, negative to scroll left
-    void ScrollVer(int delta);                    // call with positive delta to scroll down, negative to scroll left
-    bool DrawSprite(                              // draws a sprite on the screen, using xor draw. returns true if collision.
-      uint8_t* sprite,                            // pointer to sprite data.
-      int xpos, int ypos,                         // x,y position where to paint sprite
-      size_t nr_bytes);                           // size of sprite in bytes. if zero, sprite is 16 x 16 pixels. if >0, sprite is 8 x nr_bytes.
-  };
+  // xo-chip
+  uint8_t planes;                   // bitplanes selected by FN01
+  uint8_t audioPattern[16];         // 1 bit audio samples, loaded by F002
+  uint8_t pitch;                    // audio pitch, set by FX3A
 
-  // memory
-  static const size_t memorySize = 4096;
-  uint8_t memory[memorySize];
+  // megachip
+  uint16_t spriteWidth;             // colour sprites, set by 03NN and 04NN. 1..256
+  uint16_t spriteHeight;
+  uint8_t collisionColour;          // palette index sprites collide with, set by 09NN
+  uint8_t blendMode;                // 080N. kept, the screen draws sprites opaque
+  uint8_t screenAlpha;              // 05NN. kept as well
 
   // stack
   static const size_t stackSize = 16;
@@ -81,9 +102,6 @@ private:
   static const int nrHPFlags = 8;
   uint8_t HP48[nrHPFlags];
 
-  // sprites
-  static const int fontOffset = 0;	// memory location for the 4x5 bits hexadecimal font
-
   // timers
   uint32_t DT;                      // delay timer. while>0, pause emulator. counts down @60hz
   uint32_t ST;                      // sound timer. while >0, beep plays. counts down @60hz
@@ -92,28 +110,287 @@ private:
   // keys
   uint16_t keys;                    // key bitfield
 
+  // random generator for CXKK. part of the state, so forks are repeatable.
+  uint32_t randomState;
+
+  // code analysis, see Emulator::SetAnalysis. overwritten code is recorded
+  // here, the analysis itself is shared and never changes.
+  uint32_t idleLoopsValid;          // bit n: idle loop n of the analysis is still valid
+  uint64_t codeDirtyPages;          // bit n: code in memory page n was overwritten
+
+  // quirks, bits of Quirk. kept by Init.
+  uint8_t quirks;
+
+  // hash of memory and the registers that seldom change, see
+  // Emulator::StateHash. the screen keeps the hash of its pixels itself.
+  uint64_t stateHash;
+  bool hashCheck;                   // check the hash after every instruction. kept by Init.
+
   // errors
   bool errorOccured;
   bool exitCalled;
   bool screenInvalidated;
-  std::wstring errorMessage;
+  ErrorType errorType;
+  uint16_t errorPC;                 // PC of the instruction that failed
+  uint16_t errorArg;                // instruction or flag number, depending on type
+};
 
+class Emulator : public EmulatorCore
+{
 private:
-  void SetError(const wchar_t *szText);
+  // screen. pixels are stored packed, one bit per pixel and one page per
+  // bitplane. each line is one 64 bit word per 64 pixels, leftmost pixel in
+  // the most significant bit, so sprite draws and scrolls work on words.
+  // plane pages are shared between forks, and copied when drawn to.
+  class Screen {
+  public:
+    static const size_t colourWidth = 256;        // megachip
+    static const size_t colourHeight = 192;
+    static const int maxPlanes = 2;
+    static const size_t maxWidth = 128;
+    static const size_t maxHeight = 64;
+    static const size_t maxWordsPerLine = maxWidth / 64;
+
+  private:
+    size_t width;
+    size_t height;
+    size_t wordsPerLine;
+    SharedPage *planes[maxPlanes];
+    uint64_t planeHash[maxPlanes];                // hash of the words of each plane, see Emulator::StateHash
+
+    // the megachip colour screen, one palette index per pixel and four
+    // lines per page. allocated when the mode is first switched on.
+    struct ColourScreen;
+    ColourScreen *colour;
+    bool colourOn;
+
+    uint64_t *Plane(int pl);                      // plane data, made writable
+    const uint64_t *Plane(int pl) const { return planes[pl]->words; }
+    // the slot keys of all words, so a word key takes one mix instead of two
+    struct SlotKeys {
+      uint64_t keys[maxPlanes * maxWordsPerLine * maxHeight];
+      SlotKeys();
+    };
+    static const SlotKeys slotKeys;
+    static uint64_t WordKey(int pl, size_t idx, uint64_t word);
+    static uint64_t WordChange(int pl, size_t idx, uint64_t oldWord, uint64_t newWord);   // xor into planeHash
+    uint64_t PlaneHash(int pl) const;             // computed from the words
+    uint8_t *ColourLine(size_t y);                // line of the back buffer, made writable
+    void CopyColour(const ColourScreen *other);
+    void ClearColour(bool front);                 // the back buffer, and the shown one if front
+    uint64_t ColourHash(bool fromPixels) const;
+
+  public:
+    Screen();
+    Screen(const Screen &other);
+    Screen &operator=(const Screen &other);
+    ~Screen();
+    size_t Width() const { return width; }
+    size_t Height() const { return height; }
+    bool IsHires() const { return width == maxWidth; }
+    void Init(Emulator::ChipMode mode);
+    void SetHires(bool hires);                    // sets 128x64 or 64x32 resolution, and clears the screen
+    void Clear(int planeMask = 1);
+    void SetPixel(int x, int y, bool on, int plane = 0, bool wrap = false);
+    bool GetPixel(int x, int y, int plane = 0) const;
+    void ScrollHor(int delta, int planeMask = 1); // call with positive delta to scroll right, negative to scroll left
+    void ScrollVer(int delta, int planeMask = 1); // call with positive delta to scroll down, negative to scroll up
+    bool DrawSprite(                              // draws a sprite on the screen, using xor draw. returns true if collision.
+      const uint8_t* sprite,                      // pointer to sprite data. selected planes take consecutive blocks.
+      int xpos, int ypos,                         // x,y position where to paint sprite
+      size_t nr_bytes,                            // size of sprite in bytes. if zero, sprite is 16 x 16 pixels. if >0, sprite is 8 x nr_bytes.
+      int planeMask = 1,                          // bitplanes to draw in
+      bool wrap = false);                         // wrap around the edges, instead of clipping
+    void Render(uint8_t *dst, size_t bytesPerLine) const; // writes one palette index (0..3) per pixel
+
+    // megachip colour screen, colourWidth x colourHeight. sprites are drawn
+    // into a back buffer; Present shows it and starts the next one empty.
+    // Width, Height and Render stay those of the bitplanes.
+    //
+    // pages are hashed as a whole, not per pixel. BlitColourLine and
+    // SetPaletteColour only mark the pages they change; UpdateColourHash
+    // hashes the marked pages again, and must be called after a run of
+    // them before Hash is read. the other calls do it themselves.
+    void SetColour(bool on);                      // switches the colour screen on or off, and clears it
+    bool IsColour() const { return colourOn; }
+    bool BlitColourLine(                          // draws one line of a colour sprite. returns true if collision.
+      int xpos, int ypos,                         // position of the first pixel. the line is clipped.
+      const uint8_t *pixels, size_t count,        // palette indices, 0 is transparent
+      uint8_t collisionColour);                   // drawing over this index is a collision
+    void ScrollColour(int dx, int dy);            // scrolls the back buffer. positive is right and down.
+    void Present();
+    void SetPaletteColour(int idx, uint32_t argb);
+    uint32_t PaletteColour(int idx) const;        // 0xAARRGGBB
+    void UpdateColourHash();
+    void RenderColour(uint8_t *dst, size_t bytesPerLine) const; // writes one palette index per pixel of the shown frame
+
+    uint64_t Hash() const { return planeHash[0] ^ planeHash[1] ^ HashKey(HashScreenSize, width) ^ (colour != NULL ? ColourHash(false) : 0); }
+    uint64_t ComputeHash() const;                 // the same, computed from the pixels
+  };
+
+  // state hash. every part of the state has slots, and the hash is the xor
+  // of a key per slot and value (zobrist hashing). a change of one value
+  // swaps its key, so the hash follows every change at the cost of a few
+  // multiplies. a zero value has key zero: zeroed memory and cleared
+  // planes add nothing. V, I, PC and SP change with nearly every
+  // instruction, so they are hashed when the hash is read instead.
+  enum HashSlot {
+    HashV = 0,                      // V0..V7 and V8..VF, as two words
+    HashI = 2,
+    HashPC,
+    HashSP,
+    HashStack,                      // one per stack entry
+    HashDT = HashStack + stackSize,
+    HashST,
+    HashHP48,
+    HashPlanes,
+    HashPitch,
+    HashAudio,                      // two words
+    HashKeys = HashAudio + 2,
+    HashRandom,
+    HashMode,
+    HashQuirks,
+    HashScreenSize,
+    HashMegaChip,                   // sprite size, collision colour, blend mode and alpha
+    HashColourOn,
+    HashPalette,
+    HashFrontBuffer,
+    HashScreen = 64,                // one per word of each plane
+    HashMemory = HashScreen + Screen::maxPlanes * Screen::maxWordsPerLine * Screen::maxHeight,
+    HashColour = HashMemory + (1 << 24)             // one per page of the colour screen
+  };
+
+  static uint64_t HashKey(uint64_t slot, uint64_t value)
+  {
+    return value == 0 ? 0 : HashMix(value ^ HashMix(slot + 0x9E3779B97F4A7C15ULL));
+  }
+  static uint64_t HashMix(uint64_t x)
+  {
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+  }
+  void HashChange(uint64_t slot, uint64_t oldValue, uint64_t newValue) { stateHash ^= HashKey(slot, oldValue) ^ HashKey(slot, newValue); }
+  static uint64_t HashWords(uint64_t slot, const void *data, size_t words);
+  uint64_t RegisterHash() const;                  // the registers kept in stateHash
+  uint64_t HotRegisterHash() const
+  {
+    uint64_t words[2];
+    memcpy(words, V, sizeof(words));
+    return HashKey(HashV, words[0]) ^ HashKey(HashV + 1, words[1]) ^ HashKey(HashI, I) ^ HashKey(HashPC, PC) ^ HashKey(HashSP, SP);
+  }
+  void CheckStateHash();
+  uint64_t MegaChipWord() const
+  {
+    return spriteWidth | spriteHeight << 9 | static_cast<uint64_t>(collisionColour) << 18 |
+      static_cast<uint64_t>(blendMode) << 26 | static_cast<uint64_t>(screenAlpha) << 34;
+  }
+
+  // memory, in pages that are shared between forks. untouched pages point
+  // to the zero page, and so does all of the table above the last page
+  // written: forks only copy the pages below. the 16k pages of megachip
+  // take a table on the heap.
+  static const size_t memorySize = 65536;
+  static const size_t megaMemorySize = 1 << 24;
+  static const size_t nrMemoryPages = memorySize / SharedPage::size;
+  SharedPage *smallPages[nrMemoryPages];
+  SharedPage **pages;               // smallPages, or the megachip table
+  size_t nrPages;                   // pages up to the last one written
+
+  // sprites
+  static const int fontOffset = 0;	// memory location for the 4x5 bits hexadecimal font
+
+  // tracing
+  TraceWriter *tracer;              // if set, every instruction is recorded
+
+  // analysis of the loaded rom, or NULL. shared between forks.
+  const CodeAnalysis *analysis;
+
+private:
+  void SetError(ErrorType type, uint16_t arg = 0);
   void SetScreenInvalidated(bool bInvalidated = true) { screenInvalidated = bInvalidated; }
+  void SkipNextInstruction();
+  uint8_t Random();
+
+  // memory access. addresses wrap at the memory size of the mode.
+  uint8_t ReadMemory(uint32_t addr) const
+  {
+    addr &= memoryMask;
+    return pages[addr >> SharedPage::shift]->bytes[addr & (SharedPage::size - 1)];
+  }
+  void WriteMemory(uint32_t addr, uint8_t value);
+  void InvalidateCode(uint16_t addr);
+  int RunIdleLoop(int count, int &executed);
+  const uint8_t *MemoryBlock(uint32_t addr, size_t len, uint8_t *scratch) const;
+  void ReleasePages();
+  void SetPageTable(size_t count);              // a table for count pages
+  void AddI(int value) { I = (I + value) & (mode == MEGACHIP ? 0xFFFFFF : 0xFFFF); }
+
+  // megachip
+  bool MegaChipInstruction(uint16_t instruction);  // false if not one
+  bool DrawColourSprite(int xpos, int ypos);
 
 public:
   Screen SCR;
 
+  // instructions per 60Hz frame. about 1000 instructions per second.
+  static const int instructionsPerFrame = 17;
+
 public:
+  // Init, Fork and assignment release and replace the pages of the
+  // emulator they change, and Init may free its page table. that emulator
+  // must be idle: no other thread may be running or reading it meanwhile.
+  // the emulator forked from is only read.
   void Init(ChipMode m);
   Emulator(void);
+  Emulator(const Emulator &other);              // same as Fork
+  Emulator &operator=(const Emulator &other);
   ~Emulator(void);
+  void Fork(Emulator &child) const;             // makes child a copy of this emulator, sharing memory and screen pages. the tracer is not copied.
   void storeProgram(uint8_t* data, size_t len);
   void DoInstruction();             // performs x instructions, exits if instructions done, or if exit called.
+  int DoFrame();                    // performs one 60Hz frame: instructionsPerFrame instructions, then the timers.
+                                    // returns the instructions executed, fewer if idle loop iterations were skipped.
   bool ScreenIsInvalidated(bool reset = true);
+  bool ErrorOccured() const { return errorOccured; }
+  ErrorType GetErrorType() const { return errorType; }
+  std::wstring ErrorMessage() const;
   void DecreaseTimers();
   void SetKey(int idx, bool on);
+  void SetKeys(uint16_t bits) { HashChange(HashKeys, keys, bits); keys = bits; }    // all 16 keys at once, bit n is key n
   bool IsKeyPressed(int idx);
-};
+  void Seed(uint32_t seed);                       // seeds the random generator of CXKK
+  void SetQuirks(int bits);
+  int GetQuirks() const { return quirks; }
+  uint8_t PeekMemory(uint32_t addr) const { return ReadMemory(addr); }
+  void CopyMemory(uint8_t *dst, size_t addr, size_t len) const;    // addr + len up to MemorySize
+  size_t MemorySize() const { return memoryLimit; }
+
+  // registers, for debuggers and state export
+  uint8_t GetV(int idx) const { return V[idx & 0xF]; }
+  uint32_t GetI() const { return I; }
+  uint16_t GetPC() const { return PC; }
+  size_t GetSP() const { return SP; }
+  uint16_t GetStack(int idx) const { return stack[idx & 0xF]; }
+  uint32_t GetDT() const { return DT; }
+  uint32_t GetST() const { return ST; }
+  uint16_t GetKeys() const { return keys; }
+  void SetTracer(TraceWriter *t) { tracer = t; }
+  TraceWriter *GetTracer() const { return tracer; }
+  // sets the analysis of the loaded rom. it must stay alive while the
+  // emulator or a fork of it uses it; Init drops it.
+  void SetAnalysis(const CodeAnalysis *a);
+  const CodeAnalysis *GetAnalysis() const { return analysis; }
+  bool IsCodeModified(uint16_t addr) const { return ((codeDirtyPages >> ((addr & memoryMask) >> SharedPage::shift)) & 1) != 0; }
 
+  // hash of the whole machine: registers, timers, keys, memory and screen.
+  // it is kept up to date on every change, so reading it costs a few
+  // nanoseconds, whatever the size of memory. equal states have equal
+  // hashes; forks start with the hash of the parent.
+  uint64_t StateHash() const { return stateHash ^ SCR.Hash() ^ HotRegisterHash(); }
+  uint64_t ComputeStateHash() const;              // the same, computed from the whole state
+  // debugging: after every instruction and timer tick, compares StateHash
+  // with ComputeStateHash. a mismatch is counted in
+  // MetricStateHashMismatches, and the hash is corrected.
+  void SetHashCheck(bool on) { hashCheck = on; }
+};
@@ -0,0 +1,512 @@
+#include "analysis.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// cache file: the header, then the tables at the offsets in the header.
+// the version changes whenever the analysis or the layout changes, old
+// files are then analyzed again and overwritten.
+struct CodeAnalysis::Header
+{
+  uint32_t magic;
+  uint32_t version;
+  uint64_t hash;
+  uint32_t romSize;
+  uint32_t mode;
+  uint32_t memSize;
+  uint32_t flagsOffset;
+  uint32_t nrInstructions;
+  uint32_t instructionsOffset;
+  uint32_t nrBlocks;
+  uint32_t blocksOffset;
+  uint32_t nrSubroutines;
+  uint32_t subroutinesOffset;
+  uint32_t nrIdleLoops;
+  uint32_t idleLoopsOffset;
+  uint32_t totalSize;
+  uint32_t pad;
+};
+
+static const uint32_t analysisMagic = 0x4E413843;     // 'C8AN'
+static const uint32_t analysisVersion = 1;
+static const int xochipMode = 2;                      // Emulator::XOCHIP
+static const int megachipMode = 3;                    // Emulator::MEGACHIP
+
+static uint32_t Align(uint32_t offset)
+{
+  return (offset + 7) & ~7u;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// CodeAnalysis class
+
+CodeAnalysis::CodeAnalysis()
+: data(NULL), dataSize(0), flags(NULL), memSize(0), mapping(NULL), file(NULL)
+{
+}
+
+CodeAnalysis::~CodeAnalysis()
+{
+  Clear();
+}
+
+void CodeAnalysis::Clear()
+{
+#ifdef _WIN32
+  if (mapping != NULL)
+    UnmapViewOfFile(mapping);
+  if (file != NULL)
+    CloseHandle(static_cast<HANDLE>(file));           // the mapping handle
+#else
+  if (mapping != NULL)
+    munmap(mapping, dataSize);
+#endif
+  mapping = NULL;
+  file = NULL;
+  buffer.clear();
+  data = NULL;
+  dataSize = 0;
+  flags = NULL;
+  memSize = 0;
+}
+
+uint64_t CodeAnalysis::Hash(const uint8_t *rom, size_t romSize, int mode)
+{
+  // fnv-1a over the mode and the rom
+  uint64_t hash = 14695981039346656037ULL;
+  hash = (hash ^ static_cast<uint8_t>(mode)) * 1099511628211ULL;
+  for (size_t idx = 0; idx < romSize; idx++)
+    hash = (hash ^ rom[idx]) * 1099511628211ULL;
+  return hash;
+}
+
+void CodeAnalysis::Analyze(const uint8_t *rom, size_t romSize, int mode)
+{
+  Clear();
+
+  // the memory as storeProgram leaves it. only the rom is analyzed. code
+  // can only run in the first 64k of a megachip rom, the rest is data.
+  size_t size = mode == xochipMode || mode == megachipMode ? 65536 : 4096;
+  size_t loaded = romSize <= size - 0x200 ? romSize : 0;
+  if (mode == megachipMode && romSize > size - 0x200)
+    loaded = size - 0x200;
+  std::vector<uint8_t> mem(size + 4, 0);
+  if (loaded > 0)
+    memcpy(&mem[0x200], rom, loaded);
+  size_t end = 0x200 + loaded;
+
+  std::vector<uint8_t> fl(size, 0);
+  std::vector<Instruction> instructions;
+  std::vector<uint16_t> subroutines;
+
+  #define OPCODE(a) static_cast<uint16_t>((mem[a] << 8) | mem[(a) + 1])
+  #define LENGTH(a) (((mode == xochipMode && OPCODE(a) == 0xF000) || (mode == megachipMode && (OPCODE(a) & 0xFF00) == 0x0100)) ? 2 : 1) * 2
+
+  // follow all paths from the start address
+  std::vector<uint16_t> work;
+  work.push_back(0x200);
+  fl[0x200] |= FlagBlockStart;
+  while (!work.empty()) {
+    size_t addr = work.back();
+    work.pop_back();
+    if (addr < 0x200 || addr + 2 > end || (fl[addr] & FlagInstruction))
+      continue;
+
+    Instruction ins;
+    ins.addr = static_cast<uint16_t>(addr);
+    ins.opcode = OPCODE(addr);
+    ins.target = 0;
+    ins.kind = KindNormal;
+    ins.length = static_cast<uint8_t>(LENGTH(addr));
+    if (addr + ins.length > end)
+      continue;
+    fl[addr] |= FlagInstruction;
+    for (size_t idx = 0; idx < ins.length; idx++)
+      fl[addr + idx] |= FlagCode;
+
+    uint16_t op = ins.opcode;
+    uint16_t nnn = op & 0x0FFF;
+    size_t next = addr + ins.length;
+    switch (op & 0xF000) {
+    case 0x0000:
+      if (op == 0x00EE)
+        ins.kind = KindReturn;
+      else if (op == 0x00FD)
+        ins.kind = KindExit;
+      break;
+    case 0x1000:
+      ins.kind = KindJump;
+      break;
+    case 0x2000:
+      ins.kind = KindCall;
+      break;
+    case 0x3000:
+    case 0x4000:
+      ins.kind = KindSkip;
+      break;
+    case 0x5000:
+    case 0x9000:
+      if ((op & 0x000F) == 0)
+        ins.kind = KindSkip;
+      break;
+    case 0xB000:
+      ins.kind = KindIndirect;
+      break;
+    case 0xE000:
+      if ((op & 0x00FF) == 0x9E || (op & 0x00FF) == 0xA1)
+        ins.kind = KindSkip;
+      break;
+    }
+
+    switch (ins.kind) {
+    case KindNormal:
+      work.push_back(static_cast<uint16_t>(next));
+      break;
+    case KindJump:
+      ins.target = nnn;
+      fl[nnn] |= FlagBlockStart;
+      work.push_back(nnn);
+      break;
+    case KindCall:
+      ins.target = nnn;
+      if (!(fl[nnn] & FlagSubroutine))
+        subroutines.push_back(nnn);
+      fl[nnn] |= FlagSubroutine | FlagBlockStart;
+      work.push_back(nnn);
+      if (next < size)
+        fl[next] |= FlagBlockStart;
+      work.push_back(static_cast<uint16_t>(next));
+      break;
+    case KindSkip:
+      // the skip is 4 bytes if the next instruction is F000 NNNN
+      if (next < end) {
+        size_t after = next + LENGTH(next);
+        fl[next] |= FlagBlockStart;
+        work.push_back(static_cast<uint16_t>(next));
+        if (after < size) {
+          fl[after] |= FlagBlockStart;
+          work.push_back(static_cast<uint16_t>(after));
+        }
+      }
+      break;
+    default:
+      break;
+    }
+    instructions.push_back(ins);
+  }
+
+  #undef OPCODE
+  #undef LENGTH
+
+  struct ByAddress {
+    bool operator()(const Instruction &a, const Instruction &b) const { return a.addr < b.addr; }
+  };
+  std::sort(instructions.begin(), instructions.end(), ByAddress());
+  std::sort(subroutines.begin(), subroutines.end());
+
+  // basic blocks: runs of consecutive instructions, split at branch
+  // targets and after every transfer of control
+  std::vector<Block> blocks;
+  bool open = false;
+  for (size_t idx = 0; idx < instructions.size(); idx++) {
+    const Instruction &ins = instructions[idx];
+    if (!open || (fl[ins.addr] & FlagBlockStart) || blocks.back().end != ins.addr) {
+      Block block;
+      block.start = block.end = ins.addr;
+      blocks.push_back(block);
+    }
+    blocks.back().end = static_cast<uint16_t>(ins.addr + ins.length);
+    open = ins.kind == KindNormal;
+  }
+
+  // idle loops: FX07 and 6XKK, then optionally one skip, then a jump back
+  std::vector<IdleLoop> loops;
+  for (size_t idx = 0; idx < instructions.size() && loops.size() < maxIdleLoops; idx++) {
+    const Instruction &jump = instructions[idx];
+    if (jump.kind != KindJump || jump.target > jump.addr || jump.addr - jump.target > 16 * 2)
+      continue;
+    size_t first = idx;
+    while (first > 0 && instructions[first].addr > jump.target)
+      first--;
+    if (instructions[first].addr != jump.target)
+      continue;
+
+    bool idle = true;
+    for (size_t ins = first; ins < idx && idle; ins++) {
+      uint16_t op = instructions[ins].opcode;
+      if (instructions[ins].addr + 2 != instructions[ins + 1].addr)
+        idle = false;                                 // not straight line code
+      else if (instructions[ins].kind == KindSkip)
+        idle = ins + 1 == idx;                        // only the jump may be skipped, that leaves the loop
+      else
+        idle = (op & 0xF0FF) == 0xF007 || (op & 0xF000) == 0x6000;
+    }
+    if (!idle)
+      continue;
+    IdleLoop loop;
+    memset(&loop, 0, sizeof(loop));
+    loop.start = jump.target;
+    loop.end = static_cast<uint16_t>(jump.addr + 2);
+    loop.length = static_cast<uint8_t>(idx - first + 1);
+    fl[loop.start] |= FlagIdleLoop;
+    loops.push_back(loop);
+  }
+
+  // lay out the flat block
+  Header header;
+  memset(&header, 0, sizeof(header));
+  header.magic = analysisMagic;
+  header.version = analysisVersion;
+  header.hash = Hash(rom, romSize, mode);
+  header.romSize = static_cast<uint32_t>(romSize);
+  header.mode = mode;
+  header.memSize = static_cast<uint32_t>(size);
+  uint32_t offset = Align(sizeof(header));
+  header.flagsOffset = offset;
+  offset = Align(offset + static_cast<uint32_t>(size));
+  header.nrInstructions = static_cast<uint32_t>(instructions.size());
+  header.instructionsOffset = offset;
+  offset = Align(offset + header.nrInstructions * sizeof(Instruction));
+  header.nrBlocks = static_cast<uint32_t>(blocks.size());
+  header.blocksOffset = offset;
+  offset = Align(offset + header.nrBlocks * sizeof(Block));
+  header.nrSubroutines = static_cast<uint32_t>(subroutines.size());
+  header.subroutinesOffset = offset;
+  offset = Align(offset + header.nrSubroutines * sizeof(uint16_t));
+  header.nrIdleLoops = static_cast<uint32_t>(loops.size());
+  header.idleLoopsOffset = offset;
+  offset = Align(offset + header.nrIdleLoops * sizeof(IdleLoop));
+  header.totalSize = offset;
+
+  buffer.assign(offset, 0);
+  memcpy(&buffer[0], &header, sizeof(header));
+  memcpy(&buffer[header.flagsOffset], &fl[0], size);
+  if (!instructions.empty())
+    memcpy(&buffer[header.instructionsOffset], &instructions[0], instructions.size() * sizeof(Instruction));
+  if (!blocks.empty())
+    memcpy(&buffer[header.blocksOffset], &blocks[0], blocks.size() * sizeof(Block));
+  if (!subroutines.empty())
+    memcpy(&buffer[header.subroutinesOffset], &subroutines[0], subroutines.size() * sizeof(uint16_t));
+  if (!loops.empty())
+    memcpy(&buffer[header.idleLoopsOffset], &loops[0], loops.size() * sizeof(IdleLoop));
+  Attach(&buffer[0], buffer.size());
+}
+
+bool CodeAnalysis::Attach(const uint8_t *base, size_t size)
+{
+  // checks that all tables are inside the block, so a damaged file can do
+  // no harm
+  if (size < sizeof(Header))
+    return false;
+  const Header *header = reinterpret_cast<const Header *>(base);
+  if (header->magic != analysisMagic || header->version != analysisVersion || header->totalSize != size ||
+      (header->memSize != 4096 && header->memSize != 65536))
+    return false;
+  uint64_t limits[][2] = {
+    { header->flagsOffset, header->memSize },
+    { header->instructionsOffset, static_cast<uint64_t>(header->nrInstructions) * sizeof(Instruction) },
+    { header->blocksOffset, static_cast<uint64_t>(header->nrBlocks) * sizeof(Block) },
+    { header->subroutinesOffset, static_cast<uint64_t>(header->nrSubroutines) * sizeof(uint16_t) },
+    { header->idleLoopsOffset, static_cast<uint64_t>(header->nrIdleLoops) * sizeof(IdleLoop) },
+  };
+  for (size_t idx = 0; idx < sizeof(limits) / sizeof(limits[0]); idx++)
+    if ((limits[idx][0] & 7) != 0 || limits[idx][0] + limits[idx][1] > size)
+      return false;
+  if (header->nrIdleLoops > maxIdleLoops)
+    return false;
+
+  data = base;
+  dataSize = size;
+  flags = base + header->flagsOffset;
+  memSize = header->memSize;
+  return true;
+}
+
+bool CodeAnalysis::Save(const char *fileName) const
+{
+  if (data == NULL)
+    return false;
+
+  // write to a temporary file and rename it, so other processes never map
+  // a half written file
+  std::string temp = std::string(fileName) + ".tmp";
+  FILE *f = fopen(temp.c_str(), "wb");
+  if (f == NULL)
+    return false;
+  bool ok = fwrite(data, 1, dataSize, f) == dataSize;
+  ok = fclose(f) == 0 && ok;
+  if (ok && rename(temp.c_str(), fileName) != 0) {
+    remove(fileName);
+    ok = rename(temp.c_str(), fileName) == 0;
+  }
+  if (!ok)
+    remove(temp.c_str());
+  return ok;
+}
+
+bool CodeAnalysis::Map(const char *fileName, uint64_t hash, size_t romSize, int mode)
+{
+  Clear();
+
+#ifdef _WIN32
+  HANDLE f = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+  if (f == INVALID_HANDLE_VALUE)
+    return false;
+  LARGE_INTEGER size;
+  HANDLE map = NULL;
+  if (GetFileSizeEx(f, &size) && size.QuadPart > 0 && size.QuadPart < (1 << 24))
+    map = CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle(f);
+  if (map == NULL)
+    return false;
+  const uint8_t *base = static_cast<const uint8_t *>(MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0));
+  if (base == NULL) {
+    CloseHandle(map);
+    return false;
+  }
+  mapping = const_cast<uint8_t *>(base);
+  file = map;
+  size_t mapSize = static_cast<size_t>(size.QuadPart);
+#else
+  int fd = open(fileName, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void *base = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size < (1 << 24))
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return false;
+  mapping = base;
+  size_t mapSize = static_cast<size_t>(st.st_size);
+  dataSize = mapSize;                                 // for munmap if the checks fail
+#endif
+
+  if (!Attach(static_cast<const uint8_t *>(mapping), mapSize)) {
+    Clear();
+    return false;
+  }
+  const Header *header = GetHeader();
+  if (header->hash != hash || header->romSize != romSize || header->mode != static_cast<uint32_t>(mode)) {
+    Clear();
+    return false;
+  }
+  return true;
+}
+
+const CodeAnalysis::Header *CodeAnalysis::GetHeader() const
+{
+  return reinterpret_cast<const Header *>(data);
+}
+
+size_t CodeAnalysis::NrInstructions() const
+{
+  return data != NULL ? GetHeader()->nrInstructions : 0;
+}
+
+const CodeAnalysis::Instruction *CodeAnalysis::Instructions() const
+{
+  return reinterpret_cast<const Instruction *>(data + GetHeader()->instructionsOffset);
+}
+
+const CodeAnalysis::Instruction *CodeAnalysis::FindInstruction(uint16_t addr) const
+{
+  if (!(Flags(addr) & FlagInstruction))
+    return NULL;
+  const Instruction *first = Instructions();
+  const Instruction *last = first + NrInstructions();
+  while (first < last) {
+    const Instruction *mid = first + (last - first) / 2;
+    if (mid->addr < addr)
+      first = mid + 1;
+    else
+      last = mid;
+  }
+  return first->addr == addr ? first : NULL;
+}
+
+size_t CodeAnalysis::NrBlocks() const
+{
+  return data != NULL ? GetHeader()->nrBlocks : 0;
+}
+
+const CodeAnalysis::Block *CodeAnalysis::Blocks() const
+{
+  return reinterpret_cast<const Block *>(data + GetHeader()->blocksOffset);
+}
+
+size_t CodeAnalysis::NrSubroutines() const
+{
+  return data != NULL ? GetHeader()->nrSubroutines : 0;
+}
+
+const uint16_t *CodeAnalysis::Subroutines() const
+{
+  return reinterpret_cast<const uint16_t *>(data + GetHeader()->subroutinesOffset);
+}
+
+size_t CodeAnalysis::NrIdleLoops() const
+{
+  return data != NULL ? GetHeader()->nrIdleLoops : 0;
+}
+
+const CodeAnalysis::IdleLoop *CodeAnalysis::IdleLoops() const
+{
+  return reinterpret_cast<const IdleLoop *>(data + GetHeader()->idleLoopsOffset);
+}
+
+int CodeAnalysis::FindIdleLoop(uint16_t start) const
+{
+  const IdleLoop *loops = IdleLoops();
+  for (size_t idx = 0; idx < NrIdleLoops(); idx++)
+    if (loops[idx].start == start)
+      return static_cast<int>(idx);
+  return -1;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+//
+// AnalysisCache class
+
+AnalysisCache::AnalysisCache(const std::string &directory)
+: directory(directory)
+{
+}
+
+std::string AnalysisCache::FileName(uint64_t hash, int mode) const
+{
+  char name[40];
+  sprintf(name, "%016llx-%d.c8a", static_cast<unsigned long long>(hash), mode);
+  if (directory.empty())
+    return name;
+  char last = directory[directory.size() - 1];
+  if (last == '/' || last == '\\')
+    return directory + name;
+  return directory + "/" + name;
+}
+
+bool AnalysisCache::Load(CodeAnalysis &analysis, const uint8_t *rom, size_t romSize, int mode)
+{
+  uint64_t hash = CodeAnalysis::Hash(rom, romSize, mode);
+  std::string fileName = FileName(hash, mode);
+  if (analysis.Map(fileName.c_str(), hash, romSize, mode))
+    return true;
+
+  // a failed save only costs the next load another analysis
+  analysis.Analyze(rom, romSize, mode);
+  analysis.Save(fileName.c_str());
+  return false;
+}
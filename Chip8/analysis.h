@@ -0,0 +1,129 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////
+//
+// CodeAnalysis. Static analysis of a rom, done once when it is loaded:
+// the instructions reachable from 0x200, basic blocks, subroutine entry
+// points called through 2NNN, and idle loops that only wait for the delay
+// timer or a key.
+//
+// The analysis is one flat block, so it can be written to a cache file as
+// is and memory mapped on later loads. It is read only after it is made;
+// emulators that use it keep their own record of code they overwrote, see
+// Emulator::SetAnalysis.
+
+class CodeAnalysis
+{
+public:
+  // per address flags
+  enum {
+    FlagCode = 1,                   // byte of a reachable instruction
+    FlagInstruction = 2,            // first byte of a reachable instruction
+    FlagBlockStart = 4,
+    FlagSubroutine = 8,             // target of a 2NNN
+    FlagIdleLoop = 16               // first instruction of an idle loop
+  };
+
+  enum Kind {
+    KindNormal,
+    KindJump,                       // 1NNN
+    KindCall,                       // 2NNN
+    KindReturn,                     // 00EE
+    KindSkip,                       // conditional skip of the next instruction
+    KindIndirect,                   // BNNN, target unknown
+    KindExit                        // 00FD
+  };
+
+  struct Instruction {
+    uint16_t addr;
+    uint16_t opcode;
+    uint16_t target;                // jump or call target
+    uint8_t kind;
+    uint8_t length;                 // 2, or 4 for F000 NNNN
+  };
+
+  struct Block {
+    uint16_t start;
+    uint16_t end;                   // address after the last instruction
+  };
+
+  // a loop of length instructions from start, ending in a jump back to
+  // start. an iteration only writes values that do not depend on the
+  // registers, so once one iteration ran, the next ones do not change the
+  // state until the timers tick or the keys change.
+  struct IdleLoop {
+    uint16_t start;
+    uint16_t end;
+    uint8_t length;
+    uint8_t pad[3];
+  };
+
+  static const int maxIdleLoops = 32;
+
+  CodeAnalysis();
+  ~CodeAnalysis();
+
+  static uint64_t Hash(const uint8_t *rom, size_t romSize, int mode);
+
+  void Analyze(const uint8_t *rom, size_t romSize, int mode);
+  bool Save(const char *fileName) const;
+  // maps a cache file. fails if it is missing, of another version, or of another rom.
+  bool Map(const char *fileName, uint64_t hash, size_t romSize, int mode);
+  void Clear();
+
+  bool IsEmpty() const { return data == NULL; }
+  bool IsMapped() const { return mapping != NULL; }
+  size_t DataSize() const { return dataSize; }
+
+  uint8_t Flags(uint16_t addr) const { return addr < memSize ? flags[addr] : 0; }
+  size_t NrInstructions() const;
+  const Instruction *Instructions() const;
+  const Instruction *FindInstruction(uint16_t addr) const;  // NULL if not reachable
+  size_t NrBlocks() const;
+  const Block *Blocks() const;
+  size_t NrSubroutines() const;
+  const uint16_t *Subroutines() const;
+  size_t NrIdleLoops() const;
+  const IdleLoop *IdleLoops() const;
+  int FindIdleLoop(uint16_t start) const;                   // index, or -1
+
+private:
+  struct Header;
+
+  std::vector<uint8_t> buffer;      // analysis made by Analyze
+  const uint8_t *data;              // buffer or mapped file
+  size_t dataSize;
+  const uint8_t *flags;
+  size_t memSize;
+  void *mapping;                    // platform handles of the mapped file
+  void *file;
+
+  const Header *GetHeader() const;
+  bool Attach(const uint8_t *base, size_t size);
+
+  CodeAnalysis(const CodeAnalysis &);
+  CodeAnalysis &operator=(const CodeAnalysis &);
+};
+
+///////////////////////////////////////////////////////////////////////////
+//
+// AnalysisCache. A directory of analysis files, one per rom and mode.
+
+class AnalysisCache
+{
+public:
+  AnalysisCache(const std::string &directory);
+
+  // maps the cached analysis of the rom, or analyzes it and stores it.
+  // returns true if the cache had it.
+  bool Load(CodeAnalysis &analysis, const uint8_t *rom, size_t romSize, int mode);
+  std::string FileName(uint64_t hash, int mode) const;
+
+private:
+  std::string directory;
+};
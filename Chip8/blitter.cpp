@@ -0,0 +1,112 @@
+#include "blitter.h"
+
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define BLITTER_SSE2
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+//
+// Blitter class
+
+#ifdef BLITTER_SSE2
+bool Blitter::useVector = true;
+#else
+bool Blitter::useVector = false;
+#endif
+
+bool Blitter::HasVector()
+{
+#ifdef BLITTER_SSE2
+  return true;
+#else
+  return false;
+#endif
+}
+
+void Blitter::SetVector(bool on)
+{
+  useVector = on && HasVector();
+}
+
+bool Blitter::UsesVector()
+{
+  return useVector;
+}
+
+bool Blitter::BlitLine(uint8_t *dst, const uint8_t *src, size_t count, uint8_t collisionColour)
+{
+  size_t idx = 0;
+  bool collision = false;
+#ifdef BLITTER_SSE2
+  if (useVector) {
+    // opaque = src != 0. the new pixel is src where opaque, dst elsewhere,
+    // and a collision is an opaque pixel over the collision colour.
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i hit = _mm_set1_epi8(static_cast<char>(collisionColour));
+    __m128i hits = zero;
+    for (; idx + 16 <= count; idx += 16) {
+      __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + idx));
+      __m128i d = _mm_loadu_si128(reinterpret_cast<__m128i *>(dst + idx));
+      __m128i transparent = _mm_cmpeq_epi8(s, zero);
+      hits = _mm_or_si128(hits, _mm_andnot_si128(transparent, _mm_cmpeq_epi8(d, hit)));
+      d = _mm_or_si128(_mm_and_si128(transparent, d), s);
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + idx), d);
+    }
+    collision = _mm_movemask_epi8(hits) != 0;
+  }
+#endif
+  for (; idx < count; idx++) {
+    if (src[idx] == 0)
+      continue;
+    collision |= dst[idx] == collisionColour;
+    dst[idx] = src[idx];
+  }
+  return collision;
+}
+
+void Blitter::FillLine(uint8_t *dst, uint8_t value, size_t count)
+{
+  size_t idx = 0;
+#ifdef BLITTER_SSE2
+  if (useVector) {
+    const __m128i v = _mm_set1_epi8(static_cast<char>(value));
+    for (; idx + 16 <= count; idx += 16)
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + idx), v);
+  }
+#endif
+  for (; idx < count; idx++)
+    dst[idx] = value;
+}
+
+void Blitter::MoveLine(uint8_t *dst, const uint8_t *src, size_t count)
+{
+  // every block is loaded before it is stored. moving up, the blocks go
+  // from the end, so no block overwrites pixels that are still to be read.
+  if (dst == src || count == 0)
+    return;
+  if (dst < src) {
+    size_t idx = 0;
+#ifdef BLITTER_SSE2
+    if (useVector) {
+      for (; idx + 16 <= count; idx += 16)
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + idx), _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + idx)));
+    }
+#endif
+    for (; idx < count; idx++)
+      dst[idx] = src[idx];
+  }
+  else {
+    size_t idx = count;
+#ifdef BLITTER_SSE2
+    if (useVector) {
+      for (; idx >= 16; idx -= 16)
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + idx - 16), _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + idx - 16)));
+    }
+#endif
+    while (idx-- > 0)
+      dst[idx] = src[idx];
+  }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+///////////////////////////////////////////////////////////////////////////
+//
+// Blitter. The pixel kernels of the megachip colour screen, which has one
+// palette index per pixel: sprite lines, fills and moves of pixel runs.
+// They use SSE2 where the compiler has it, 16 pixels at a time, so a full
+// 256x192 redraw is a few microseconds.
+//
+// The plain versions are kept for other processors, and can be selected
+// with SetVector(false) to compare the two.
+
+class Blitter
+{
+public:
+  // draws count sprite pixels over dst. index 0 is transparent and keeps
+  // the screen pixel. returns true if a drawn pixel covered a pixel of
+  // the collision colour.
+  static bool BlitLine(uint8_t *dst, const uint8_t *src, size_t count, uint8_t collisionColour);
+  static void FillLine(uint8_t *dst, uint8_t value, size_t count);
+  static void MoveLine(uint8_t *dst, const uint8_t *src, size_t count);   // the runs may overlap
+
+  static bool HasVector();          // compiled with the vector kernels
+  static void SetVector(bool on);   // use them, if compiled. on by default.
+  static bool UsesVector();
+
+private:
+  static bool useVector;
+};
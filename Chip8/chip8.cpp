@@ -1,23 +1,31 @@
 #include "chip8.h"
 #include <QFileDialog>
+#include <QStandardPaths>
+#include <QDir>
 #include <qbitmap.h>
 #include <qpainter.h>
 #include <qtimer.h>
 #include <qkeyevent>
 #include <qkeysequence>
 
+#include "timeline.h"
+
 Chip8::Chip8(QWidget *parent)
 : QMainWindow( parent ),
-  _emuThread( &_emu )
+  _emuThread( &_emu ),
+  _netplay( _emu, &_netplayTransport )
 {
   ui.setupUi(this);
 
   connect(ui.actionOpenGame, SIGNAL(triggered()), this, SLOT(openGame()));
+  connect(ui.actionOpenGrid, SIGNAL(triggered()), this, SLOT(openGrid()));
   connect(ui.actionZoomIn, SIGNAL(triggered()), this, SLOT(zoomIn()));
   connect(ui.actionZoomOut, SIGNAL(triggered()), this, SLOT(zoomOut()));
   // toolbar
   connect(ui.actionStartEmulator, SIGNAL(triggered()), this, SLOT(play()));
   connect(ui.actionPauseEmulator, SIGNAL(triggered()), this, SLOT(pause()));
+  connect(ui.actionFastForward, SIGNAL(triggered()), this, SLOT(fastForward()));
+  connect(ui.actionAntiFlicker, SIGNAL(triggered()), this, SLOT(antiFlicker()));
   //thread
   connect(&_emuThread, SIGNAL(screenInvalidated()), this, SLOT(screenInvalidated()), Qt::BlockingQueuedConnection);
   connect(&_emuThread, SIGNAL(threadExit()), this, SLOT(threadExit()), Qt::BlockingQueuedConnection);
@@ -27,6 +35,50 @@ Chip8::Chip8(QWidget *parent)
 
   _scale = 5;
 
+  // speed readout
+  _speedLabel = new QLabel(this);
+  ui.statusBar->addPermanentWidget(_speedLabel);
+  _speedInstructions = 0;
+  _speedFrames = 0;
+  _speedClock.start();
+
+  // metrics readout, and export if asked for by the environment
+  _metricsLabel = new QLabel(this);
+  ui.statusBar->addPermanentWidget(_metricsLabel);
+  _metricsEmulationNs = 0;
+  _metricsSleepNs = 0;
+  _metricsPresented = 0;
+  _metricsExporter.StartFromEnvironment();
+
+  // a trace of the threads, if compiled in: CHIP8_TIMELINE=file.json
+  TIMELINE_THREAD("gui");
+  Timeline::StartFromEnvironment();
+
+  // live state for external tools
+  const char *stateName = getenv("CHIP8_STATE_EXPORT");
+  if (stateName != NULL)
+    _emuThread.exportState(*stateName != 0 ? stateName : StateExporter::defaultName);
+
+  // netplay with a second player: CHIP8_NETPLAY=localport:host:remoteport[:delay].
+  // both players open the same rom.
+  _netplayOn = false;
+  _netplayDelay = 2;
+  QStringList netplay = QString(getenv("CHIP8_NETPLAY")).split(':');
+  if (netplay.size() >= 3 &&
+      _netplayTransport.Open(netplay[0].toUShort(), netplay[1].toLocal8Bit().constData(), netplay[2].toUShort())) {
+    if (netplay.size() >= 4)
+      _netplayDelay = netplay[3].toInt();
+    _netplayOn = true;
+    _emuThread.setNetplay(&_netplay);
+  }
+
+  // run-ahead: CHIP8_RUNAHEAD=frames shows the screen that many frames early
+  const char *runAhead = getenv("CHIP8_RUNAHEAD");
+  if (runAhead != NULL)
+    _emuThread.setRunAhead(QString(runAhead).toInt());
+  _metricsRunAheadFrames = 0;
+  _metricsRunAheadNs = 0;
+
   // set up timer
   _timer = new QTimer(this);
   connect(_timer, SIGNAL(timeout()), this, SLOT(timerTick()));
@@ -38,12 +90,30 @@ Chip8::Chip8(QWidget *parent)
 
 void Chip8::initPallette()
 {
+  // index is plane0 | plane1 << 1. classic roms only use the first two.
   _pallette.clear();
   _pallette.append(QRgb(0xFF000000));
   _pallette.append(QRgb(0xFFFFFFFF));
-  for (int dummy = 2; dummy < 256; dummy++)
+  _pallette.append(QRgb(0xFFAAAAAA));
+  _pallette.append(QRgb(0xFF555555));
+  for (int dummy = 4; dummy < 256; dummy++)
     _pallette.append(QRgb(0xFF800000));
 
+  // the anti-flicker filter writes intensities
+  _greyPallette.clear();
+  for (int grey = 0; grey < 256; grey++)
+    _greyPallette.append(qRgb(grey, grey, grey));
+
+  // megachip roms load their own, see loadColourPallette
+  _colourPallette.fill(QRgb(0xFF000000), 256);
+}
+
+void Chip8::loadColourPallette()
+{
+  // there is nothing behind the screen to blend with, so the colours are
+  // shown opaque
+  for (int idx = 0; idx < 256; idx++)
+    _colourPallette[idx] = _emu.SCR.PaletteColour(idx) | 0xFF000000;
 }
 
 void Chip8::initBitmap()
@@ -56,12 +126,14 @@ Chip8::~Chip8()
 {
   // key event handler
   QApplication::instance()->removeEventFilter(this);
+  Timeline::Stop();
 }
 
 // painting 
 
 void Chip8::paintEvent(QPaintEvent *event)
 {
+  TIMELINE_SPAN("paint");
   QPainter pnt(this);
   QRect target(10, 80, _scale*_scr.width(), _scale*_scr.height());
   pnt.drawImage(target, _scr);
@@ -70,12 +142,36 @@ void Chip8::paintEvent(QPaintEvent *event)
 //slot
 void Chip8::screenInvalidated()
 {
-  _scr = QImage(
-    _emu.SCR.Data(),
-    _emu.SCR.Width(), _emu.SCR.Height(), _emu.SCR.BytesPerLine(),
-    QImage::Format::Format_Indexed8
-    );
-  _scr.setColorTable(_pallette);
+  TIMELINE_SPAN("present");
+  if (_emu.SCR.IsColour()) {
+    // megachip: 256x192 in the colours of the rom, without the anti-flicker filter
+    int width = static_cast<int>(_emu.SCR.colourWidth);
+    int height = static_cast<int>(_emu.SCR.colourHeight);
+    if (_scr.width() != width || _scr.height() != height)
+      _scr = QImage(width, height, QImage::Format::Format_Indexed8);
+    loadColourPallette();
+    _scr.setColorTable(_colourPallette);
+    _emu.SCR.RenderColour(_scr.bits(), _scr.bytesPerLine());
+    Metrics::Add(MetricFramesPresented);
+    update();
+    return;
+  }
+
+  int width = static_cast<int>(_emu.SCR.Width());
+  int height = static_cast<int>(_emu.SCR.Height());
+  bool blend = _blender.GetMode() != FrameBlender::BlendOff;
+  if (_scr.width() != width || _scr.height() != height) {
+    _scr = QImage(width, height, QImage::Format::Format_Indexed8);
+    _scr.setColorTable(blend ? _greyPallette : _pallette);
+  }
+  if (blend) {
+    _emu.SCR.Render(_frame, width);
+    _blender.Blend(_frame, width, height, _scr.bits(), _scr.bytesPerLine());
+  }
+  else {
+    _emu.SCR.Render(_scr.bits(), _scr.bytesPerLine());
+  }
+  Metrics::Add(MetricFramesPresented);
 
   update();
 }
@@ -85,14 +181,19 @@ void Chip8::screenInvalidated()
 void Chip8::registerKey(bool down, int key)
 {
   if (key >= '0' && key <= '9') {
-    _emu.SetKey(key - '0', down);
+    _emuThread.postKey(key - '0', down);
   }
   if (key >= 'A' && key <= 'F') {
-    _emu.SetKey(key - 'A' + 10, down );
+    _emuThread.postKey(key - 'A' + 10, down);
   }
 }
 
-bool Chip8::eventFilter(QObject * /*object*/, QEvent *event){
+bool Chip8::eventFilter(QObject *object, QEvent *event){
+
+  // keys of other windows, like a grid, are theirs
+  QWidget *widget = qobject_cast<QWidget *>(object);
+  if (widget == NULL || widget->window() != this)
+    return false;
 
   if (event->type() == QEvent::KeyPress) {
     QKeyEvent *keyEvent = static_cast<QKeyEvent *>(event);
@@ -114,7 +215,9 @@ bool Chip8::eventFilter(QObject * /*object*/, QEvent *event){
 
 void Chip8::timerTick()
 {
-  _emu.DecreaseTimers();
+  // the emulator thread runs the timers, in emulated time.
+  TIMELINE_SPAN("timer tick");
+  UpdateSpeed();
 }
 
 
@@ -124,7 +227,7 @@ void Chip8::openGame()
 
   fileName = QFileDialog::getOpenFileName(this, tr("Open File"),
     "",
-    tr("Chip 8 Files (*.ch8);;All files (*.*)")
+    tr("Chip 8 Files (*.ch8);;Super Chip Files (*.sc8);;XO-Chip Files (*.xo8);;MegaChip Files (*.mc8);;All files (*.*)")
     );
 
   if (!fileName.isEmpty())
@@ -132,14 +235,62 @@ void Chip8::openGame()
     QFile progFile(fileName);
     if (progFile.open(QIODevice::ReadOnly))
     {
+      // the emulator thread reads the analysis and the memory being
+      // replaced, it must be stopped first. it goes on with the new rom.
+      bool wasRunning = _emuThread.isRunning();
+      stopEmulator();
+
       QByteArray progData = progFile.readAll();
-      _emu.Init(Emulator::CHIP8);
+      Emulator::ChipMode mode = Emulator::CHIP8;
+      if (fileName.endsWith(".xo8", Qt::CaseInsensitive))
+        mode = Emulator::XOCHIP;
+      else if (fileName.endsWith(".sc8", Qt::CaseInsensitive))
+        mode = Emulator::SCHIP;
+      else if (fileName.endsWith(".mc8", Qt::CaseInsensitive))
+        mode = Emulator::MEGACHIP;
+      Q_ASSERT(!_emuThread.isRunning());        // Init needs an idle emulator
+      _emu.Init(mode);
       _emu.storeProgram((uint8_t*)(progData.data()), progData.size());
+
+      // analysis is mapped from the cache if the rom was loaded before
+      QString cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+      QDir().mkpath(cacheDir);
+      AnalysisCache cache(QDir::toNativeSeparators(cacheDir).toLocal8Bit().constData());
+      cache.Load(_analysis, (const uint8_t*)(progData.constData()), progData.size(), mode);
+      _emu.SetAnalysis(&_analysis);
+
+      // quirks the rom needs, detected on the first load
+      QuirkCache quirkCache(QDir::toNativeSeparators(cacheDir).toLocal8Bit().constData());
+      int quirks = quirkCache.Load((const uint8_t*)(progData.constData()), progData.size(), mode);
+      _emu.SetQuirks(quirks);
+      ui.statusBar->showMessage(QString("Quirks: %1").arg(QuirkDetector::Names(quirks).c_str()), 5000);
+
+      // both peers start from here
+      if (_netplayOn)
+        _netplay.Start(_netplayDelay);
+
+      if (wasRunning)
+        play();
     }
   }
 
 }
 
+void Chip8::openGrid()
+{
+  QStringList fileNames = QFileDialog::getOpenFileNames(this, tr("Open Files"),
+    "",
+    tr("Chip 8 Files (*.ch8);;Super Chip Files (*.sc8);;XO-Chip Files (*.xo8);;MegaChip Files (*.mc8);;All files (*.*)")
+    );
+
+  if (!fileNames.isEmpty())
+  {
+    GridWindow *grid = new GridWindow(fileNames);
+    grid->setAttribute(Qt::WA_DeleteOnClose);
+    grid->show();
+  }
+}
+
 void Chip8::zoomIn()
 {
 }
@@ -165,8 +316,106 @@ void Chip8::pause()
   }
 }
 
+void Chip8::stopEmulator()
+{
+  // the thread may be waiting for the window to take a screen, a blocking
+  // wait here would never end. events other than input are handled meanwhile.
+  _emuThread.stop();
+  while (!_emuThread.wait(1))
+    QCoreApplication::processEvents(QEventLoop::ExcludeUserInputEvents);
+  UpdateUI();
+}
+
+void Chip8::fastForward()
+{
+  // cycle through 1x, 2x, 4x and unlimited
+  int speed = _emuThread.getSpeed();
+  if (speed == 1)
+    speed = 2;
+  else if (speed == 2)
+    speed = 4;
+  else if (speed == 4)
+    speed = 0;
+  else
+    speed = 1;
+  _emuThread.setSpeed(speed);
+  UpdateUI();
+}
+
+void Chip8::antiFlicker()
+{
+  // cycles off, max, phosphor, majority
+  static const char *names[FrameBlender::nrBlendModes] = { "Off", "Max", "Phosphor", "Majority" };
+  int mode = (_blender.GetMode() + 1) % FrameBlender::nrBlendModes;
+  _blender.SetMode(static_cast<FrameBlender::Mode>(mode));
+  _scr.setColorTable(mode != FrameBlender::BlendOff ? _greyPallette : _pallette);
+  ui.actionAntiFlicker->setText(QString("Anti-Flicker: %1").arg(names[mode]));
+  UpdateUI();
+}
+
 void Chip8::UpdateUI()
 {
   ui.actionStartEmulator->setChecked(_emuThread.isRunning());
   ui.actionPauseEmulator->setChecked(_emuThread.isFinished());
+  ui.actionFastForward->setChecked(_emuThread.getSpeed() != 1);
+  ui.actionAntiFlicker->setChecked(_blender.GetMode() != FrameBlender::BlendOff);
+}
+
+void Chip8::UpdateSpeed()
+{
+  qint64 elapsed = _speedClock.elapsed();
+  if (elapsed < 1000)
+    return;
+
+  uint64_t instructions = _emuThread.instructionCount();
+  uint64_t frames = _emuThread.frameCount();
+  double seconds = elapsed / 1000.0;
+  double multiplier = (frames - _speedFrames) / seconds / 60.0;
+  double mips = (instructions - _speedInstructions) / seconds / 1e6;
+  _speedInstructions = instructions;
+  _speedFrames = frames;
+  _speedClock.restart();
+
+  int speed = _emuThread.getSpeed();
+  QString target = speed > 0 ? QString("%1x").arg(speed) : QString("unlimited");
+  if (speed == 0)
+    _speedLabel->setText(QString("%1x (%2), %3 MIPS").arg(multiplier, 0, 'f', 1).arg(target).arg(mips, 0, 'f', 2));
+  else
+    _speedLabel->setText(QString("%1x (%2)").arg(multiplier, 0, 'f', 1).arg(target));
+
+  // share of the emulator thread spent running frames, rather than sleeping
+  // or waiting for the window
+  uint64_t emulationNs = Metrics::Get(MetricEmulationNs);
+  uint64_t sleepNs = Metrics::Get(MetricSleepNs);
+  uint64_t presented = Metrics::Get(MetricFramesPresented);
+  double busy = (emulationNs - _metricsEmulationNs) / (seconds * 1e9) * 100.0;
+  double slept = (sleepNs - _metricsSleepNs) / (seconds * 1e9) * 100.0;
+  double fps = (presented - _metricsPresented) / seconds;
+  _metricsEmulationNs = emulationNs;
+  _metricsSleepNs = sleepNs;
+  _metricsPresented = presented;
+
+  uint64_t errors = 0;
+  for (int type = 1; type < Emulator::nrErrorTypes; type++)
+    errors += Metrics::Get(static_cast<Metric>(MetricErrors + type));
+  QString text = QString("emulating %1%, sleeping %2%, %3 fps shown, %4 errors, %5 keys queued")
+    .arg(busy, 0, 'f', 0).arg(slept, 0, 'f', 0).arg(fps, 0, 'f', 0).arg(errors)
+    .arg(Metrics::Get(MetricKeyQueueDepth));
+  uint64_t runAheadFrames = Metrics::Get(MetricRunAheadFrames);
+  uint64_t runAheadNs = Metrics::Get(MetricRunAheadNs);
+  if (runAheadFrames > _metricsRunAheadFrames) {
+    // the cost of a frame ahead, with its share of saving and restoring
+    text += QString(", run-ahead %1: %2 us per frame")
+      .arg(_emuThread.getRunAhead())
+      .arg((runAheadNs - _metricsRunAheadNs) / 1e3 / (runAheadFrames - _metricsRunAheadFrames), 0, 'f', 1);
+  }
+  _metricsRunAheadFrames = runAheadFrames;
+  _metricsRunAheadNs = runAheadNs;
+  if (_netplayOn) {
+    // read from the emulator thread, may be a frame old
+    const NetplayStats &stats = _netplay.Stats();
+    text += QString(", netplay: %1 rollbacks, max depth %2, max resimulation %3 us, %4 stalls")
+      .arg(stats.rollbacks).arg(stats.maxDepth).arg(stats.maxResimNs / 1e3, 0, 'f', 0).arg(stats.stalls);
+  }
+  _metricsLabel->setText(text);
 }
\ No newline at end of file
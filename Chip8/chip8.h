@@ -2,10 +2,18 @@
 #define CHIP8_H
 
 #include <QtWidgets/QMainWindow>
+#include <QElapsedTimer>
+#include <QLabel>
 #include "ui_chip8.h"
 
 #include "Emulator.h"
 #include "emulatorthread.h"
+#include "analysis.h"
+#include "metrics.h"
+#include "frameblend.h"
+#include "netplay.h"
+#include "quirks.h"
+#include "gridwindow.h"
 
 class Chip8 : public QMainWindow
 {
@@ -19,16 +27,39 @@ private:
 	Ui::Chip8Class ui;
 	EmulatorThread _emuThread;
   Emulator _emu;
+  CodeAnalysis _analysis;       // analysis of the loaded rom, from the analysis cache
   QVector<QRgb> _pallette;      // a palette, used in _scr.
+  QVector<QRgb> _greyPallette;  // palette of _scr when the anti-flicker filter is on
+  QVector<QRgb> _colourPallette; // palette of _scr in megachip mode, loaded by the rom
+  FrameBlender _blender;        // anti-flicker filter
+  uint8_t _frame[FrameBlender::maxSize]; // emulator screen before blending
   QImage _scr;                  // a copy of the emulator screen, in QImage format
   int _scale;                   // factor to multiply the bitmap.
   QTimer *_timer;
+  QLabel *_speedLabel;          // effective speed, in the status bar
+  QElapsedTimer _speedClock;
+  uint64_t _speedInstructions;  // thread counters at last speed update
+  uint64_t _speedFrames;
+  QLabel *_metricsLabel;        // emulator thread load, presented frames, errors and key queue
+  uint64_t _metricsEmulationNs; // metrics at last update
+  uint64_t _metricsSleepNs;
+  uint64_t _metricsPresented;
+  uint64_t _metricsRunAheadFrames;
+  uint64_t _metricsRunAheadNs;
+  MetricsExporter _metricsExporter;
+  UdpTransport _netplayTransport;
+  NetplaySession _netplay;      // used if CHIP8_NETPLAY is set
+  bool _netplayOn;
+  int _netplayDelay;
 
 private:
   void initPallette();
+  void loadColourPallette();
   void initBitmap();
   virtual void paintEvent(QPaintEvent *event);
   void UpdateUI();
+  void UpdateSpeed();
+  void stopEmulator();          // stops the emulator thread and waits for it to end
   // key handling
   void registerKey(bool down, int key);
   virtual bool eventFilter(QObject * /*object*/ , QEvent *event);
@@ -37,10 +68,13 @@ public slots:
   void screenInvalidated();
   void timerTick();
 	void openGame();
+  void openGrid();
 	void zoomIn();
 	void zoomOut();
   void play();
   void pause();
+  void fastForward();
+  void antiFlicker();
 };
 
 #endif // CHIP8_H
@@ -0,0 +1,95 @@
+#include "chip8env.h"
+#include "environment.h"
+
+static_assert(C8ENV_OBS_SIZE == Environment::obsSize, "observation size differs");
+
+static bool ValidMode(int mode)
+{
+  return mode >= Emulator::CHIP8 && mode <= Emulator::XOCHIP;
+}
+
+struct c8env {
+  Environment env;
+  c8env(const uint8_t *rom, size_t romSize, int mode, int framesPerStep)
+  : env(rom, romSize, static_cast<Emulator::ChipMode>(mode), framesPerStep) {}
+};
+
+struct c8env_vec {
+  VectorEnvironment vec;
+  c8env_vec(const uint8_t *rom, size_t romSize, int mode, int framesPerStep, int nrEnvs, int nrThreads)
+  : vec(rom, romSize, static_cast<Emulator::ChipMode>(mode), framesPerStep, nrEnvs, nrThreads) {}
+};
+
+c8env *c8env_create(const uint8_t *rom, size_t rom_size, int mode, int frames_per_step)
+{
+  if (!ValidMode(mode))
+    return NULL;
+  return new c8env(rom, rom_size, mode, frames_per_step);
+}
+
+void c8env_destroy(c8env *env)
+{
+  delete env;
+}
+
+void c8env_add_reward(c8env *env, uint16_t addr, float scale)
+{
+  env->env.AddReward(addr, scale);
+}
+
+void c8env_set_done(c8env *env, uint16_t addr, uint8_t mask, uint8_t value)
+{
+  env->env.SetDone(addr, mask, value);
+}
+
+void c8env_reset(c8env *env, uint32_t seed, uint8_t *obs)
+{
+  env->env.Reset(seed, obs);
+}
+
+float c8env_step(c8env *env, uint16_t keys, uint8_t *obs, int *done)
+{
+  bool isDone;
+  float reward = env->env.Step(keys, obs, isDone);
+  if (done != NULL)
+    *done = isDone ? 1 : 0;
+  return reward;
+}
+
+uint8_t c8env_peek(const c8env *env, uint16_t addr)
+{
+  return env->env.Machine().PeekMemory(addr);
+}
+
+c8env_vec *c8env_vec_create(const uint8_t *rom, size_t rom_size, int mode,
+  int frames_per_step, int num_envs, int num_threads)
+{
+  if (!ValidMode(mode))
+    return NULL;
+  return new c8env_vec(rom, rom_size, mode, frames_per_step, num_envs, num_threads);
+}
+
+void c8env_vec_destroy(c8env_vec *vec)
+{
+  delete vec;
+}
+
+void c8env_vec_add_reward(c8env_vec *vec, uint16_t addr, float scale)
+{
+  vec->vec.AddReward(addr, scale);
+}
+
+void c8env_vec_set_done(c8env_vec *vec, uint16_t addr, uint8_t mask, uint8_t value)
+{
+  vec->vec.SetDone(addr, mask, value);
+}
+
+void c8env_vec_reset(c8env_vec *vec, uint32_t seed, uint8_t *obs)
+{
+  vec->vec.Reset(seed, obs);
+}
+
+void c8env_vec_step(c8env_vec *vec, const uint16_t *keys, uint8_t *obs, float *rewards, int *dones)
+{
+  vec->vec.Step(keys, obs, rewards, dones);
+}
@@ -0,0 +1,55 @@
+#ifndef CHIP8ENV_H
+#define CHIP8ENV_H
+
+/*
+ * C interface to Environment and VectorEnvironment, for use from other
+ * languages. Observations are C8ENV_OBS_WIDTH x C8ENV_OBS_HEIGHT bytes per
+ * environment, one palette index per pixel. Keys are a bitfield, bit n is
+ * key n.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef C8ENV_DLL
+#define C8ENV_API __declspec(dllexport)
+#else
+#define C8ENV_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define C8ENV_OBS_WIDTH   128
+#define C8ENV_OBS_HEIGHT  64
+#define C8ENV_OBS_SIZE    (C8ENV_OBS_WIDTH * C8ENV_OBS_HEIGHT)
+
+/* mode: 0 chip-8, 1 super chip, 2 xo-chip. megachip does not fit the
+ * observation, the create functions return NULL for it and for any other
+ * mode. */
+typedef struct c8env c8env;
+typedef struct c8env_vec c8env_vec;
+
+C8ENV_API c8env *c8env_create(const uint8_t *rom, size_t rom_size, int mode, int frames_per_step);
+C8ENV_API void c8env_destroy(c8env *env);
+C8ENV_API void c8env_add_reward(c8env *env, uint16_t addr, float scale);
+C8ENV_API void c8env_set_done(c8env *env, uint16_t addr, uint8_t mask, uint8_t value);
+C8ENV_API void c8env_reset(c8env *env, uint32_t seed, uint8_t *obs);
+C8ENV_API float c8env_step(c8env *env, uint16_t keys, uint8_t *obs, int *done);
+C8ENV_API uint8_t c8env_peek(const c8env *env, uint16_t addr);
+
+C8ENV_API c8env_vec *c8env_vec_create(const uint8_t *rom, size_t rom_size, int mode,
+  int frames_per_step, int num_envs, int num_threads);
+C8ENV_API void c8env_vec_destroy(c8env_vec *vec);
+C8ENV_API void c8env_vec_add_reward(c8env_vec *vec, uint16_t addr, float scale);
+C8ENV_API void c8env_vec_set_done(c8env_vec *vec, uint16_t addr, uint8_t mask, uint8_t value);
+/* obs holds num_envs observations, environment i at obs + i * C8ENV_OBS_SIZE */
+C8ENV_API void c8env_vec_reset(c8env_vec *vec, uint32_t seed, uint8_t *obs);
+C8ENV_API void c8env_vec_step(c8env_vec *vec, const uint16_t *keys, uint8_t *obs, float *rewards, int *dones);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CHIP8ENV_H */
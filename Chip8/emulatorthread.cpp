@@ -1,14 +1,35 @@
 #include "emulatorthread.h"
 #include <iostream>
+#include <chrono>
 
 #include "Emulator.h"
+#include "metrics.h"
+#include "netplay.h"
+#include "timeline.h"
+
+typedef std::chrono::steady_clock Clock;
+
+// one 60Hz frame, in emulated time. at normal speed, this is also the
+// interval at which the ui is refreshed.
+static const Clock::duration framePeriod = std::chrono::microseconds(16667);
+
+// in unlimited mode, frames are run in batches between clock checks
+static const int unlimitedBatch = 64;
 
 EmulatorThread::EmulatorThread(Emulator *emu)
-: QThread()
-  
+: QThread(),
+  runAhead(*emu)
 {
   c8emu = emu;
   stopped = false;
+  speed = 1;
+  instructions = 0;
+  frames = 0;
+  keyHead = 0;
+  keyTail = 0;
+  netplay = NULL;
+  localKeys = 0;
+  runAheadFrames = 0;
 }
 
 EmulatorThread::~EmulatorThread()
@@ -19,13 +40,90 @@ EmulatorThread::~EmulatorThread()
 void EmulatorThread::run()
 {
   stopped = false;
+  Clock::time_point frameDeadline = Clock::now();
+  Clock::time_point nextPublish = frameDeadline;
+  bool pendingScreen = false;
+  TIMELINE_THREAD("emulator");
+
   while (!stopped)
   {
-    c8emu->DoInstruction();
-    msleep(1);
-    if (c8emu->ScreenIsInvalidated()) {
-      // send signal to UI
+    int multiplier = netplay != NULL ? 1 : speed;     // netplay peers run in step
+    int batch = multiplier > 0 ? 1 : unlimitedBatch;
+    Metrics::Set(MetricTargetInstructionsPerSecond, multiplier * 60 * Emulator::instructionsPerFrame);
+
+    Clock::time_point batchStart = Clock::now();
+    int executed = 0;
+    {
+      TIMELINE_SPAN("frame");
+      for (int frame = 0; frame < batch; frame++) {
+        applyKeys();
+        if (netplay != NULL) {
+          // a stalled frame runs nothing, the peer catches up meanwhile
+          uint64_t before = netplay->Stats().instructions;
+          if (!netplay->AdvanceFrame(localKeys))
+            batch = 0;
+          executed += static_cast<int>(netplay->Stats().instructions - before);
+          if (netplay->LastRollback() > 0)
+            pendingScreen = true;
+        }
+        else {
+          executed += c8emu->DoFrame();
+        }
+        if (c8emu->ScreenIsInvalidated())
+          pendingScreen = true;
+      }
+    }
+    // in unlimited mode only the last frame of a batch is published
+    if (exporter.IsStarted())
+      exporter.Publish(*c8emu);
+    instructions += executed;
+    frames += batch;
+    Metrics::Add(MetricInstructions, executed);
+    Metrics::Add(MetricFrames, batch);
+
+    // run ahead to the screen to show. when it is switched on or off, the
+    // screen jumps, so it is shown either way.
+    int ahead = multiplier == 1 && netplay == NULL ? runAheadFrames.load() : 0;
+    if (ahead != runAhead.Frames()) {
+      runAhead.SetFrames(ahead);
+      pendingScreen = true;
+    }
+    if (ahead > 0) {
+      TIMELINE_SPAN("run ahead");
+      if (runAhead.Advance())
+        pendingScreen = true;
+    }
+
+    // at normal speed every changed frame is shown. when running faster,
+    // at most one frame per host refresh is, so presenting does not
+    // limit the speed.
+    Clock::time_point now = Clock::now();
+    Metrics::Add(MetricEmulationNs, std::chrono::duration_cast<std::chrono::nanoseconds>(now - batchStart).count());
+    if (pendingScreen && (multiplier == 1 || now >= nextPublish)) {
+      // send signal to UI, and wait for it to take the screen
+      TIMELINE_SPAN("wait for gui");
       emit screenInvalidated();
+      pendingScreen = false;
+      nextPublish = now + framePeriod;
+    }
+    runAhead.Restore();
+
+    if (multiplier > 0) {
+      frameDeadline += framePeriod / multiplier;
+      if (frameDeadline > now) {
+        TIMELINE_SPAN("sleep");
+        Clock::time_point sleepStart = Clock::now();
+        usleep(std::chrono::duration_cast<std::chrono::microseconds>(frameDeadline - now).count());
+        Metrics::Add(MetricSleepNs, std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - sleepStart).count());
+      }
+      else if (now - frameDeadline > 4 * framePeriod) {
+        // too far behind, for example after a long blocking paint.
+        // continue from now instead of running a burst of frames.
+        frameDeadline = now;
+      }
+    }
+    else {
+      frameDeadline = now;
     }
   }
 
@@ -36,3 +134,39 @@ void EmulatorThread::stop()
 {
   stopped = true;
 }
+
+void EmulatorThread::postKey(int key, bool down)
+{
+  Metrics::Add(MetricKeyEvents);
+  TIMELINE_VALUE(down ? "key down" : "key up", key);
+  uint32_t head = keyHead.load(std::memory_order_relaxed);
+  uint32_t tail = keyTail.load(std::memory_order_acquire);
+  if (head - tail >= keyQueueSize) {
+    Metrics::Add(MetricKeyEventsDropped);
+    return;
+  }
+  keyQueue[head % keyQueueSize] = static_cast<uint8_t>((key & 0xF) | (down ? 0x10 : 0));
+  keyHead.store(head + 1, std::memory_order_release);
+}
+
+void EmulatorThread::applyKeys()
+{
+  uint32_t tail = keyTail.load(std::memory_order_relaxed);
+  uint32_t head = keyHead.load(std::memory_order_acquire);
+  // the gauge has this one writer: the depth the frame found
+  Metrics::Set(MetricKeyQueueDepth, head - tail);
+  if (tail == head)
+    return;
+  TIMELINE_VALUE("keys applied", static_cast<int32_t>(head - tail));
+  for (; tail != head; tail++) {
+    uint8_t event = keyQueue[tail % keyQueueSize];
+    if (netplay != NULL) {
+      uint16_t bit = static_cast<uint16_t>(1 << (event & 0xF));
+      localKeys = (event & 0x10) != 0 ? localKeys | bit : localKeys & ~bit;
+    }
+    else {
+      c8emu->SetKey(event & 0xF, (event & 0x10) != 0);
+    }
+  }
+  keyTail.store(tail, std::memory_order_release);
+}
@@ -2,8 +2,14 @@
 #define EMULATORTHREAD_H
 
 class Emulator;
+class NetplaySession;
 
 #include <QThread>
+#include <atomic>
+#include <string>
+
+#include "stateexport.h"
+#include "runahead.h"
 
 class EmulatorThread : public QThread
 {
@@ -14,6 +20,34 @@ public:
   ~EmulatorThread();
   void stop();
 
+  // speed multiplier: 1 is real time, 2 and 4 run faster, 0 runs as fast
+  // as possible. timers always count in emulated time.
+  void setSpeed(int multiplier) { speed = multiplier; }
+  int getSpeed() const { return speed; }
+
+  // key events from the ui thread. they are queued and applied by the
+  // emulator thread at the start of a frame, so keys never change in the
+  // middle of one.
+  void postKey(int key, bool down);
+
+  // publishes the machine state to shared memory after every frame, see
+  // stateexport.h. call before starting the thread.
+  bool exportState(const std::string &name) { return exporter.Start(name); }
+
+  // runs the frames through a netplay session, which sends the local keys
+  // to the other player. always at normal speed. set before starting the
+  // thread.
+  void setNetplay(NetplaySession *session) { netplay = session; }
+
+  // shows the screen frames ahead of the game, see runahead.h. 0 is off.
+  // only at normal speed and without netplay.
+  void setRunAhead(int frames) { runAheadFrames = frames < 0 ? 0 : (frames > RunAhead::maxFrames ? RunAhead::maxFrames : frames); }
+  int getRunAhead() const { return runAheadFrames; }
+
+  // counters, for the speed readout of the ui
+  uint64_t instructionCount() const { return instructions; }   // executed, without skipped idle loop iterations
+  uint64_t frameCount() const { return frames; }
+
 signals:
   void screenInvalidated();
   void threadExit();
@@ -21,9 +55,24 @@ signals:
 private:
   Emulator *c8emu;
   void run();
+  void applyKeys();
 
 private:
   volatile bool stopped;
+  std::atomic<int> speed;
+  std::atomic<uint64_t> instructions;
+  std::atomic<uint64_t> frames;
+  StateExporter exporter;
+  NetplaySession *netplay;
+  uint16_t localKeys;               // key bitfield, for netplay
+  RunAhead runAhead;
+  std::atomic<int> runAheadFrames;
+
+  // single producer, single consumer ring of key events: key | down << 4
+  static const uint32_t keyQueueSize = 64;
+  uint8_t keyQueue[keyQueueSize];
+  std::atomic<uint32_t> keyHead;    // written by the ui thread
+  std::atomic<uint32_t> keyTail;    // written by the emulator thread
 };
 
 #endif // EMULATORTHREAD_H
@@ -0,0 +1,216 @@
+#include "environment.h"
+
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////
+//
+// Environment class
+
+Environment::Environment(const uint8_t *rom, size_t romSize, Emulator::ChipMode mode, int framesPerStep)
+: framesPerStep(framesPerStep), hasDone(false), doneAddr(0), doneMask(0), doneValue(0)
+{
+  initial.Init(mode);
+  initial.storeProgram(const_cast<uint8_t *>(rom), romSize);
+  initial.Fork(emu);
+  memset(lores, 0, sizeof(lores));
+}
+
+void Environment::AddReward(uint16_t addr, float scale)
+{
+  RewardHook hook;
+  hook.addr = addr;
+  hook.scale = scale;
+  hook.last = emu.PeekMemory(addr);
+  rewards.push_back(hook);
+}
+
+void Environment::SetDone(uint16_t addr, uint8_t mask, uint8_t value)
+{
+  hasDone = true;
+  doneAddr = addr;
+  doneMask = mask;
+  doneValue = value;
+}
+
+void Environment::Reset(uint32_t seed, uint8_t *obs)
+{
+  // forking the loaded machine is cheaper than loading the rom again, and
+  // gives the same state every time.
+  initial.Fork(emu);
+  emu.Seed(seed);
+  for (size_t idx = 0; idx < rewards.size(); idx++)
+    rewards[idx].last = emu.PeekMemory(rewards[idx].addr);
+  if (obs != NULL)
+    Observe(obs);
+}
+
+float Environment::Step(uint16_t keys, uint8_t *obs, bool &done)
+{
+  emu.SetKeys(keys);
+  done = false;
+  for (int frame = 0; frame < framesPerStep && !done; frame++) {
+    emu.DoFrame();
+    done = IsDone();
+  }
+
+  float reward = 0.0f;
+  for (size_t idx = 0; idx < rewards.size(); idx++) {
+    RewardHook &hook = rewards[idx];
+    uint8_t value = emu.PeekMemory(hook.addr);
+    reward += hook.scale * (static_cast<int>(value) - static_cast<int>(hook.last));
+    hook.last = value;
+  }
+
+  if (obs != NULL)
+    Observe(obs);
+  return reward;
+}
+
+bool Environment::IsDone() const
+{
+  if (emu.ErrorOccured())
+    return true;
+  return hasDone && (emu.PeekMemory(doneAddr) & doneMask) == doneValue;
+}
+
+void Environment::Observe(uint8_t *obs)
+{
+  if (emu.SCR.IsHires()) {
+    emu.SCR.Render(obs, obsWidth);
+    return;
+  }
+
+  // scale the 64x32 screen up to the observation size
+  const int width = obsWidth / 2;
+  emu.SCR.Render(lores, width);
+  for (int y = 0; y < obsHeight / 2; y++) {
+    const uint8_t *src = &lores[y * width];
+    uint8_t *dst = &obs[2 * y * obsWidth];
+    for (int x = 0; x < width; x++)
+      dst[2 * x] = dst[2 * x + 1] = src[x];
+    memcpy(dst + obsWidth, dst, obsWidth);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+//
+// VectorEnvironment class
+
+VectorEnvironment::VectorEnvironment(const uint8_t *rom, size_t romSize, Emulator::ChipMode mode,
+  int framesPerStep, int nrEnvs, int nrThreads)
+: seedStride(static_cast<uint32_t>(nrEnvs)),
+  jobKeys(NULL), jobObs(NULL), jobRewards(NULL), jobDones(NULL),
+  generation(0), running(0), stopping(false)
+{
+  envs.reserve(nrEnvs);
+  for (int idx = 0; idx < nrEnvs; idx++)
+    envs.push_back(Environment(rom, romSize, mode, framesPerStep));
+  seeds.resize(nrEnvs, 0);
+
+  // the calling thread is worker 0, so one thread means no extra threads
+  if (nrThreads < 1)
+    nrThreads = 1;
+  if (nrThreads > nrEnvs)
+    nrThreads = nrEnvs;
+  for (int worker = 1; worker < nrThreads; worker++)
+    workers.push_back(std::thread(&VectorEnvironment::WorkerLoop, this, worker));
+}
+
+VectorEnvironment::~VectorEnvironment()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  startCond.notify_all();
+  for (size_t idx = 0; idx < workers.size(); idx++)
+    workers[idx].join();
+}
+
+void VectorEnvironment::AddReward(uint16_t addr, float scale)
+{
+  for (size_t idx = 0; idx < envs.size(); idx++)
+    envs[idx].AddReward(addr, scale);
+}
+
+void VectorEnvironment::SetDone(uint16_t addr, uint8_t mask, uint8_t value)
+{
+  for (size_t idx = 0; idx < envs.size(); idx++)
+    envs[idx].SetDone(addr, mask, value);
+}
+
+void VectorEnvironment::Reset(uint32_t seed, uint8_t *obs)
+{
+  for (size_t idx = 0; idx < envs.size(); idx++) {
+    seeds[idx] = seed + static_cast<uint32_t>(idx);
+    envs[idx].Reset(seeds[idx], obs != NULL ? obs + idx * Environment::obsSize : NULL);
+  }
+}
+
+void VectorEnvironment::Step(const uint16_t *keys, uint8_t *obs, float *rewards, int *dones)
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    jobKeys = keys;
+    jobObs = obs;
+    jobRewards = rewards;
+    jobDones = dones;
+    running = static_cast<int>(workers.size());
+    generation++;
+  }
+  startCond.notify_all();
+
+  StepRange(0);
+
+  std::unique_lock<std::mutex> guard(lock);
+  doneCond.wait(guard, [this] { return running == 0; });
+}
+
+void VectorEnvironment::StepRange(int worker)
+{
+  // every worker takes a contiguous range, so observations written by one
+  // thread stay together in memory.
+  size_t nrWorkers = workers.size() + 1;
+  size_t first = envs.size() * worker / nrWorkers;
+  size_t last = envs.size() * (worker + 1) / nrWorkers;
+
+  for (size_t idx = first; idx < last; idx++) {
+    uint8_t *obs = jobObs != NULL ? jobObs + idx * Environment::obsSize : NULL;
+    bool done;
+    float reward = envs[idx].Step(jobKeys[idx], obs, done);
+    if (jobRewards != NULL)
+      jobRewards[idx] = reward;
+    if (jobDones != NULL)
+      jobDones[idx] = done ? 1 : 0;
+    if (done) {
+      // the observation stays the last frame of the episode
+      seeds[idx] += seedStride;
+      envs[idx].Reset(seeds[idx], NULL);
+    }
+  }
+}
+
+void VectorEnvironment::WorkerLoop(int worker)
+{
+  uint64_t seen = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      startCond.wait(guard, [this, seen] { return stopping || generation != seen; });
+      if (stopping)
+        return;
+      seen = generation;
+    }
+
+    StepRange(worker);
+
+    bool last;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      last = --running == 0;
+    }
+    if (last)
+      doneCond.notify_one();
+  }
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "Emulator.h"
+
+///////////////////////////////////////////////////////////////////////////
+//
+// Environment. Runs a rom as a reinforcement learning environment: a step
+// sets the keys, runs a number of frames and returns a reward. Rewards and
+// the done flag are read from bytes of emulator memory, so they can be set
+// up per game without code.
+//
+// Observations are the screen as one palette index per pixel, always
+// obsWidth x obsHeight. Low resolution screens are scaled up 2x.
+
+class Environment
+{
+public:
+  static const int obsWidth = 128;
+  static const int obsHeight = 64;
+  static const size_t obsSize = obsWidth * obsHeight;
+
+  Environment(const uint8_t *rom, size_t romSize, Emulator::ChipMode mode, int framesPerStep);
+
+  // reward += scale * (byte at addr after the step - byte before the step)
+  void AddReward(uint16_t addr, float scale);
+  // episode is done when (byte at addr & mask) == value, or on an emulator error
+  void SetDone(uint16_t addr, uint8_t mask, uint8_t value);
+
+  // obs may be NULL if no observation is wanted
+  void Reset(uint32_t seed, uint8_t *obs);
+  float Step(uint16_t keys, uint8_t *obs, bool &done);
+
+  const Emulator &Machine() const { return emu; }
+
+private:
+  struct RewardHook {
+    uint16_t addr;
+    float scale;
+    uint8_t last;
+  };
+
+  Emulator initial;                 // machine right after loading the rom, forked on reset
+  Emulator emu;
+  int framesPerStep;
+  std::vector<RewardHook> rewards;
+  bool hasDone;
+  uint16_t doneAddr;
+  uint8_t doneMask;
+  uint8_t doneValue;
+  uint8_t lores[obsSize / 4];       // low resolution screen, before scaling
+
+  void Observe(uint8_t *obs);
+  bool IsDone() const;
+};
+
+///////////////////////////////////////////////////////////////////////////
+//
+// VectorEnvironment. Steps a number of environments at once on a pool of
+// worker threads. Observations of all environments go into one buffer
+// supplied by the caller, environment i at obs + i * Environment::obsSize.
+// An environment that is done is reset automatically, with the next seed
+// of its own sequence, so runs are repeatable.
+
+class VectorEnvironment
+{
+public:
+  VectorEnvironment(const uint8_t *rom, size_t romSize, Emulator::ChipMode mode,
+    int framesPerStep, int nrEnvs, int nrThreads);
+  ~VectorEnvironment();
+
+  int Count() const { return static_cast<int>(envs.size()); }
+  void AddReward(uint16_t addr, float scale);
+  void SetDone(uint16_t addr, uint8_t mask, uint8_t value);
+
+  void Reset(uint32_t seed, uint8_t *obs);
+  void Step(const uint16_t *keys, uint8_t *obs, float *rewards, int *dones);
+
+private:
+  std::vector<Environment> envs;
+  std::vector<uint32_t> seeds;      // seed of the current episode, per environment
+  uint32_t seedStride;
+
+  // work of the current step. written by Step before the workers start.
+  const uint16_t *jobKeys;
+  uint8_t *jobObs;
+  float *jobRewards;
+  int *jobDones;
+
+  std::vector<std::thread> workers;
+  std::mutex lock;
+  std::condition_variable startCond;
+  std::condition_variable doneCond;
+  uint64_t generation;              // incremented for every step
+  int running;                      // workers still busy with the step
+  bool stopping;
+
+  void StepRange(int worker);
+  void WorkerLoop(int worker);
+};
@@ -0,0 +1,183 @@
+#include "frameblend.h"
+
+#include <string.h>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define FRAMEBLEND_SSE2
+#endif
+
+// intensities of the palette indices: plane 0 white, plane 1 light grey,
+// both planes dark grey, like the colour palette of the window
+static const uint8_t intensities[4] = { 0, 255, 170, 85 };
+
+///////////////////////////////////////////////////////////////////////////
+//
+// FrameBlender class
+
+FrameBlender::FrameBlender()
+: mode(BlendOff), nrFrames(4), decayShift(1), width(0), height(0), count(0), newest(0)
+{
+  // 16 byte aligned buffers inside the object
+  uint8_t *base = storage + ((16 - reinterpret_cast<uintptr_t>(storage) % 16) % 16);
+  for (int idx = 0; idx < maxFrames; idx++)
+    ring[idx] = base + idx * maxSize;
+  phosphor = base + maxFrames * maxSize;
+  result = phosphor + maxSize;
+  Reset();
+}
+
+void FrameBlender::SetMode(Mode m)
+{
+  mode = m;
+  Reset();
+}
+
+void FrameBlender::SetFrames(int frames)
+{
+  nrFrames = frames < 2 ? 2 : (frames > maxFrames ? maxFrames : frames);
+  Reset();
+}
+
+void FrameBlender::SetDecay(int shift)
+{
+  decayShift = shift < 1 ? 1 : (shift > 7 ? 7 : shift);
+}
+
+void FrameBlender::Reset()
+{
+  count = 0;
+  newest = 0;
+  memset(phosphor, 0, maxSize);
+}
+
+uint8_t FrameBlender::Intensity(int index)
+{
+  return intensities[index & 3];
+}
+
+void FrameBlender::Blend(const uint8_t *frame, size_t w, size_t h, uint8_t *dst, size_t dstBytesPerLine)
+{
+  if (w * h > maxSize)
+    return;
+  if (w != width || h != height) {
+    width = w;
+    height = h;
+    Reset();
+  }
+  size_t size = width * height;         // a multiple of 16 at both resolutions
+
+  // store the new frame as intensities
+  newest = count == 0 ? 0 : (newest + 1) % nrFrames;
+  if (count < nrFrames)
+    count++;
+  uint8_t *cur = ring[newest];
+#ifdef FRAMEBLEND_SSE2
+  const __m128i one = _mm_set1_epi8(1), two = _mm_set1_epi8(2), three = _mm_set1_epi8(3);
+  for (size_t idx = 0; idx < size; idx += 16) {
+    __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i *>(frame + idx));
+    __m128i v = _mm_and_si128(_mm_cmpeq_epi8(px, one), _mm_set1_epi8(static_cast<char>(intensities[1])));
+    v = _mm_or_si128(v, _mm_and_si128(_mm_cmpeq_epi8(px, two), _mm_set1_epi8(static_cast<char>(intensities[2]))));
+    v = _mm_or_si128(v, _mm_and_si128(_mm_cmpeq_epi8(px, three), _mm_set1_epi8(static_cast<char>(intensities[3]))));
+    _mm_store_si128(reinterpret_cast<__m128i *>(cur + idx), v);
+  }
+#else
+  for (size_t idx = 0; idx < size; idx++)
+    cur[idx] = intensities[frame[idx] & 3];
+#endif
+
+  const uint8_t *src = cur;
+  switch (mode) {
+  case BlendMax:
+    BlendMaxFrames();
+    src = result;
+    break;
+  case BlendPhosphor:
+    BlendPhosphorFrames();
+    src = phosphor;
+    break;
+  case BlendMajority:
+    BlendMajorityFrames();
+    src = result;
+    break;
+  default:
+    break;
+  }
+
+  for (size_t y = 0; y < height; y++)
+    memcpy(dst + y * dstBytesPerLine, src + y * width, width);
+}
+
+void FrameBlender::BlendMaxFrames()
+{
+  size_t size = width * height;
+#ifdef FRAMEBLEND_SSE2
+  for (size_t idx = 0; idx < size; idx += 16) {
+    __m128i v = _mm_load_si128(reinterpret_cast<const __m128i *>(ring[0] + idx));
+    for (int fr = 1; fr < count; fr++)
+      v = _mm_max_epu8(v, _mm_load_si128(reinterpret_cast<const __m128i *>(ring[fr] + idx)));
+    _mm_store_si128(reinterpret_cast<__m128i *>(result + idx), v);
+  }
+#else
+  for (size_t idx = 0; idx < size; idx++) {
+    uint8_t v = ring[0][idx];
+    for (int fr = 1; fr < count; fr++)
+      v = ring[fr][idx] > v ? ring[fr][idx] : v;
+    result[idx] = v;
+  }
+#endif
+}
+
+void FrameBlender::BlendPhosphorFrames()
+{
+  // phosphor = max(new frame, phosphor - phosphor / 2^shift)
+  size_t size = width * height;
+  const uint8_t *cur = ring[newest];
+#ifdef FRAMEBLEND_SSE2
+  const __m128i mask = _mm_set1_epi8(static_cast<char>(0xFF >> decayShift));
+  const __m128i shift = _mm_cvtsi32_si128(decayShift);
+  for (size_t idx = 0; idx < size; idx += 16) {
+    __m128i p = _mm_load_si128(reinterpret_cast<const __m128i *>(phosphor + idx));
+    __m128i decay = _mm_and_si128(_mm_srl_epi16(p, shift), mask);
+    p = _mm_max_epu8(_mm_sub_epi8(p, decay), _mm_load_si128(reinterpret_cast<const __m128i *>(cur + idx)));
+    _mm_store_si128(reinterpret_cast<__m128i *>(phosphor + idx), p);
+  }
+#else
+  for (size_t idx = 0; idx < size; idx++) {
+    uint8_t p = static_cast<uint8_t>(phosphor[idx] - (phosphor[idx] >> decayShift));
+    phosphor[idx] = cur[idx] > p ? cur[idx] : p;
+  }
+#endif
+}
+
+void FrameBlender::BlendMajorityFrames()
+{
+  // lit in more than half of the frames: brightest of them, else dark
+  size_t size = width * height;
+  int threshold = count / 2;
+#ifdef FRAMEBLEND_SSE2
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i limit = _mm_set1_epi8(static_cast<char>(threshold));
+  for (size_t idx = 0; idx < size; idx += 16) {
+    __m128i lit = zero;
+    __m128i v = zero;
+    for (int fr = 0; fr < count; fr++) {
+      __m128i f = _mm_load_si128(reinterpret_cast<const __m128i *>(ring[fr] + idx));
+      lit = _mm_add_epi8(lit, _mm_andnot_si128(_mm_cmpeq_epi8(f, zero), _mm_set1_epi8(1)));
+      v = _mm_max_epu8(v, f);
+    }
+    v = _mm_and_si128(v, _mm_cmpgt_epi8(lit, limit));
+    _mm_store_si128(reinterpret_cast<__m128i *>(result + idx), v);
+  }
+#else
+  for (size_t idx = 0; idx < size; idx++) {
+    int lit = 0;
+    uint8_t v = 0;
+    for (int fr = 0; fr < count; fr++) {
+      lit += ring[fr][idx] != 0;
+      v = ring[fr][idx] > v ? ring[fr][idx] : v;
+    }
+    result[idx] = lit > threshold ? v : 0;
+  }
+#endif
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+///////////////////////////////////////////////////////////////////////////
+//
+// FrameBlender. Anti-flicker filter for the presented frames. Chip-8 games
+// erase and redraw sprites with xor, so a sprite is often missing from
+// every other frame. The blender keeps the last frames and combines them
+// into one greyscale image, one intensity (0..255) per pixel, to be shown
+// with a grey palette.
+//
+// It only sees rendered frames (palette indices, as Screen::Render writes
+// them), never the emulator.
+
+class FrameBlender
+{
+public:
+  enum Mode {
+    BlendOff,                       // intensity of the last frame only
+    BlendMax,                       // brightest of the last frames
+    BlendPhosphor,                  // lit pixels fade out over a few frames
+    BlendMajority,                  // lit if lit in more than half of the last frames
+    nrBlendModes
+  };
+
+  static const int maxFrames = 8;
+  static const size_t maxSize = 128 * 64;
+
+  FrameBlender();
+
+  void SetMode(Mode mode);
+  Mode GetMode() const { return mode; }
+  void SetFrames(int count);        // frames kept for max and majority, 2..maxFrames
+  void SetDecay(int shift);         // phosphor keeps 1 - 1/2^shift of the intensity per frame
+  void Reset();                     // forgets all frames, for example after a resolution change
+
+  // adds a frame of palette indices (0..3) and writes the blended
+  // intensities to dst. frames of another size than the last one reset
+  // the blender.
+  void Blend(const uint8_t *frame, size_t width, size_t height, uint8_t *dst, size_t dstBytesPerLine);
+
+  static uint8_t Intensity(int index);
+
+private:
+  Mode mode;
+  int nrFrames;
+  int decayShift;
+  size_t width;
+  size_t height;
+  int count;                        // frames in the ring, up to nrFrames
+  int newest;                       // ring index of the newest frame
+
+  // the ring of intensities, and the phosphor state. aligned for the
+  // vector loads.
+  uint8_t *ring[maxFrames];
+  uint8_t *phosphor;
+  uint8_t *result;
+  uint8_t storage[(maxFrames + 2) * maxSize + 16];
+
+  void BlendMaxFrames();
+  void BlendPhosphorFrames();
+  void BlendMajorityFrames();
+
+  FrameBlender(const FrameBlender &);
+  FrameBlender &operator=(const FrameBlender &);
+};
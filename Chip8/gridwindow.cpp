@@ -0,0 +1,246 @@
+#include "gridwindow.h"
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QStandardPaths>
+#include <QGridLayout>
+#include <qpainter.h>
+#include <qtimer.h>
+#include <qkeyevent>
+#include <math.h>
+
+#include "quirks.h"
+
+// EmulatorView
+
+EmulatorView::EmulatorView(FrameScheduler *scheduler, QWidget *parent)
+: QWidget( parent ),
+  _scheduler( scheduler ),
+  _dirty( false ),
+  _selected( false ),
+  _lastCpuNs( 0 ),
+  _lastMissed( 0 )
+{
+  // same colours as the main window
+  QVector<QRgb> pallette;
+  pallette.append(QRgb(0xFF000000));
+  pallette.append(QRgb(0xFFFFFFFF));
+  pallette.append(QRgb(0xFFAAAAAA));
+  pallette.append(QRgb(0xFF555555));
+  for (int dummy = 4; dummy < 256; dummy++)
+    pallette.append(QRgb(0xFF800000));
+  _scr = QImage(128, 64, QImage::Format::Format_Indexed8);
+  _scr.setColorTable(pallette);
+  _scr.fill(0);
+
+  setMinimumSize(128, 80);
+  _session.SetFrameCallback(frameDone, this);
+  _scheduler->Add(&_session);
+}
+
+EmulatorView::~EmulatorView()
+{
+  // no frame runs, and no callback comes, after this
+  _scheduler->Remove(&_session);
+}
+
+bool EmulatorView::load(const QString &fileName)
+{
+  QFile progFile(fileName);
+  if (!progFile.open(QIODevice::ReadOnly))
+    return false;
+  QByteArray progData = progFile.readAll();
+  Emulator::ChipMode mode = Emulator::CHIP8;
+  if (fileName.endsWith(".xo8", Qt::CaseInsensitive))
+    mode = Emulator::XOCHIP;
+  else if (fileName.endsWith(".sc8", Qt::CaseInsensitive))
+    mode = Emulator::SCHIP;
+  else if (fileName.endsWith(".mc8", Qt::CaseInsensitive))
+    mode = Emulator::MEGACHIP;
+
+  // the session is paused until the rom is in
+  _scheduler->Pause(&_session);
+  Emulator &emu = _session.GetEmulator();
+  emu.Init(mode);
+  emu.storeProgram((uint8_t*)(progData.data()), progData.size());
+
+  QString cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+  QDir().mkpath(cacheDir);
+  std::string dir = QDir::toNativeSeparators(cacheDir).toLocal8Bit().constData();
+  AnalysisCache cache(dir);
+  cache.Load(_analysis, (const uint8_t*)(progData.constData()), progData.size(), mode);
+  emu.SetAnalysis(&_analysis);
+  QuirkCache quirkCache(dir);
+  emu.SetQuirks(quirkCache.Load((const uint8_t*)(progData.constData()), progData.size(), mode));
+
+  _name = QFileInfo(fileName).completeBaseName();
+  _scheduler->Resume(&_session);
+  update();
+  return true;
+}
+
+void EmulatorView::togglePause()
+{
+  if (_session.IsPaused())
+    _scheduler->Resume(&_session);
+  else
+    _scheduler->Pause(&_session);
+  update();
+}
+
+void EmulatorView::setSelected(bool selected)
+{
+  _selected = selected;
+  update();
+}
+
+void EmulatorView::frameDone(ScheduledSession * /*session*/, void *user)
+{
+  // on a worker thread: only flag it, the grid timer repaints
+  static_cast<EmulatorView *>(user)->_dirty = true;
+}
+
+void EmulatorView::refresh()
+{
+  if (_dirty.exchange(false))
+    update();
+}
+
+void EmulatorView::updateStats(double seconds)
+{
+  uint64_t cpuNs = _session.CpuNs();
+  uint64_t missed = _session.MissedDeadlines();
+  if (_session.IsPaused())
+    _stats = "paused";
+  else
+    _stats = QString("cpu %1%, %2 missed").arg((cpuNs - _lastCpuNs) / (seconds * 1e7), 0, 'f', 2).arg(missed - _lastMissed);
+  _lastCpuNs = cpuNs;
+  _lastMissed = missed;
+  update();
+}
+
+void EmulatorView::paintEvent(QPaintEvent * /*event*/)
+{
+  QPainter pnt(this);
+  pnt.fillRect(rect(), Qt::darkGray);
+
+  size_t width = 64, height = 32;
+  _session.CopyScreen(_scr.bits(), _scr.bytesPerLine(), width, height);
+
+  // the screen, as large as fits above the text line
+  QRect area = rect().adjusted(2, 2, -2, -18);
+  int scale = qMax(1, qMin(area.width() / static_cast<int>(width), area.height() / static_cast<int>(height)));
+  QRect target(area.x() + (area.width() - scale * static_cast<int>(width)) / 2, area.y(),
+    scale * static_cast<int>(width), scale * static_cast<int>(height));
+  pnt.drawImage(target, _scr, QRect(0, 0, static_cast<int>(width), static_cast<int>(height)));
+
+  pnt.setPen(Qt::white);
+  pnt.drawText(rect().adjusted(4, 0, -4, -2), Qt::AlignBottom | Qt::AlignLeft, _name);
+  pnt.drawText(rect().adjusted(4, 0, -4, -2), Qt::AlignBottom | Qt::AlignRight, _stats);
+  if (_selected) {
+    pnt.setPen(QPen(Qt::yellow, 2));
+    pnt.drawRect(rect().adjusted(1, 1, -1, -1));
+  }
+}
+
+void EmulatorView::mousePressEvent(QMouseEvent * /*event*/)
+{
+  emit selected(this);
+}
+
+void EmulatorView::mouseDoubleClickEvent(QMouseEvent * /*event*/)
+{
+  togglePause();
+}
+
+// GridWindow
+
+GridWindow::GridWindow(const QStringList &files, QWidget *parent)
+: QWidget( parent ),
+  _selectedView( NULL )
+{
+  setWindowTitle(QString("Chip8 - %1 games").arg(files.size()));
+  setFocusPolicy(Qt::StrongFocus);
+
+  QGridLayout *layout = new QGridLayout(this);
+  layout->setSpacing(4);
+  int columns = static_cast<int>(ceil(sqrt(static_cast<double>(files.size()))));
+  for (int idx = 0; idx < files.size(); idx++) {
+    EmulatorView *view = new EmulatorView(&scheduler(), this);
+    if (!view->load(files[idx])) {
+      delete view;
+      continue;
+    }
+    connect(view, SIGNAL(selected(EmulatorView *)), this, SLOT(select(EmulatorView *)));
+    layout->addWidget(view, _views.size() / columns, _views.size() % columns);
+    _views.append(view);
+  }
+  if (!_views.isEmpty())
+    select(_views.first());
+  resize(columns * 4 * 64 + 8, ((_views.size() + columns - 1) / qMax(1, columns)) * (4 * 32 + 20) + 8);
+
+  // repaints changed views at the host refresh, rather than per frame
+  _timer = new QTimer(this);
+  connect(_timer, SIGNAL(timeout()), this, SLOT(timerTick()));
+  _timer->start(16);
+  _statsClock.start();
+}
+
+GridWindow::~GridWindow()
+{
+}
+
+FrameScheduler &GridWindow::scheduler()
+{
+  static FrameScheduler shared;
+  return shared;
+}
+
+void GridWindow::timerTick()
+{
+  for (int idx = 0; idx < _views.size(); idx++)
+    _views[idx]->refresh();
+
+  qint64 elapsed = _statsClock.elapsed();
+  if (elapsed >= 1000) {
+    for (int idx = 0; idx < _views.size(); idx++)
+      _views[idx]->updateStats(elapsed / 1000.0);
+    _statsClock.restart();
+  }
+}
+
+void GridWindow::select(EmulatorView *view)
+{
+  if (_selectedView != NULL)
+    _selectedView->setSelected(false);
+  _selectedView = view;
+  _selectedView->setSelected(true);
+}
+
+void GridWindow::registerKey(bool down, int key)
+{
+  if (_selectedView == NULL)
+    return;
+  if (key >= '0' && key <= '9') {
+    _selectedView->postKey(key - '0', down);
+  }
+  if (key >= 'A' && key <= 'F') {
+    _selectedView->postKey(key - 'A' + 10, down);
+  }
+}
+
+void GridWindow::keyPressEvent(QKeyEvent *event)
+{
+  if (event->isAutoRepeat())
+    return;
+  if (event->key() == Qt::Key_Space && _selectedView != NULL)
+    _selectedView->togglePause();
+  else
+    registerKey(true, event->key());
+}
+
+void GridWindow::keyReleaseEvent(QKeyEvent *event)
+{
+  if (!event->isAutoRepeat())
+    registerKey(false, event->key());
+}
@@ -0,0 +1,85 @@
+#ifndef GRIDWINDOW_H
+#define GRIDWINDOW_H
+
+#include <QWidget>
+#include <QImage>
+#include <QStringList>
+#include <QElapsedTimer>
+#include <atomic>
+
+#include "scheduler.h"
+#include "analysis.h"
+
+class QTimer;
+
+// one emulator in a grid. it runs as a session of the shared scheduler
+// and paints the last screen the session copied out.
+class EmulatorView : public QWidget
+{
+  Q_OBJECT
+
+public:
+  EmulatorView(FrameScheduler *scheduler, QWidget *parent = 0);
+  ~EmulatorView();
+  bool load(const QString &fileName);
+  void togglePause();
+  void setSelected(bool selected);
+  void postKey(int key, bool down) { _session.PostKey(key, down); }
+
+  void refresh();                   // repaints if the session showed a new frame
+  void updateStats(double seconds); // cpu load and missed deadlines since the last call
+
+signals:
+  void selected(EmulatorView *view);
+
+protected:
+  virtual void paintEvent(QPaintEvent *event);
+  virtual void mousePressEvent(QMouseEvent *event);
+  virtual void mouseDoubleClickEvent(QMouseEvent *event);
+
+private:
+  static void frameDone(ScheduledSession *session, void *user);
+
+  FrameScheduler *_scheduler;
+  ScheduledSession _session;
+  CodeAnalysis _analysis;
+  std::atomic<bool> _dirty;         // set by a worker when a frame changed the screen
+  QImage _scr;                      // 128x64, the session screen in the top left
+  QString _name;
+  QString _stats;
+  bool _selected;
+  uint64_t _lastCpuNs;              // session counters at the last stats update
+  uint64_t _lastMissed;
+};
+
+// a window with a grid of emulators. keys go to the selected one; a
+// double click or space pauses and resumes it.
+class GridWindow : public QWidget
+{
+  Q_OBJECT
+
+public:
+  GridWindow(const QStringList &files, QWidget *parent = 0);
+  ~GridWindow();
+
+  // one pool of workers for the emulators of all grids
+  static FrameScheduler &scheduler();
+
+protected:
+  virtual void keyPressEvent(QKeyEvent *event);
+  virtual void keyReleaseEvent(QKeyEvent *event);
+
+private slots:
+  void timerTick();
+  void select(EmulatorView *view);
+
+private:
+  QList<EmulatorView *> _views;
+  EmulatorView *_selectedView;
+  QTimer *_timer;
+  QElapsedTimer _statsClock;
+
+  void registerKey(bool down, int key);
+};
+
+#endif // GRIDWINDOW_H
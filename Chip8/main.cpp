@@ -1,8 +1,13 @@
 #include "chip8.h"
+#include "tools.h"
 #include <QtWidgets/QApplication>
 
 int main(int argc, char *argv[])
 {
+	int toolResult = RunTool(argc, argv);
+	if (toolResult >= 0)
+		return toolResult;
+
 	QApplication a(argc, argv);
 	Chip8 w;
 	w.show();
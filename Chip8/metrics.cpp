@@ -0,0 +1,245 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Emulator.h"
+#include "netsession.h"
+
+static_assert(MetricErrorsEnd - MetricErrors == EmulatorCore::nrErrorTypes, "one error counter per error type");
+
+struct MetricInfo {
+  const char *name;
+  const char *help;
+  bool counter;
+};
+
+static const MetricInfo metricInfo[nrMetrics] = {
+  { "chip8_instructions_total", "Instructions run by emulator threads.", true },
+  { "chip8_frames_total", "60Hz frames run by emulator threads.", true },
+  { "chip8_frames_presented_total", "Frames painted by the window.", true },
+  { "chip8_emulation_seconds_total", "Time emulator threads spent running frames.", true },
+  { "chip8_sleep_seconds_total", "Time emulator threads spent sleeping or waiting for input.", true },
+  { "chip8_key_events_total", "Key events received.", true },
+  { "chip8_key_events_dropped_total", "Key events dropped because the key queue was full.", true },
+  { "chip8_errors_total", "Emulator errors, by type.", true },
+  { NULL, NULL, true }, { NULL, NULL, true }, { NULL, NULL, true },
+  { NULL, NULL, true }, { NULL, NULL, true }, { NULL, NULL, true },
+  { "chip8_netplay_rollbacks_total", "Netplay rollbacks after a wrong input prediction.", true },
+  { "chip8_netplay_rollback_frames_total", "Frames simulated again by netplay rollbacks.", true },
+  { "chip8_netplay_resimulation_seconds_total", "Time spent simulating frames again.", true },
+  { "chip8_netplay_stalls_total", "Frames delayed waiting for the remote player.", true },
+  { "chip8_state_hash_mismatches_total", "Incremental state hashes that differed from a full computation.", true },
+  { "chip8_runahead_frames_total", "Frames run ahead to show the screen early, and thrown away.", true },
+  { "chip8_runahead_seconds_total", "Time spent running ahead, saving and restoring the state.", true },
+  { "chip8_instructions_per_second", "Achieved instructions per second, over the last second.", false },
+  { "chip8_target_instructions_per_second", "Instructions per second at the selected speed, 0 if unlimited.", false },
+  { "chip8_key_queue_depth", "Key events waiting for the emulator thread.", false },
+};
+
+static const char *errorLabels[EmulatorCore::nrErrorTypes] = {
+  "none", "stack_underflow", "stack_overflow", "memory_overflow", "hp48_flags", "quit", "invalid_instruction"
+};
+
+///////////////////////////////////////////////////////////////////////////
+//
+// Metrics class
+
+thread_local Metrics::BlockOwner Metrics::owner;
+std::atomic<Metrics::Block *> Metrics::blocks(NULL);
+std::atomic<int64_t> Metrics::gauges[nrMetrics - nrCounters];
+
+Metrics::BlockOwner::~BlockOwner()
+{
+  // the counts stay, the next thread continues counting in this block
+  if (block != NULL)
+    block->inUse.store(false, std::memory_order_release);
+}
+
+Metrics::Block *Metrics::AttachBlock()
+{
+  // reuse the block of a thread that ended, or add a new one. blocks are
+  // never freed, so readers can walk the list without locking.
+  for (Block *block = blocks.load(std::memory_order_acquire); block != NULL; block = block->next) {
+    bool expected = false;
+    if (!block->inUse.load(std::memory_order_relaxed) &&
+        block->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+      owner.block = block;
+      return block;
+    }
+  }
+
+  Block *block = new Block;
+  for (int idx = 0; idx < nrCounters; idx++)
+    block->values[idx].store(0, std::memory_order_relaxed);
+  block->inUse.store(true, std::memory_order_relaxed);
+  block->next = blocks.load(std::memory_order_relaxed);
+  while (!blocks.compare_exchange_weak(block->next, block, std::memory_order_release))
+    ;
+  owner.block = block;
+  return block;
+}
+
+uint64_t Metrics::Get(Metric metric)
+{
+  if (metric >= nrCounters)
+    return gauges[metric - nrCounters].load(std::memory_order_relaxed);
+  uint64_t sum = 0;
+  for (Block *block = blocks.load(std::memory_order_acquire); block != NULL; block = block->next)
+    sum += block->values[metric].load(std::memory_order_relaxed);
+  return sum;
+}
+
+void Metrics::WriteText(std::string &out)
+{
+  char line[256];
+  for (int metric = 0; metric < nrMetrics; metric++) {
+    const MetricInfo &info = metricInfo[metric];
+    if (info.name == NULL)
+      continue;
+    snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n",
+      info.name, info.help, info.name, info.counter ? "counter" : "gauge");
+    out += line;
+
+    if (metric == MetricErrors) {
+      for (int type = 1; type < EmulatorCore::nrErrorTypes; type++) {
+        snprintf(line, sizeof(line), "%s{type=\"%s\"} %llu\n", info.name, errorLabels[type],
+          static_cast<unsigned long long>(Get(static_cast<Metric>(MetricErrors + type))));
+        out += line;
+      }
+    }
+    else if (metric == MetricEmulationNs || metric == MetricSleepNs || metric == MetricNetplayResimNs ||
+             metric == MetricRunAheadNs) {
+      snprintf(line, sizeof(line), "%s %.6f\n", info.name, Get(static_cast<Metric>(metric)) / 1e9);
+      out += line;
+    }
+    else {
+      snprintf(line, sizeof(line), "%s %lld\n", info.name,
+        static_cast<long long>(Get(static_cast<Metric>(metric))));
+      out += line;
+    }
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+//
+// MetricsExporter class
+
+MetricsExporter::MetricsExporter()
+: stopping(false), listener(invalidSocket)
+{
+}
+
+MetricsExporter::~MetricsExporter()
+{
+  Stop();
+}
+
+bool MetricsExporter::Start(const std::string &fileName, uint16_t port)
+{
+  Stop();
+  file = fileName;
+  if (port != 0) {
+    listener = NetListen(port);
+    if (listener == invalidSocket)
+      return false;
+  }
+  if (file.empty() && listener == invalidSocket)
+    return false;
+  stopping = false;
+  thread = std::thread(&MetricsExporter::Run, this);
+  return true;
+}
+
+bool MetricsExporter::StartFromEnvironment()
+{
+  const char *fileName = getenv("CHIP8_METRICS_FILE");
+  const char *port = getenv("CHIP8_METRICS_PORT");
+  if (fileName == NULL && port == NULL)
+    return false;
+  return Start(fileName != NULL ? fileName : "", static_cast<uint16_t>(port != NULL ? atoi(port) : 0));
+}
+
+void MetricsExporter::Stop()
+{
+  stopping = true;
+  if (thread.joinable())
+    thread.join();
+  if (listener != invalidSocket) {
+    NetClose(listener);
+    listener = invalidSocket;
+  }
+}
+
+void MetricsExporter::Run()
+{
+  Poller poller;
+  if (listener != invalidSocket)
+    poller.Add(listener, NULL);
+
+  std::string text;
+  uint64_t lastInstructions = Metrics::Get(MetricInstructions);
+  uint64_t lastUpdate = NowNs();
+  uint64_t nextUpdate = lastUpdate;
+
+  while (!stopping) {
+    uint64_t now = NowNs();
+    if (now >= nextUpdate) {
+      uint64_t instructions = Metrics::Get(MetricInstructions);
+      if (now > lastUpdate)
+        Metrics::Set(MetricInstructionsPerSecond,
+          static_cast<int64_t>((instructions - lastInstructions) * 1e9 / (now - lastUpdate)));
+      lastInstructions = instructions;
+      lastUpdate = now;
+      nextUpdate = now + 1000000000;
+
+      text.clear();
+      Metrics::WriteText(text);
+      if (!file.empty())
+        WriteFile(text);
+    }
+
+    // serve scrapes until the next update. short waits, so Stop is quick.
+    Poller::Event event;
+    if (poller.Wait(100, &event, 1) > 0) {
+      SocketHandle client;
+      while ((client = NetAccept(listener)) != invalidSocket) {
+        // the request does not matter, every request gets the metrics
+        char request[1024];
+        NetReceive(client, request, sizeof(request));
+        char header[128];
+        snprintf(header, sizeof(header),
+          "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\n\r\n",
+          static_cast<unsigned>(text.size()));
+        std::string response = header + text;
+        size_t sent = 0;
+        for (int tries = 0; sent < response.size() && tries < 100; tries++) {
+          int n = NetSend(client, response.data() + sent, response.size() - sent);
+          if (n < 0)
+            break;
+          if (n == 0)
+            std::this_thread::yield();
+          sent += n;
+        }
+        NetClose(client);
+      }
+    }
+  }
+}
+
+void MetricsExporter::WriteFile(const std::string &text)
+{
+  // replace the file in one go, readers never see half of it
+  std::string temp = file + ".tmp";
+  FILE *f = fopen(temp.c_str(), "wb");
+  if (f == NULL)
+    return;
+  bool ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+  ok = fclose(f) == 0 && ok;
+  if (ok && rename(temp.c_str(), file.c_str()) != 0) {
+    remove(file.c_str());
+    rename(temp.c_str(), file.c_str());
+  }
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <atomic>
+#include <thread>
+
+///////////////////////////////////////////////////////////////////////////
+//
+// Metrics. Process wide counters and gauges for watching the emulator at
+// runtime.
+//
+// Counters are kept per thread: every thread that counts gets its own
+// block of counters on its own cache lines, and adding is a relaxed load
+// and store on that block, never a locked instruction or a shared line.
+// Reading sums the blocks of all threads. Gauges are single values, set by
+// whichever thread owns them.
+
+enum Metric {
+  // counters
+  MetricInstructions,               // instructions run by emulator threads and server workers
+  MetricFrames,                     // 60Hz frames run
+  MetricFramesPresented,            // frames painted by the window
+  MetricEmulationNs,                // time spent running frames
+  MetricSleepNs,                    // time spent sleeping, or waiting for sockets in the server
+  MetricKeyEvents,
+  MetricKeyEventsDropped,           // key events lost because the queue was full
+  MetricErrors,                     // first of Emulator::nrErrorTypes counters, one per type
+  MetricErrorsEnd = MetricErrors + 7,
+  MetricNetplayRollbacks = MetricErrorsEnd,       // netplay rollbacks after a wrong prediction
+  MetricNetplayRollbackFrames,      // frames simulated again, the sum of the rollback depths
+  MetricNetplayResimNs,             // time spent simulating again
+  MetricNetplayStalls,              // frames not run because the remote input was too far behind
+  MetricStateHashMismatches,        // state hash checks that failed, see Emulator::SetHashCheck
+  MetricRunAheadFrames,             // frames run ahead and thrown away, see runahead.h
+  MetricRunAheadNs,                 // time spent running ahead, saving and restoring
+  nrCounters,
+
+  // gauges
+  MetricInstructionsPerSecond = nrCounters,       // achieved, updated every second
+  MetricTargetInstructionsPerSecond,              // 0 when running unlimited
+  MetricKeyQueueDepth,                            // key events waiting at the start of the last frame
+  nrMetrics
+};
+
+class Metrics
+{
+public:
+  static void Add(Metric counter, uint64_t n = 1)
+  {
+    std::atomic<uint64_t> &value = LocalBlock()->values[counter];
+    value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+  static void Set(Metric gauge, int64_t value) { gauges[gauge - nrCounters].store(value, std::memory_order_relaxed); }
+
+  static uint64_t Get(Metric metric);               // counter summed over all threads, or gauge
+  static void WriteText(std::string &out);          // prometheus text format
+
+private:
+  // the padding keeps the counters off cache lines of other blocks
+  struct Block {
+    char padBefore[64];
+    std::atomic<uint64_t> values[nrCounters];
+    char padAfter[64];
+    std::atomic<bool> inUse;                        // a live thread owns the block
+    Block *next;
+  };
+
+  struct BlockOwner {
+    Block *block;
+    BlockOwner() : block(NULL) {}
+    ~BlockOwner();
+  };
+
+  static thread_local BlockOwner owner;
+  static std::atomic<Block *> blocks;
+  static std::atomic<int64_t> gauges[nrMetrics - nrCounters];
+
+  static Block *LocalBlock()
+  {
+    Block *block = owner.block;
+    return block != NULL ? block : AttachBlock();
+  }
+  static Block *AttachBlock();
+};
+
+///////////////////////////////////////////////////////////////////////////
+//
+// MetricsExporter. Once a second, updates the rate gauges and publishes the
+// metrics: written to a file, and served to anyone connecting to a port on
+// 127.0.0.1 as a http response, so prometheus can scrape it.
+
+class MetricsExporter
+{
+public:
+  MetricsExporter();
+  ~MetricsExporter();
+
+  // file may be empty, port may be 0. starts nothing if both are.
+  bool Start(const std::string &file, uint16_t port);
+  void Stop();
+
+  // from the CHIP8_METRICS_FILE and CHIP8_METRICS_PORT environment variables
+  bool StartFromEnvironment();
+
+private:
+  std::thread thread;
+  std::atomic<bool> stopping;
+  std::string file;
+  uintptr_t listener;
+
+  void Run();
+  void WriteFile(const std::string &text);
+};
@@ -0,0 +1,283 @@
+#include "netplay.h"
+
+#include <string.h>
+
+#include "metrics.h"
+
+// packet: magic, then little endian fields
+//   uint32 ack      remote keys the sender has, for frames before this
+//   uint32 start    frame of the first keys in the packet
+//   uint8  count
+//   uint16 keys[count]
+static const uint8_t packetMagic = 0xC8;
+static const size_t packetHeaderSize = 10;
+
+static void Put32(uint8_t *p, uint32_t v)
+{
+  p[0] = static_cast<uint8_t>(v);
+  p[1] = static_cast<uint8_t>(v >> 8);
+  p[2] = static_cast<uint8_t>(v >> 16);
+  p[3] = static_cast<uint8_t>(v >> 24);
+}
+
+static uint32_t Get32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// UdpTransport class
+
+UdpTransport::UdpTransport()
+: s(invalidSocket)
+{
+}
+
+UdpTransport::~UdpTransport()
+{
+  Close();
+}
+
+bool UdpTransport::Open(uint16_t localPort, const char *host, uint16_t remotePort)
+{
+  Close();
+  s = NetUdpOpen(localPort);
+  if (s == invalidSocket)
+    return false;
+  if (!NetUdpConnect(s, host, remotePort)) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+void UdpTransport::Close()
+{
+  if (s != invalidSocket)
+    NetClose(s);
+  s = invalidSocket;
+}
+
+void UdpTransport::Send(const void *data, size_t len)
+{
+  if (s != invalidSocket)
+    NetSend(s, data, len);
+}
+
+size_t UdpTransport::Receive(void *data, size_t len)
+{
+  // errors, like the peer port not being open yet, are just no datagram
+  int n = s != invalidSocket ? NetReceive(s, data, len) : 0;
+  return n > 0 ? n : 0;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+//
+// LoopbackLink class
+
+LoopbackLink::LoopbackLink(int latencyMs, int jitterMs, double loss, uint32_t seed)
+: now(0), randomState(seed != 0 ? seed : 1)
+{
+  latencyNs = static_cast<uint64_t>(latencyMs) * 1000000;
+  jitterNs = static_cast<uint64_t>(jitterMs) * 1000000;
+  lossLimit = static_cast<uint32_t>((loss < 0 ? 0 : (loss > 1 ? 1 : loss)) * 4294967295.0);
+  for (int idx = 0; idx < 2; idx++) {
+    endpoints[idx].link = this;
+    endpoints[idx].idx = idx;
+  }
+}
+
+uint32_t LoopbackLink::Random()
+{
+  // xorshift, repeatable for a seed
+  uint32_t x = randomState;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  randomState = x;
+  return x;
+}
+
+void LoopbackLink::Send(int from, const void *data, size_t len)
+{
+  if (Random() < lossLimit)
+    return;
+  Packet packet;
+  packet.due = now + latencyNs + (jitterNs > 0 ? Random() % jitterNs : 0);
+  packet.data.assign(static_cast<const uint8_t *>(data), static_cast<const uint8_t *>(data) + len);
+
+  // jitter can reorder packets, like on a real network
+  std::vector<Packet> &queue = queues[from ^ 1];
+  size_t pos = queue.size();
+  while (pos > 0 && queue[pos - 1].due > packet.due)
+    pos--;
+  queue.insert(queue.begin() + pos, packet);
+}
+
+size_t LoopbackLink::Receive(int to, void *data, size_t len)
+{
+  std::vector<Packet> &queue = queues[to];
+  if (queue.empty() || queue.front().due > now)
+    return 0;
+  size_t n = queue.front().data.size() < len ? queue.front().data.size() : len;
+  memcpy(data, &queue.front().data[0], n);
+  queue.erase(queue.begin());
+  return n;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+//
+// NetplaySession class
+
+NetplaySession::NetplaySession(Emulator &e, NetplayTransport *t)
+: emu(e), transport(t)
+{
+  Start(0);
+}
+
+void NetplaySession::Start(int delay)
+{
+  inputDelay = delay < 0 ? 0 : (delay > maxInputDelay ? maxInputDelay : delay);
+  memset(localInputs, 0, sizeof(localInputs));
+  memset(remoteInputs, 0, sizeof(remoteInputs));
+  memset(usedRemote, 0, sizeof(usedRemote));
+  memset(&stats, 0, sizeof(stats));
+
+  // the keys of the first frames, before the delay, are none on both sides
+  frame = 0;
+  localCount = inputDelay;
+  remoteCount = inputDelay;
+  remoteAck = inputDelay;
+  firstMismatch = -1;
+  lastRollback = 0;
+}
+
+bool NetplaySession::AdvanceFrame(uint16_t localKeys)
+{
+  Receive();
+  Rollback();
+
+  if (frame - remoteCount >= maxPrediction) {
+    // the remote peer is behind. keep sending, so it gets our keys.
+    SendInputs();
+    stats.stalls++;
+    Metrics::Add(MetricNetplayStalls);
+    return false;
+  }
+
+  localInputs[localCount % inputRing] = localKeys;
+  localCount++;
+  SendInputs();
+  RunFrame(frame);
+  frame++;
+  stats.frames++;
+  return true;
+}
+
+void NetplaySession::Poll()
+{
+  Receive();
+  Rollback();
+  SendInputs();
+}
+
+void NetplaySession::Receive()
+{
+  uint8_t packet[packetHeaderSize + 2 * maxInputsPerPacket];
+  size_t len;
+  while ((len = transport->Receive(packet, sizeof(packet))) != 0) {
+    if (len < packetHeaderSize || packet[0] != packetMagic)
+      continue;
+    int ack = static_cast<int>(Get32(packet + 1));
+    int start = static_cast<int>(Get32(packet + 5));
+    int count = packet[9];
+    if (count > maxInputsPerPacket || len < packetHeaderSize + 2 * count)
+      continue;
+    stats.packetsReceived++;
+
+    // packets can come late or twice, only take what is new
+    if (ack > remoteAck && ack <= localCount)
+      remoteAck = ack;
+    for (int idx = 0; idx < count; idx++) {
+      int f = start + idx;
+      if (f < remoteCount)
+        continue;
+      if (f > remoteCount || f >= frame + inputRing / 2)
+        break;
+      const uint8_t *p = packet + packetHeaderSize + 2 * idx;
+      uint16_t keys = static_cast<uint16_t>(p[0] | (p[1] << 8));
+      remoteInputs[f % inputRing] = keys;
+      remoteCount++;
+      if (f < frame && usedRemote[f % inputRing] != keys && (firstMismatch < 0 || f < firstMismatch))
+        firstMismatch = f;
+    }
+  }
+}
+
+void NetplaySession::Rollback()
+{
+  lastRollback = 0;
+  if (firstMismatch < 0)
+    return;
+
+  // back to the state before the wrong frame, and forward again with the
+  // keys known now
+  uint64_t start = NowNs();
+  int depth = frame - firstMismatch;
+  emu = states[firstMismatch % nrStates];
+  for (int f = firstMismatch; f < frame; f++)
+    RunFrame(f);
+  uint64_t ns = NowNs() - start;
+  firstMismatch = -1;
+
+  lastRollback = depth;
+  stats.rollbacks++;
+  stats.rollbackFrames += depth;
+  if (depth > stats.maxDepth)
+    stats.maxDepth = depth;
+  stats.resimNs += ns;
+  if (ns > stats.maxResimNs)
+    stats.maxResimNs = ns;
+  Metrics::Add(MetricNetplayRollbacks);
+  Metrics::Add(MetricNetplayRollbackFrames, depth);
+  Metrics::Add(MetricNetplayResimNs, ns);
+}
+
+void NetplaySession::SendInputs()
+{
+  uint8_t packet[packetHeaderSize + 2 * maxInputsPerPacket];
+  int start = remoteAck;
+  int count = localCount - start;
+  if (count > maxInputsPerPacket)
+    count = maxInputsPerPacket;
+
+  packet[0] = packetMagic;
+  Put32(packet + 1, static_cast<uint32_t>(remoteCount));
+  Put32(packet + 5, static_cast<uint32_t>(start));
+  packet[9] = static_cast<uint8_t>(count);
+  for (int idx = 0; idx < count; idx++) {
+    uint16_t keys = localInputs[(start + idx) % inputRing];
+    packet[packetHeaderSize + 2 * idx] = static_cast<uint8_t>(keys);
+    packet[packetHeaderSize + 2 * idx + 1] = static_cast<uint8_t>(keys >> 8);
+  }
+  transport->Send(packet, packetHeaderSize + 2 * count);
+  stats.packetsSent++;
+}
+
+void NetplaySession::RunFrame(int f)
+{
+  // predict that the remote keys stay as they were last known
+  uint16_t remote = 0;
+  if (f < remoteCount)
+    remote = remoteInputs[f % inputRing];
+  else if (remoteCount > 0)
+    remote = remoteInputs[(remoteCount - 1) % inputRing];
+  usedRemote[f % inputRing] = remote;
+
+  states[f % nrStates] = emu;
+  emu.SetKeys(localInputs[f % inputRing] | remote);
+  stats.instructions += emu.DoFrame();
+}
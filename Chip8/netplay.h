@@ -0,0 +1,167 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#include "Emulator.h"
+#include "netsession.h"
+
+///////////////////////////////////////////////////////////////////////////
+//
+// rollback netplay for two players. both peers run the same rom from the
+// same state; the keys of a frame are the local keys of both players or'ed
+// together, so each player uses their own keys of the game.
+//
+// a peer does not wait for the remote keys of a frame. it predicts them
+// (the last remote keys it knows) and runs on. when the real keys arrive
+// and differ from the prediction, it goes back to the state of that frame
+// and simulates again up to the present. states are copy-on-write forks of
+// the emulator, so saving one every frame is cheap.
+//
+// every packet holds all local keys the peer has not acknowledged yet, so
+// lost packets need no resending of their own.
+
+///////////////////////////////////////////////////////////////////////////
+//
+// transports. unreliable datagrams, like udp.
+
+class NetplayTransport
+{
+public:
+  virtual ~NetplayTransport() {}
+  virtual void Send(const void *data, size_t len) = 0;
+  virtual size_t Receive(void *data, size_t len) = 0;     // size of the next datagram, 0 if none
+};
+
+class UdpTransport : public NetplayTransport
+{
+public:
+  UdpTransport();
+  ~UdpTransport();
+  bool Open(uint16_t localPort, const char *host, uint16_t remotePort);
+  void Close();
+  virtual void Send(const void *data, size_t len);
+  virtual size_t Receive(void *data, size_t len);
+
+private:
+  SocketHandle s;
+
+  UdpTransport(const UdpTransport &);
+  UdpTransport &operator=(const UdpTransport &);
+};
+
+// two connected endpoints in one process, with simulated latency, jitter
+// and loss. time only moves with SetTime, so tests run faster than real
+// time. both ends must be used from the same thread.
+class LoopbackLink
+{
+public:
+  LoopbackLink(int latencyMs, int jitterMs, double loss, uint32_t seed = 1);
+  void SetTime(uint64_t ns) { now = ns; }
+  NetplayTransport *End(int idx) { return &endpoints[idx & 1]; }
+
+private:
+  struct Packet {
+    uint64_t due;                   // delivered from this time on
+    std::vector<uint8_t> data;
+  };
+
+  class Endpoint : public NetplayTransport
+  {
+  public:
+    LoopbackLink *link;
+    int idx;
+    virtual void Send(const void *data, size_t len) { link->Send(idx, data, len); }
+    virtual size_t Receive(void *data, size_t len) { return link->Receive(idx, data, len); }
+  };
+
+  uint64_t now;
+  uint64_t latencyNs;
+  uint64_t jitterNs;
+  uint32_t lossLimit;               // a packet is lost if a random number is below this
+  uint32_t randomState;
+  Endpoint endpoints[2];
+  std::vector<Packet> queues[2];    // towards end 0 and 1, ordered by due time
+
+  uint32_t Random();
+  void Send(int from, const void *data, size_t len);
+  size_t Receive(int to, void *data, size_t len);
+};
+
+///////////////////////////////////////////////////////////////////////////
+//
+// NetplaySession class
+
+struct NetplayStats
+{
+  uint64_t frames;                  // frames run, not counting simulating again
+  uint64_t instructions;            // instructions executed, simulating again included
+  uint64_t stalls;                  // calls that did not run a frame, waiting for the remote peer
+  uint64_t rollbacks;
+  uint64_t rollbackFrames;          // sum of the rollback depths
+  int maxDepth;                     // deepest rollback, in frames
+  uint64_t resimNs;                 // time spent simulating again
+  uint64_t maxResimNs;              // longest single rollback
+  uint64_t packetsSent;
+  uint64_t packetsReceived;
+};
+
+class NetplaySession
+{
+public:
+  static const int maxPrediction = 8;       // frames run ahead of the remote keys before stalling
+  static const int maxInputDelay = 8;
+
+  // runs emu, which must be in the same state on both peers when Start is
+  // called. the transport must outlive the session.
+  NetplaySession(Emulator &emu, NetplayTransport *transport);
+
+  // the current state of the emulator becomes frame 0. local keys apply
+  // inputDelay frames after they are given, which hides that much latency
+  // without rollbacks; both peers must use the same delay.
+  void Start(int inputDelay = 0);
+
+  // one host frame: exchanges keys, rolls back if a prediction was wrong,
+  // and runs the next frame with localKeys. returns false if the remote
+  // peer is too far behind; then no frame was run and the keys were not
+  // taken.
+  bool AdvanceFrame(uint16_t localKeys);
+
+  // exchanges keys and rolls back if needed, without running a frame. for
+  // a peer that waits, so the other one can catch up.
+  void Poll();
+
+  int Frame() const { return frame; }                         // frames run so far
+  int ConfirmedFrames() const { return remoteCount < frame ? remoteCount : frame; }   // frames run with the real remote keys
+  int LastRollback() const { return lastRollback; }           // depth of the rollback in the last call, or 0
+  const NetplayStats &Stats() const { return stats; }
+
+private:
+  static const int nrStates = maxPrediction + 1;
+  static const int inputRing = 64;          // larger than the unacknowledged keys can get
+  static const int maxInputsPerPacket = 40;
+
+  Emulator &emu;
+  NetplayTransport *transport;
+  Emulator states[nrStates];                // state at the start of frame f in states[f % nrStates]
+  uint16_t localInputs[inputRing];          // keys of frame f in [f % inputRing]
+  uint16_t remoteInputs[inputRing];
+  uint16_t usedRemote[inputRing];           // remote keys the frame was last run with
+  int frame;                                // next frame to run
+  int inputDelay;
+  int localCount;                           // local keys known for frames before this
+  int remoteCount;                          // remote keys known for frames before this
+  int remoteAck;                            // local keys the remote peer has
+  int firstMismatch;                        // first frame run with a wrong prediction
+  int lastRollback;
+  NetplayStats stats;
+
+  void Receive();
+  void Rollback();
+  void SendInputs();
+  void RunFrame(int f);
+
+  NetplaySession(const NetplaySession &);
+  NetplaySession &operator=(const NetplaySession &);
+};
@@ -0,0 +1,425 @@
+#include "netsession.h"
+
+#include <string.h>
+#include <chrono>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
+typedef int socklen_t;
+#define NET_NOSIGNAL 0
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#define NET_NOSIGNAL MSG_NOSIGNAL
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+//
+// sockets
+
+static bool NetStartup()
+{
+#ifdef _WIN32
+  static bool started = false;
+  if (!started) {
+    WSADATA data;
+    if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+      return false;
+    started = true;
+  }
+#endif
+  return true;
+}
+
+static bool WouldBlock()
+{
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+static void SetNoDelay(SocketHandle s)
+{
+  // frames are small and latency matters more than packet count
+  int on = 1;
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&on), sizeof(on));
+}
+
+SocketHandle NetListen(uint16_t port)
+{
+  if (!NetStartup())
+    return invalidSocket;
+  SocketHandle s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s == invalidSocket)
+    return invalidSocket;
+
+  int on = 1;
+  setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&on), sizeof(on));
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(s, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(s, SOMAXCONN) != 0 ||
+      !NetSetNonBlocking(s)) {
+    NetClose(s);
+    return invalidSocket;
+  }
+  return s;
+}
+
+SocketHandle NetAccept(SocketHandle listener)
+{
+  SocketHandle s = accept(listener, NULL, NULL);
+  if (s == invalidSocket)
+    return invalidSocket;
+  if (!NetSetNonBlocking(s)) {
+    NetClose(s);
+    return invalidSocket;
+  }
+  SetNoDelay(s);
+  return s;
+}
+
+SocketHandle NetConnect(const char *host, uint16_t port)
+{
+  if (!NetStartup())
+    return invalidSocket;
+  SocketHandle s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s == invalidSocket)
+    return invalidSocket;
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, host, &addr.sin_addr) != 1 ||
+      connect(s, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || !NetSetNonBlocking(s)) {
+    NetClose(s);
+    return invalidSocket;
+  }
+  SetNoDelay(s);
+  return s;
+}
+
+SocketHandle NetUdpOpen(uint16_t port)
+{
+  if (!NetStartup())
+    return invalidSocket;
+  SocketHandle s = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s == invalidSocket)
+    return invalidSocket;
+
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  if (bind(s, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || !NetSetNonBlocking(s)) {
+    NetClose(s);
+    return invalidSocket;
+  }
+  return s;
+}
+
+bool NetUdpConnect(SocketHandle s, const char *host, uint16_t port)
+{
+  sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  return inet_pton(AF_INET, host, &addr.sin_addr) == 1 &&
+    connect(s, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0;
+}
+
+void NetClose(SocketHandle s)
+{
+#ifdef _WIN32
+  closesocket(s);
+#else
+  close(static_cast<int>(s));
+#endif
+}
+
+bool NetSetNonBlocking(SocketHandle s)
+{
+#ifdef _WIN32
+  u_long on = 1;
+  return ioctlsocket(s, FIONBIO, &on) == 0;
+#else
+  int flags = fcntl(static_cast<int>(s), F_GETFL, 0);
+  return flags >= 0 && fcntl(static_cast<int>(s), F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+int NetSend(SocketHandle s, const void *data, size_t len)
+{
+  int n = send(s, static_cast<const char *>(data), static_cast<int>(len), NET_NOSIGNAL);
+  if (n >= 0)
+    return n;
+  return WouldBlock() ? 0 : -1;
+}
+
+int NetReceive(SocketHandle s, void *data, size_t len)
+{
+  int n = recv(s, static_cast<char *>(data), static_cast<int>(len), 0);
+  if (n > 0)
+    return n;
+  if (n == 0)
+    return -1;                      // closed by the other side
+  return WouldBlock() ? 0 : -1;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// Poller class
+
+#ifdef __linux__
+
+Poller::Poller()
+{
+  epfd = epoll_create1(0);
+}
+
+Poller::~Poller()
+{
+  if (epfd >= 0)
+    close(epfd);
+}
+
+bool Poller::Add(SocketHandle s, void *data)
+{
+  epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = data;
+  return epoll_ctl(epfd, EPOLL_CTL_ADD, static_cast<int>(s), &ev) == 0;
+}
+
+void Poller::SetWrite(SocketHandle s, void *data, bool write)
+{
+  epoll_event ev;
+  ev.events = write ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  ev.data.ptr = data;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, static_cast<int>(s), &ev);
+}
+
+void Poller::Remove(SocketHandle s)
+{
+  epoll_event ev;
+  epoll_ctl(epfd, EPOLL_CTL_DEL, static_cast<int>(s), &ev);
+}
+
+int Poller::Wait(int timeoutMs, Event *events, int maxEvents)
+{
+  epoll_event ev[64];
+  if (maxEvents > 64)
+    maxEvents = 64;
+  int n = epoll_wait(epfd, ev, maxEvents, timeoutMs);
+  if (n < 0)
+    return 0;                       // interrupted
+  for (int idx = 0; idx < n; idx++) {
+    events[idx].data = ev[idx].data.ptr;
+    events[idx].readable = (ev[idx].events & EPOLLIN) != 0;
+    events[idx].writable = (ev[idx].events & EPOLLOUT) != 0;
+    events[idx].error = (ev[idx].events & (EPOLLERR | EPOLLHUP)) != 0;
+  }
+  return n;
+}
+
+#else
+
+Poller::Poller()
+{
+}
+
+Poller::~Poller()
+{
+}
+
+bool Poller::Add(SocketHandle s, void *data)
+{
+  Entry entry;
+  entry.s = s;
+  entry.data = data;
+  entry.write = false;
+  entries.push_back(entry);
+  return true;
+}
+
+void Poller::SetWrite(SocketHandle s, void *data, bool write)
+{
+  for (size_t idx = 0; idx < entries.size(); idx++)
+    if (entries[idx].s == s) {
+      entries[idx].data = data;
+      entries[idx].write = write;
+    }
+}
+
+void Poller::Remove(SocketHandle s)
+{
+  for (size_t idx = 0; idx < entries.size(); idx++)
+    if (entries[idx].s == s) {
+      entries[idx] = entries.back();
+      entries.pop_back();
+      return;
+    }
+}
+
+int Poller::Wait(int timeoutMs, Event *events, int maxEvents)
+{
+  pollBuffer.resize(entries.size() * sizeof(pollfd) + 1);
+  pollfd *fds = reinterpret_cast<pollfd *>(&pollBuffer[0]);
+  for (size_t idx = 0; idx < entries.size(); idx++) {
+    fds[idx].fd = entries[idx].s;
+    fds[idx].events = entries[idx].write ? POLLIN | POLLOUT : POLLIN;
+    fds[idx].revents = 0;
+  }
+#ifdef _WIN32
+  int n = entries.empty() ? 0 : WSAPoll(fds, static_cast<ULONG>(entries.size()), timeoutMs);
+  if (entries.empty())
+    Sleep(timeoutMs);
+#else
+  int n = poll(fds, entries.size(), timeoutMs);
+#endif
+  if (n <= 0)
+    return 0;
+
+  int count = 0;
+  for (size_t idx = 0; idx < entries.size() && count < maxEvents; idx++) {
+    if (fds[idx].revents == 0)
+      continue;
+    events[count].data = entries[idx].data;
+    events[count].readable = (fds[idx].revents & POLLIN) != 0;
+    events[count].writable = (fds[idx].revents & POLLOUT) != 0;
+    events[count].error = (fds[idx].revents & (POLLERR | POLLHUP)) != 0;
+    count++;
+  }
+  return count;
+}
+
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+//
+// messages
+
+uint8_t *AppendMessage(std::vector<uint8_t> &out, uint32_t type, size_t size)
+{
+  MessageHeader header;
+  header.type = type;
+  header.size = static_cast<uint32_t>(size);
+  size_t pos = out.size();
+  out.resize(pos + sizeof(header) + size);
+  memcpy(&out[pos], &header, sizeof(header));
+  return &out[pos + sizeof(header)];
+}
+
+bool NextMessage(const std::vector<uint8_t> &buf, size_t &pos, MessageHeader &header, const uint8_t *&payload)
+{
+  if (buf.size() - pos < sizeof(header))
+    return false;
+  memcpy(&header, &buf[pos], sizeof(header));
+  if (header.size > maxMessageSize || buf.size() - pos - sizeof(header) < header.size)
+    return false;
+  payload = &buf[pos] + sizeof(header);
+  pos += sizeof(header) + header.size;
+  return true;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// frame deltas
+
+static uint8_t *PutCount(uint8_t *out, size_t count)
+{
+  while (count >= 0x80) {
+    *out++ = static_cast<uint8_t>(count | 0x80);
+    count >>= 7;
+  }
+  *out++ = static_cast<uint8_t>(count);
+  return out;
+}
+
+static const uint8_t *GetCount(const uint8_t *in, const uint8_t *end, size_t &count)
+{
+  count = 0;
+  for (int shift = 0; in < end && shift < 32; shift += 7) {
+    uint8_t b = *in++;
+    count |= static_cast<size_t>(b & 0x7F) << shift;
+    if ((b & 0x80) == 0)
+      return in;
+  }
+  return NULL;
+}
+
+size_t MaxDeltaSize(size_t size)
+{
+  // worst case is alternating single unchanged and changed bytes: three
+  // bytes for every two, plus the counts of the last run.
+  return size * 3 / 2 + 16;
+}
+
+size_t EncodeDelta(const uint8_t *prev, const uint8_t *cur, size_t size, uint8_t *out)
+{
+  uint8_t *start = out;
+  size_t pos = 0;
+  while (pos < size) {
+    size_t same = pos;
+    while (same < size && prev[same] == cur[same])
+      same++;
+    if (same == size)
+      break;                        // no more changes, the rest is implied
+    size_t diff = same;
+    while (diff < size && prev[diff] != cur[diff])
+      diff++;
+    out = PutCount(out, same - pos);
+    out = PutCount(out, diff - same);
+    for (size_t idx = same; idx < diff; idx++)
+      *out++ = prev[idx] ^ cur[idx];
+    pos = diff;
+  }
+  return out - start;
+}
+
+bool ApplyDelta(uint8_t *screen, size_t size, const uint8_t *delta, size_t len)
+{
+  const uint8_t *end = delta + len;
+  size_t pos = 0;
+  while (delta < end) {
+    size_t same, diff;
+    delta = GetCount(delta, end, same);
+    if (delta == NULL)
+      return false;
+    delta = GetCount(delta, end, diff);
+    if (delta == NULL || same > size - pos || diff > size - pos - same ||
+        diff > static_cast<size_t>(end - delta))
+      return false;
+    pos += same;
+    for (size_t idx = 0; idx < diff; idx++)
+      screen[pos++] ^= *delta++;
+  }
+  return true;
+}
+
+uint64_t NowNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
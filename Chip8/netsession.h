@@ -0,0 +1,134 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////
+//
+// sockets. thin layer over winsock and bsd sockets, only what the session
+// server, its clients and netplay need. session sockets are tcp on
+// 127.0.0.1, netplay sockets udp on all interfaces.
+
+typedef uintptr_t SocketHandle;
+static const SocketHandle invalidSocket = ~static_cast<SocketHandle>(0);
+
+SocketHandle NetListen(uint16_t port);
+SocketHandle NetAccept(SocketHandle listener);            // invalidSocket if none pending
+SocketHandle NetConnect(const char *host, uint16_t port);
+void NetClose(SocketHandle s);
+bool NetSetNonBlocking(SocketHandle s);
+
+// udp, nonblocking. after NetUdpConnect, NetSend and NetReceive send and
+// receive whole datagrams to and from that peer only.
+SocketHandle NetUdpOpen(uint16_t port);
+bool NetUdpConnect(SocketHandle s, const char *host, uint16_t port);
+
+// return the number of bytes transferred, 0 if the call would block, and
+// -1 if the connection is closed or failed.
+int NetSend(SocketHandle s, const void *data, size_t len);
+int NetReceive(SocketHandle s, void *data, size_t len);
+
+///////////////////////////////////////////////////////////////////////////
+//
+// Poller class. waits for socket events: epoll on linux, poll elsewhere.
+
+class Poller
+{
+public:
+  struct Event {
+    void *data;
+    bool readable;
+    bool writable;
+    bool error;
+  };
+
+  Poller();
+  ~Poller();
+  bool Add(SocketHandle s, void *data);
+  void SetWrite(SocketHandle s, void *data, bool write);  // also wait for writable
+  void Remove(SocketHandle s);
+  int Wait(int timeoutMs, Event *events, int maxEvents);
+
+private:
+#ifdef __linux__
+  int epfd;
+#else
+  struct Entry {
+    SocketHandle s;
+    void *data;
+    bool write;
+  };
+  std::vector<Entry> entries;
+  std::vector<uint8_t> pollBuffer;  // pollfd array, reused between waits
+#endif
+
+  Poller(const Poller &);
+  Poller &operator=(const Poller &);
+};
+
+///////////////////////////////////////////////////////////////////////////
+//
+// session protocol. messages are a header followed by the payload. both
+// sides run on the same host, so fields are in host byte order.
+//
+// client -> server
+//   MsgLoad     mode (uint8), rom data. (re)starts the session with the rom.
+//   MsgKey      key (uint8), down (uint8)
+// server -> client
+//   MsgWelcome  WelcomeMessage
+//   MsgFrame    FrameMessage, then the delta to the previous frame sent,
+//               or to an empty screen if FrameKeyframe is set
+//   MsgError    Emulator::ErrorType (uint8). the session stops running.
+
+enum MessageType {
+  MsgLoad = 1,
+  MsgKey,
+  MsgWelcome,
+  MsgFrame,
+  MsgError
+};
+
+struct MessageHeader {
+  uint32_t type;
+  uint32_t size;                    // payload size, without the header
+};
+
+struct WelcomeMessage {
+  uint32_t session;
+  uint32_t workers;                 // worker threads of the server
+};
+
+enum FrameFlags {
+  FrameKeyframe = 0x01              // first frame after a load or a resize: the client clears its screen
+};
+
+struct FrameMessage {
+  uint32_t frame;                   // frames run since the rom was loaded
+  uint16_t width;
+  uint16_t height;
+  uint64_t stamp;                   // steady clock, nanoseconds, when the frame was done
+  uint64_t workNs;                  // server time spent on the session since the previous message
+  uint32_t flags;                   // FrameFlags
+  uint32_t load;                    // MsgLoads received on the connection, counting this rom
+};
+
+static const size_t maxMessageSize = 65536 + 16;
+static const size_t frameSize = 128 * 64;     // largest screen, one byte per pixel
+
+// appends a message, returns a pointer to its payload
+uint8_t *AppendMessage(std::vector<uint8_t> &out, uint32_t type, size_t size);
+
+// finds the next complete message in buf at pos, and moves pos past it.
+// returns false if no complete message is there, or if it is invalid
+// (check with size > maxMessageSize).
+bool NextMessage(const std::vector<uint8_t> &buf, size_t &pos, MessageHeader &header, const uint8_t *&payload);
+
+// frame deltas: the xor of the new frame with the previous one, run length
+// coded as (unchanged bytes, changed bytes) counts followed by the changed
+// bytes. counts are 7 bit varints. an unchanged frame codes to nothing.
+size_t MaxDeltaSize(size_t size);
+size_t EncodeDelta(const uint8_t *prev, const uint8_t *cur, size_t size, uint8_t *out);
+bool ApplyDelta(uint8_t *screen, size_t size, const uint8_t *delta, size_t len);
+
+uint64_t NowNs();                   // steady clock in nanoseconds, as used in FrameMessage::stamp
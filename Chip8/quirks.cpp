@@ -0,0 +1,206 @@
+#include "quirks.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "analysis.h"
+
+// cache files hold this and the profile, as text
+static const char quirkFileTag[] = "chip8-quirks 1";
+
+static const size_t maxScreenSize = 128 * 64;
+
+// keys tried in turn: the usual movement and action keys first
+static const uint8_t scriptOrder[16] = { 5, 4, 6, 8, 2, 1, 0xC, 0xD, 0xA, 7, 9, 3, 0xE, 0xF, 0, 0xB };
+
+///////////////////////////////////////////////////////////////////////////
+//
+// QuirkDetector class
+
+uint16_t QuirkDetector::ScriptKeys(int frame)
+{
+  // every half second one key, held for 10 frames
+  int phase = frame / 30;
+  if (frame % 30 >= 10)
+    return 0;
+  return static_cast<uint16_t>(1 << scriptOrder[phase % 16]);
+}
+
+std::string QuirkDetector::Names(int quirks)
+{
+  static const char *names[4] = { "shift-vy", "increment-i", "jump-vx", "wrap" };
+  std::string text;
+  for (int bit = 0; bit < 4; bit++) {
+    if (quirks & (1 << bit)) {
+      if (!text.empty())
+        text += ", ";
+      text += names[bit];
+    }
+  }
+  return text.empty() ? "none" : text;
+}
+
+void QuirkDetector::Run(const uint8_t *rom, size_t romSize, Emulator::ChipMode mode, int frames, QuirkRun &run)
+{
+  Emulator emu;
+  emu.Init(mode);
+  emu.SetQuirks(run.quirks);
+  emu.storeProgram(const_cast<uint8_t *>(rom), romSize);
+
+  uint8_t screen[2][maxScreenSize];
+  uint8_t used[maxScreenSize];
+  memset(screen[0], 0, sizeof(screen[0]));
+  memset(used, 0, sizeof(used));
+  int cur = 0;
+  size_t lastSize = 0;
+
+  run.errorFrame = -1;
+  run.error = Emulator::ErrorNone;
+  run.changedFrames = 0;
+  for (int frame = 0; frame < frames; frame++) {
+    emu.SetKeys(ScriptKeys(frame));
+    emu.DoFrame();
+    if (emu.ErrorOccured()) {
+      run.errorFrame = frame;
+      run.error = emu.GetErrorType();
+      break;
+    }
+    if (!emu.ScreenIsInvalidated())
+      continue;
+
+    // drawing the same thing again is not activity, only a changed screen
+    size_t size = emu.SCR.Width() * emu.SCR.Height();
+    emu.SCR.Render(screen[cur ^ 1], emu.SCR.Width());
+    if (size != lastSize || memcmp(screen[cur], screen[cur ^ 1], size) != 0)
+      run.changedFrames++;
+    cur ^= 1;
+    lastSize = size;
+    for (size_t idx = 0; idx < size; idx++)
+      used[idx] |= screen[cur][idx];
+  }
+
+  run.pixelsUsed = 0;
+  for (size_t idx = 0; idx < sizeof(used); idx++)
+    run.pixelsUsed += used[idx] != 0;
+
+  // an error outweighs any activity, the earlier the worse. a stack fault
+  // is the surest sign of a wrong profile. quitting is a normal end.
+  int64_t score = static_cast<int64_t>(run.changedFrames) * 100 + run.pixelsUsed;
+  if (run.error == Emulator::ErrorStackOverflow || run.error == Emulator::ErrorStackUnderflow)
+    score -= 2000000 + static_cast<int64_t>(frames - run.errorFrame) * 1000;
+  else if (run.error != Emulator::ErrorNone && run.error != Emulator::ErrorQuit)
+    score -= 1000000 + static_cast<int64_t>(frames - run.errorFrame) * 1000;
+  run.score = score;
+}
+
+static int BitCount(int bits)
+{
+  int count = 0;
+  for (; bits != 0; bits &= bits - 1)
+    count++;
+  return count;
+}
+
+int QuirkDetector::Detect(const uint8_t *rom, size_t romSize, Emulator::ChipMode mode,
+  QuirkRun *runs, int frames, int nrThreads)
+{
+  QuirkRun local[Emulator::nrQuirkProfiles];
+  if (runs == NULL)
+    runs = local;
+  for (int idx = 0; idx < Emulator::nrQuirkProfiles; idx++)
+    runs[idx].quirks = idx;
+
+  // the profiles are handed out one at a time, so fast runs do not wait
+  // for slow ones
+  if (nrThreads <= 0)
+    nrThreads = static_cast<int>(std::thread::hardware_concurrency());
+  if (nrThreads > Emulator::nrQuirkProfiles)
+    nrThreads = Emulator::nrQuirkProfiles;
+  if (nrThreads < 1)
+    nrThreads = 1;
+  std::atomic<int> next(0);
+  std::vector<std::thread> threads;
+  for (int th = 0; th < nrThreads; th++) {
+    threads.push_back(std::thread([&]() {
+      int idx;
+      while ((idx = next++) < Emulator::nrQuirkProfiles)
+        Run(rom, romSize, mode, frames, runs[idx]);
+    }));
+  }
+  for (size_t th = 0; th < threads.size(); th++)
+    threads[th].join();
+
+  // profiles with fewer quirks first. a profile with more quirks has to
+  // be clearly better: wrapping sprites, for one, always lights a few more
+  // pixels, even for roms that are written for clipping.
+  int best = 0;
+  for (int bits = 1; bits <= 4; bits++) {
+    for (int idx = 1; idx < Emulator::nrQuirkProfiles; idx++) {
+      int64_t margin = (runs[best].score < 0 ? -runs[best].score : runs[best].score) / 10 + 100;
+      if (BitCount(idx) == bits && runs[idx].score > runs[best].score + margin)
+        best = idx;
+    }
+  }
+  return best;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+//
+// QuirkCache class
+
+QuirkCache::QuirkCache(const std::string &directory)
+: directory(directory)
+{
+}
+
+std::string QuirkCache::FileName(uint64_t hash, int mode) const
+{
+  char name[40];
+  sprintf(name, "%016llx-%d.c8q", static_cast<unsigned long long>(hash), mode);
+  if (directory.empty())
+    return name;
+  char last = directory[directory.size() - 1];
+  if (last == '/' || last == '\\')
+    return directory + name;
+  return directory + "/" + name;
+}
+
+int QuirkCache::Load(const uint8_t *rom, size_t romSize, Emulator::ChipMode mode, bool *cached)
+{
+  uint64_t hash = CodeAnalysis::Hash(rom, romSize, mode);
+  std::string fileName = FileName(hash, mode);
+
+  FILE *f = fopen(fileName.c_str(), "r");
+  if (f != NULL) {
+    char tag[32] = "";
+    int quirks = -1;
+    bool ok = fgets(tag, sizeof(tag), f) != NULL && strncmp(tag, quirkFileTag, strlen(quirkFileTag)) == 0 &&
+      fscanf(f, "%d", &quirks) == 1 && quirks >= 0 && quirks < Emulator::nrQuirkProfiles;
+    fclose(f);
+    if (ok) {
+      if (cached != NULL)
+        *cached = true;
+      return quirks;
+    }
+  }
+
+  // as with the analysis, a failed save only costs another detection
+  int quirks = QuirkDetector::Detect(rom, romSize, mode);
+  std::string temp = fileName + ".tmp";
+  f = fopen(temp.c_str(), "w");
+  if (f != NULL) {
+    bool ok = fprintf(f, "%s\n%d %s\n", quirkFileTag, quirks, QuirkDetector::Names(quirks).c_str()) > 0;
+    ok = fclose(f) == 0 && ok;
+    if (ok && rename(temp.c_str(), fileName.c_str()) != 0) {
+      remove(fileName.c_str());
+      rename(temp.c_str(), fileName.c_str());
+    }
+  }
+  if (cached != NULL)
+    *cached = false;
+  return quirks;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+#include "Emulator.h"
+
+///////////////////////////////////////////////////////////////////////////
+//
+// QuirkDetector. Finds the quirks (Emulator::Quirk) a rom needs, by running
+// it headless under every combination at once, one thread per core, with
+// the same scripted keys. Each run is scored: errors, and stack faults
+// most of all, count against it, screen activity counts for it. Quirks a
+// rom never runs into give the same run as without them, so ties go to
+// the profile with the fewest quirks.
+
+struct QuirkRun
+{
+  int quirks;
+  int errorFrame;                   // frame of the first error, or -1. the run stops there.
+  Emulator::ErrorType error;
+  int changedFrames;                // frames after which the screen looked different
+  int pixelsUsed;                   // pixels lit at some time
+  int64_t score;
+};
+
+class QuirkDetector
+{
+public:
+  static const int defaultFrames = 1200;    // 20 seconds of emulated time
+
+  // runs all profiles and returns the best. runs, if given, receives
+  // Emulator::nrQuirkProfiles entries. nrThreads 0 uses all cores.
+  static int Detect(const uint8_t *rom, size_t romSize, Emulator::ChipMode mode,
+    QuirkRun *runs = NULL, int frames = defaultFrames, int nrThreads = 0);
+
+  // one profile, on the calling thread
+  static void Run(const uint8_t *rom, size_t romSize, Emulator::ChipMode mode, int frames, QuirkRun &run);
+
+  static uint16_t ScriptKeys(int frame);  // the keys pressed in a frame
+  static std::string Names(int quirks);   // "shift-vy, wrap", or "none"
+};
+
+///////////////////////////////////////////////////////////////////////////
+//
+// QuirkCache. The detected profile of a rom, stored by hash of the rom in
+// a small file next to the analysis cache.
+
+class QuirkCache
+{
+public:
+  QuirkCache(const std::string &directory);
+
+  // the quirks of the rom, from the cache or detected and stored. cached
+  // tells if the cache had them.
+  int Load(const uint8_t *rom, size_t romSize, Emulator::ChipMode mode, bool *cached = NULL);
+  std::string FileName(uint64_t hash, int mode) const;
+
+private:
+  std::string directory;
+};
@@ -0,0 +1,87 @@
+#include "runahead.h"
+
+#include <chrono>
+
+#include "metrics.h"
+
+static uint64_t ClockNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// RunAhead class
+
+RunAhead::RunAhead(Emulator &e)
+: emu(e), frames(0), advanced(false), advanceStart(0), shownHash(0), tracer(NULL)
+{
+  ResetStats();
+}
+
+void RunAhead::SetFrames(int n)
+{
+  frames = n < 0 ? 0 : (n > maxFrames ? maxFrames : n);
+}
+
+void RunAhead::ResetStats()
+{
+  stats.frames = 0;
+  stats.aheadFrames = 0;
+  stats.saveNs = 0;
+  stats.aheadNs = 0;
+  stats.restoreNs = 0;
+  stats.maxNs = 0;
+}
+
+bool RunAhead::Advance()
+{
+  if (advanced)
+    Restore();
+  if (frames == 0)
+    return false;
+
+  uint64_t start = ClockNs();
+  saved = emu;
+  tracer = emu.GetTracer();
+  emu.SetTracer(NULL);
+  advanced = true;
+  advanceStart = start;
+  uint64_t savedAt = ClockNs();
+
+  // an error ahead, like a quit, is undone by the restore
+  for (int frame = 0; frame < frames && !emu.ErrorOccured(); frame++)
+    emu.DoFrame();
+  uint64_t end = ClockNs();
+
+  stats.frames++;
+  stats.aheadFrames += frames;
+  stats.saveNs += savedAt - start;
+  stats.aheadNs += end - savedAt;
+  Metrics::Add(MetricRunAheadFrames, frames);
+  Metrics::Add(MetricRunAheadNs, end - start);
+
+  // the frames ahead draw again what the last call drew, so the flag says
+  // little. the screen hash says whether it changed.
+  emu.ScreenIsInvalidated();
+  uint64_t hash = emu.SCR.Hash();
+  bool changed = hash != shownHash;
+  shownHash = hash;
+  return changed;
+}
+
+void RunAhead::Restore()
+{
+  if (!advanced)
+    return;
+  uint64_t start = ClockNs();
+  emu = saved;
+  emu.SetTracer(tracer);
+  advanced = false;
+  uint64_t end = ClockNs();
+
+  stats.restoreNs += end - start;
+  if (end - advanceStart > stats.maxNs)
+    stats.maxNs = end - advanceStart;
+  Metrics::Add(MetricRunAheadNs, end - start);
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "Emulator.h"
+
+///////////////////////////////////////////////////////////////////////////
+//
+// run-ahead. many games read a key in one frame and draw the answer a
+// frame or two later, so even with no delay in the window a key press
+// shows late. after each real frame the emulator saves its state, runs
+// some frames further with the keys held now, and shows the screen of the
+// last of them; then it goes back to the saved state. the game runs as
+// before, the screen is shown that many frames early.
+//
+// the saved state is a copy-on-write fork into an emulator kept for it,
+// so saving is a copy of the registers and page references, and restoring
+// is the same copy back. the pages the frames ahead write come from the
+// free list of the thread, so nothing is allocated once it has run a
+// while.
+
+struct RunAheadStats
+{
+  uint64_t frames;                  // host frames run ahead from
+  uint64_t aheadFrames;             // frames run ahead, and thrown away
+  uint64_t saveNs;
+  uint64_t aheadNs;
+  uint64_t restoreNs;
+  uint64_t maxNs;                   // slowest host frame, save to restore
+};
+
+class RunAhead
+{
+public:
+  static const int maxFrames = 8;
+
+  // runs ahead on emu, which must outlive this
+  explicit RunAhead(Emulator &emu);
+
+  void SetFrames(int n);            // 0 switches run-ahead off
+  int Frames() const { return frames; }
+
+  // saves the state and runs the frames ahead. emu then has the screen to
+  // show, until Restore. returns true if the screen ahead differs from the
+  // one of the last call.
+  bool Advance();
+  void Restore();                   // back to the state before Advance
+
+  const RunAheadStats &Stats() const { return stats; }
+  void ResetStats();
+
+private:
+  Emulator &emu;
+  Emulator saved;
+  int frames;
+  bool advanced;
+  uint64_t advanceStart;
+  uint64_t shownHash;               // hash of the screen of the last Advance
+  TraceWriter *tracer;              // of emu, which does not record the frames ahead
+  RunAheadStats stats;
+
+  RunAhead(const RunAhead &);
+  RunAhead &operator=(const RunAhead &);
+};
@@ -0,0 +1,233 @@
+#include "scheduler.h"
+
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+
+#include "metrics.h"
+#include "netsession.h"
+#include "timeline.h"
+
+///////////////////////////////////////////////////////////////////////////
+//
+// ScheduledSession class
+
+ScheduledSession::ScheduledSession()
+: callback(NULL), user(NULL), release(0), queued(false), running(false), paused(true),
+  frames(0), cpuNs(0), missed(0), keyHead(0), keyTail(0), screenWidth(0), screenHeight(0)
+{
+}
+
+void ScheduledSession::SetFrameCallback(FrameCallback cb, void *u)
+{
+  callback = cb;
+  user = u;
+}
+
+void ScheduledSession::PostKey(int key, bool down)
+{
+  Metrics::Add(MetricKeyEvents);
+  uint32_t head = keyHead.load(std::memory_order_relaxed);
+  uint32_t tail = keyTail.load(std::memory_order_acquire);
+  if (head - tail >= keyQueueSize) {
+    Metrics::Add(MetricKeyEventsDropped);
+    return;
+  }
+  keyQueue[head % keyQueueSize] = static_cast<uint8_t>((key & 0xF) | (down ? 0x10 : 0));
+  keyHead.store(head + 1, std::memory_order_release);
+}
+
+void ScheduledSession::ApplyKeys()
+{
+  uint32_t tail = keyTail.load(std::memory_order_relaxed);
+  uint32_t head = keyHead.load(std::memory_order_acquire);
+  for (; tail != head; tail++) {
+    uint8_t event = keyQueue[tail % keyQueueSize];
+    emu.SetKey(event & 0xF, (event & 0x10) != 0);
+  }
+  keyTail.store(tail, std::memory_order_release);
+}
+
+bool ScheduledSession::CopyScreen(uint8_t *dst, size_t bytesPerLine, size_t &width, size_t &height)
+{
+  std::lock_guard<std::mutex> guard(screenLock);
+  if (screenWidth == 0)
+    return false;
+  width = screenWidth;
+  height = screenHeight;
+  for (size_t y = 0; y < height; y++)
+    memcpy(dst + y * bytesPerLine, screen + y * width, width);
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+//
+// FrameScheduler class
+
+// heap order: the earliest release on top
+bool FrameScheduler::LaterRelease(const ScheduledSession *a, const ScheduledSession *b)
+{
+  return a->release > b->release;
+}
+
+FrameScheduler::FrameScheduler(int nrWorkers)
+: stopping(false)
+{
+  if (nrWorkers <= 0)
+    nrWorkers = static_cast<int>(std::thread::hardware_concurrency());
+  if (nrWorkers < 1)
+    nrWorkers = 1;
+  for (int idx = 0; idx < nrWorkers; idx++)
+    workers.push_back(std::thread(&FrameScheduler::Worker, this));
+}
+
+FrameScheduler::~FrameScheduler()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (size_t idx = 0; idx < workers.size(); idx++)
+    workers[idx].join();
+}
+
+void FrameScheduler::Add(ScheduledSession *session)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  session->paused = true;
+  sessions.push_back(session);
+}
+
+void FrameScheduler::Remove(ScheduledSession *session)
+{
+  std::unique_lock<std::mutex> guard(lock);
+  session->paused = true;
+  Unqueue(session);
+  while (session->running)
+    idle.wait(guard);
+  sessions.erase(std::remove(sessions.begin(), sessions.end(), session), sessions.end());
+}
+
+void FrameScheduler::Pause(ScheduledSession *session)
+{
+  // a queued session is dropped when it comes to the top of the queue, a
+  // running frame ends normally. either way the worker leaves it out.
+  std::unique_lock<std::mutex> guard(lock);
+  session->paused = true;
+  while (session->running)
+    idle.wait(guard);
+}
+
+void FrameScheduler::Resume(ScheduledSession *session)
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (!session->paused)
+      return;
+    // a session still in the queue keeps its place, changing its release
+    // would break the heap
+    session->paused = false;
+    if (!session->running && !session->queued) {
+      session->release = NowNs();
+      Push(session);
+    }
+  }
+  wake.notify_one();
+}
+
+size_t FrameScheduler::NrSessions()
+{
+  std::lock_guard<std::mutex> guard(lock);
+  return sessions.size();
+}
+
+void FrameScheduler::Push(ScheduledSession *session)
+{
+  session->queued = true;
+  queue.push_back(session);
+  std::push_heap(queue.begin(), queue.end(), LaterRelease);
+}
+
+void FrameScheduler::Unqueue(ScheduledSession *session)
+{
+  // only for removing, so a linear search is fine
+  if (!session->queued)
+    return;
+  queue.erase(std::remove(queue.begin(), queue.end(), session), queue.end());
+  std::make_heap(queue.begin(), queue.end(), LaterRelease);
+  session->queued = false;
+}
+
+void FrameScheduler::Worker()
+{
+  TIMELINE_THREAD("scheduler worker");
+  std::unique_lock<std::mutex> guard(lock);
+  while (!stopping) {
+    if (queue.empty()) {
+      wake.wait(guard);
+      continue;
+    }
+    ScheduledSession *session = queue.front();
+    if (session->paused) {
+      std::pop_heap(queue.begin(), queue.end(), LaterRelease);
+      queue.pop_back();
+      session->queued = false;
+      continue;
+    }
+    uint64_t now = NowNs();
+    if (session->release > now) {
+      uint64_t sleepStart = now;
+      wake.wait_for(guard, std::chrono::nanoseconds(session->release - now));
+      Metrics::Add(MetricSleepNs, NowNs() - sleepStart);
+      continue;
+    }
+    std::pop_heap(queue.begin(), queue.end(), LaterRelease);
+    queue.pop_back();
+    session->queued = false;
+    session->running = true;
+    // the next session may already be due, let another worker take it
+    if (!queue.empty())
+      wake.notify_one();
+    guard.unlock();
+
+    // the frame itself, outside the lock
+    uint64_t start = NowNs();
+    TIMELINE_BEGIN("session frame");
+    session->ApplyKeys();
+    int executed = session->emu.DoFrame();
+    bool changed = session->emu.ScreenIsInvalidated();
+    if (changed) {
+      std::lock_guard<std::mutex> screenGuard(session->screenLock);
+      session->screenWidth = session->emu.SCR.Width();
+      session->screenHeight = session->emu.SCR.Height();
+      session->emu.SCR.Render(session->screen, session->screenWidth);
+    }
+    bool quit = session->emu.ErrorOccured() && session->emu.GetErrorType() == Emulator::ErrorQuit;
+    uint64_t end = NowNs();
+    TIMELINE_END("session frame");
+    if (changed && session->callback != NULL)
+      session->callback(session, session->user);
+
+    session->frames++;
+    session->cpuNs += end - start;
+    Metrics::Add(MetricFrames);
+    Metrics::Add(MetricInstructions, executed);
+    Metrics::Add(MetricEmulationNs, end - start);
+
+    guard.lock();
+    session->running = false;
+    uint64_t deadline = session->release + framePeriodNs;
+    if (end > deadline)
+      session->missed++;
+    session->release = deadline;
+    if (session->release + framePeriodNs < end)
+      session->release = end;       // more than a frame behind: skip ahead
+    if (quit)
+      session->paused = true;       // nothing left to run
+    if (!session->paused && !stopping)
+      Push(session);
+    idle.notify_all();
+  }
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Emulator.h"
+
+class FrameScheduler;
+
+///////////////////////////////////////////////////////////////////////////
+//
+// ScheduledSession class. One emulator run by a FrameScheduler, one 60Hz
+// frame per task. A session is never run by two workers at once, so the
+// emulator needs no locking of its own; other threads only touch it while
+// the session is paused, or through the key queue and the screen copy.
+
+class ScheduledSession
+{
+public:
+  // called on a worker after a frame that changed the screen
+  typedef void (*FrameCallback)(ScheduledSession *session, void *user);
+
+  ScheduledSession();
+
+  // the emulator. only while the session is paused, or not yet added.
+  Emulator &GetEmulator() { return emu; }
+  void SetFrameCallback(FrameCallback callback, void *user);
+
+  // key events from any thread, applied at the start of the next frame
+  void PostKey(int key, bool down);
+
+  // copies the screen of the last frame that changed it, from any thread.
+  // returns false if no frame was shown yet.
+  bool CopyScreen(uint8_t *dst, size_t bytesPerLine, size_t &width, size_t &height);
+
+  bool IsPaused() const { return paused; }
+  uint64_t Frames() const { return frames; }
+  uint64_t CpuNs() const { return cpuNs; }                    // worker time spent running frames
+  uint64_t MissedDeadlines() const { return missed; }         // frames that ended after their deadline
+
+private:
+  friend class FrameScheduler;
+
+  Emulator emu;
+  FrameCallback callback;
+  void *user;
+
+  // scheduler state, under the scheduler lock
+  uint64_t release;                 // frame may start from this time on, steady clock ns
+  bool queued;                      // in the run queue
+  bool running;                     // on a worker right now
+  bool paused;
+
+  std::atomic<uint64_t> frames;
+  std::atomic<uint64_t> cpuNs;
+  std::atomic<uint64_t> missed;
+
+  // single producer, single consumer ring of key events: key | down << 4.
+  // the consumer is whichever worker runs the frame.
+  static const uint32_t keyQueueSize = 64;
+  uint8_t keyQueue[keyQueueSize];
+  std::atomic<uint32_t> keyHead;
+  std::atomic<uint32_t> keyTail;
+
+  std::mutex screenLock;
+  uint8_t screen[128 * 64];
+  size_t screenWidth;
+  size_t screenHeight;
+
+  void ApplyKeys();
+
+  ScheduledSession(const ScheduledSession &);
+  ScheduledSession &operator=(const ScheduledSession &);
+};
+
+///////////////////////////////////////////////////////////////////////////
+//
+// FrameScheduler class. Runs the frames of many sessions on a few worker
+// threads, about one per core. Runnable sessions wait in a queue ordered by
+// deadline, earliest first; a worker takes the first one when its frame is
+// due, or sleeps until then. Paused sessions are not in the queue, so they
+// cost nothing. A session that falls more than a frame behind skips ahead
+// instead of running a burst of frames.
+
+class FrameScheduler
+{
+public:
+  static const uint64_t framePeriodNs = 16666667;
+
+  FrameScheduler(int nrWorkers = 0);         // 0: one per core
+  ~FrameScheduler();
+
+  // sessions start paused. Remove and Pause wait for a running frame to
+  // end, so they must not be called from a frame callback.
+  void Add(ScheduledSession *session);
+  void Remove(ScheduledSession *session);
+  void Pause(ScheduledSession *session);
+  void Resume(ScheduledSession *session);
+
+  int NrWorkers() const { return static_cast<int>(workers.size()); }
+  size_t NrSessions();
+
+private:
+  std::mutex lock;
+  std::condition_variable wake;              // workers: the queue changed
+  std::condition_variable idle;              // Remove: a frame ended
+  std::vector<ScheduledSession *> sessions;
+  std::vector<ScheduledSession *> queue;     // heap, earliest release first
+  std::vector<std::thread> workers;
+  bool stopping;
+
+  static bool LaterRelease(const ScheduledSession *a, const ScheduledSession *b);
+  void Push(ScheduledSession *session);
+  void Unqueue(ScheduledSession *session);
+  void Worker();
+
+  FrameScheduler(const FrameScheduler &);
+  FrameScheduler &operator=(const FrameScheduler &);
+};
@@ -0,0 +1,159 @@
+#include "sessionclient.h"
+
+#include <string.h>
+#include <thread>
+
+///////////////////////////////////////////////////////////////////////////
+//
+// LatencyHistogram class
+
+void LatencyHistogram::Clear()
+{
+  memset(counts, 0, sizeof(counts));
+  total = 0;
+  maxNs = 0;
+}
+
+void LatencyHistogram::Add(uint64_t ns)
+{
+  uint64_t bucket = ns / bucketNs;
+  counts[bucket < nrBuckets ? bucket : nrBuckets]++;
+  total++;
+  if (ns > maxNs)
+    maxNs = ns;
+}
+
+double LatencyHistogram::PercentileMs(double p) const
+{
+  uint64_t target = static_cast<uint64_t>(total * p / 100.0);
+  uint64_t seen = 0;
+  for (int bucket = 0; bucket <= nrBuckets; bucket++) {
+    seen += counts[bucket];
+    if (seen > target)
+      return (bucket + 1) * bucketNs / 1e6;        // upper end of the bucket
+  }
+  return maxNs / 1e6;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// SessionClient class
+
+SessionClient::SessionClient()
+: framesReceived(0), bytesReceived(0), serverWorkNs(0), latency(NULL), onFrame(NULL), user(NULL),
+  socket(invalidSocket), session(0), workers(0), frame(0), loadNumber(0), width(0), height(0), error(0)
+{
+  memset(screen, 0, sizeof(screen));
+}
+
+SessionClient::~SessionClient()
+{
+  if (socket != invalidSocket)
+    NetClose(socket);
+}
+
+bool SessionClient::Connect(const char *host, uint16_t port)
+{
+  socket = NetConnect(host, port);
+  return socket != invalidSocket;
+}
+
+bool SessionClient::Send(const std::vector<uint8_t> &msg)
+{
+  // messages from the client are small, wait if the socket is full
+  size_t pos = 0;
+  while (pos < msg.size()) {
+    int n = NetSend(socket, &msg[pos], msg.size() - pos);
+    if (n < 0)
+      return false;
+    if (n == 0)
+      std::this_thread::yield();
+    pos += n;
+  }
+  return true;
+}
+
+bool SessionClient::Load(const uint8_t *rom, size_t size, int mode)
+{
+  std::vector<uint8_t> msg;
+  uint8_t *payload = AppendMessage(msg, MsgLoad, size + 1);
+  payload[0] = static_cast<uint8_t>(mode);
+  memcpy(payload + 1, rom, size);
+  frame = 0;
+  error = 0;
+  return Send(msg);
+}
+
+bool SessionClient::SendKey(int key, bool down)
+{
+  std::vector<uint8_t> msg;
+  uint8_t *payload = AppendMessage(msg, MsgKey, 2);
+  payload[0] = static_cast<uint8_t>(key);
+  payload[1] = down ? 1 : 0;
+  return Send(msg);
+}
+
+bool SessionClient::Receive()
+{
+  for (;;) {
+    size_t pos = in.size();
+    in.resize(pos + 16384);
+    int n = NetReceive(socket, &in[pos], 16384);
+    in.resize(pos + (n > 0 ? n : 0));
+    if (n < 0)
+      return false;
+    if (n == 0)
+      break;
+    bytesReceived += n;
+  }
+
+  size_t pos = 0;
+  MessageHeader header;
+  const uint8_t *payload;
+  while (NextMessage(in, pos, header, payload)) {
+    switch (header.type) {
+    case MsgWelcome:
+      if (header.size >= sizeof(WelcomeMessage)) {
+        WelcomeMessage welcome;
+        memcpy(&welcome, payload, sizeof(welcome));
+        session = welcome.session;
+        workers = welcome.workers;
+      }
+      break;
+    case MsgFrame: {
+      if (header.size < sizeof(FrameMessage))
+        return false;
+      FrameMessage msg;
+      memcpy(&msg, payload, sizeof(msg));
+      if (static_cast<size_t>(msg.width) * msg.height > frameSize)
+        return false;
+      if ((msg.flags & FrameKeyframe) != 0 || msg.width != width || msg.height != height) {
+        memset(screen, 0, sizeof(screen));
+        width = msg.width;
+        height = msg.height;
+      }
+      if (!ApplyDelta(screen, width * height, payload + sizeof(msg), header.size - sizeof(msg)))
+        return false;
+      frame = msg.frame;
+      loadNumber = msg.load;
+      framesReceived++;
+      serverWorkNs += msg.workNs;
+      if (latency != NULL)
+        latency->Add(NowNs() - msg.stamp);
+      if (onFrame != NULL)
+        onFrame(this, user);
+      break;
+    }
+    case MsgError:
+      error = header.size > 0 ? payload[0] : -1;
+      break;
+    }
+  }
+  if (in.size() - pos >= sizeof(header)) {
+    memcpy(&header, &in[pos], sizeof(header));
+    if (header.size > maxMessageSize)
+      return false;
+  }
+  in.erase(in.begin(), in.begin() + pos);
+  return true;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "netsession.h"
+
+///////////////////////////////////////////////////////////////////////////
+//
+// LatencyHistogram. frame latencies in 0.1 ms buckets, up to 100 ms.
+
+struct LatencyHistogram
+{
+  static const int nrBuckets = 1000;
+  static const uint64_t bucketNs = 100000;
+
+  uint64_t counts[nrBuckets + 1];   // last bucket counts everything slower
+  uint64_t total;
+  uint64_t maxNs;
+
+  LatencyHistogram() { Clear(); }
+  void Clear();
+  void Add(uint64_t ns);
+  double PercentileMs(double p) const;
+};
+
+///////////////////////////////////////////////////////////////////////////
+//
+// SessionClient. Client side of a SessionServer connection: sends the rom
+// and key events, and keeps the screen up to date from the frame deltas.
+// The socket is non blocking; call Receive when it is readable.
+
+class SessionClient
+{
+public:
+  SessionClient();
+  ~SessionClient();
+
+  bool Connect(const char *host, uint16_t port);
+  SocketHandle Socket() const { return socket; }
+
+  bool Load(const uint8_t *rom, size_t size, int mode);
+  bool SendKey(int key, bool down);
+  bool Receive();                   // false if the connection is closed
+
+  // state from the server
+  uint32_t Session() const { return session; }
+  uint32_t Workers() const { return workers; }
+  uint32_t Frame() const { return frame; }               // frame number of the screen
+  uint32_t LoadNumber() const { return loadNumber; }     // the screen is of the rom of this Load, from 1
+  size_t Width() const { return width; }
+  size_t Height() const { return height; }
+  const uint8_t *Screen() const { return screen; }       // one palette index per pixel
+  int Error() const { return error; }                    // Emulator::ErrorType, 0 if none
+
+  // counters
+  uint64_t framesReceived;
+  uint64_t bytesReceived;
+  uint64_t serverWorkNs;            // server time spent on this session
+  LatencyHistogram *latency;        // if set, frame latencies are added
+
+  // if set, called for every frame after it is applied
+  void (*onFrame)(SessionClient *client, void *user);
+  void *user;
+
+private:
+  SocketHandle socket;
+  std::vector<uint8_t> in;
+  uint32_t session;
+  uint32_t workers;
+  uint32_t frame;
+  uint32_t loadNumber;
+  size_t width;
+  size_t height;
+  uint8_t screen[frameSize];
+  int error;
+
+  bool Send(const std::vector<uint8_t> &msg);
+
+  SessionClient(const SessionClient &);
+  SessionClient &operator=(const SessionClient &);
+};
@@ -0,0 +1,364 @@
+#include "sessionserver.h"
+
+#include <string.h>
+
+#include "Emulator.h"
+#include "metrics.h"
+
+static const uint64_t frameNs = 16666667;
+static const size_t maxPending = 64 * 1024;   // unsent bytes at which a client skips frames
+
+struct SessionServer::Session
+{
+  SocketHandle socket;
+  uint32_t id;
+  Emulator emu;
+  bool running;                     // rom loaded, and no error
+  bool closed;
+  bool wantWrite;
+  uint32_t frame;
+  uint64_t workNs;                  // not yet reported to the client
+  size_t width;
+  size_t height;
+  bool keyframe;                    // the next frame sent is against an empty screen
+  uint32_t loads;                   // MsgLoads received
+  uint8_t screen[frameSize];        // last frame sent to the client
+  std::vector<uint8_t> in;
+  std::vector<uint8_t> out;
+  size_t outPos;
+};
+
+///////////////////////////////////////////////////////////////////////////
+//
+// SessionServer class
+
+SessionServer::SessionServer(int nrWorkers)
+: listener(invalidSocket), stopping(false), nextSession(1)
+{
+  if (nrWorkers < 1)
+    nrWorkers = 1;
+  for (int idx = 0; idx < nrWorkers; idx++) {
+    Worker *worker = new Worker;
+    worker->sessions = 0;
+    worker->frames = 0;
+    worker->framesSent = 0;
+    worker->bytesSent = 0;
+    worker->busyNs = 0;
+    worker->missed = 0;
+    workers.push_back(worker);
+  }
+}
+
+SessionServer::~SessionServer()
+{
+  stopping = true;
+  for (size_t idx = 0; idx < workers.size(); idx++) {
+    if (workers[idx]->thread.joinable())
+      workers[idx]->thread.join();
+    for (size_t s = 0; s < workers[idx]->incoming.size(); s++)
+      NetClose(workers[idx]->incoming[s]);
+    delete workers[idx];
+  }
+  if (listener != invalidSocket)
+    NetClose(listener);
+}
+
+bool SessionServer::Listen(uint16_t port)
+{
+  listener = NetListen(port);
+  return listener != invalidSocket;
+}
+
+void SessionServer::Run(double seconds, FILE *stats)
+{
+  for (size_t idx = 0; idx < workers.size(); idx++)
+    workers[idx]->thread = std::thread(&SessionServer::WorkerLoop, this, workers[idx]);
+
+  Poller poller;
+  poller.Add(listener, NULL);
+
+  uint64_t start = NowNs();
+  uint64_t lastStats = start;
+  uint64_t lastFrames = 0, lastSent = 0, lastBytes = 0, lastBusy = 0;
+
+  while (!stopping) {
+    Poller::Event event;
+    if (poller.Wait(100, &event, 1) > 0) {
+      SocketHandle s;
+      while ((s = NetAccept(listener)) != invalidSocket) {
+        // new sessions go to the worker with the fewest sessions
+        Worker *target = workers[0];
+        for (size_t idx = 1; idx < workers.size(); idx++)
+          if (workers[idx]->sessions < target->sessions)
+            target = workers[idx];
+        std::lock_guard<std::mutex> guard(target->lock);
+        target->incoming.push_back(s);
+        target->sessions++;
+      }
+    }
+
+    uint64_t now = NowNs();
+    if (stats != NULL && now - lastStats >= 1000000000) {
+      int sessions = 0;
+      uint64_t frames = 0, sent = 0, bytes = 0, busy = 0, missed = 0;
+      for (size_t idx = 0; idx < workers.size(); idx++) {
+        sessions += workers[idx]->sessions;
+        frames += workers[idx]->frames;
+        sent += workers[idx]->framesSent;
+        bytes += workers[idx]->bytesSent;
+        busy += workers[idx]->busyNs;
+        missed += workers[idx]->missed;
+      }
+      double secs = (now - lastStats) / 1e9;
+      double cores = (busy - lastBusy) / 1e9 / secs;
+      fprintf(stats, "%d sessions, %.0f frames/s, %.0f sent/s, %.0f KB/s, %.2f cores busy",
+        sessions, (frames - lastFrames) / secs, (sent - lastSent) / secs, (bytes - lastBytes) / secs / 1024, cores);
+      if (cores > 0)
+        fprintf(stats, ", %.0f sessions per core", sessions / cores);
+      fprintf(stats, ", %llu deadlines missed\n", static_cast<unsigned long long>(missed));
+      fflush(stats);
+      lastStats = now;
+      lastFrames = frames;
+      lastSent = sent;
+      lastBytes = bytes;
+      lastBusy = busy;
+    }
+    if (seconds > 0 && now - start >= seconds * 1e9)
+      stopping = true;
+  }
+
+  for (size_t idx = 0; idx < workers.size(); idx++)
+    workers[idx]->thread.join();
+}
+
+void SessionServer::WorkerLoop(Worker *worker)
+{
+  Poller poller;
+  std::vector<Session *> sessions;
+  std::vector<SocketHandle> incoming;
+  std::vector<uint8_t> scratch(MaxDeltaSize(frameSize));
+  Poller::Event events[64];
+  uint64_t deadline = NowNs() + frameNs;
+
+  while (!stopping) {
+    // pick up new connections
+    {
+      std::lock_guard<std::mutex> guard(worker->lock);
+      incoming.swap(worker->incoming);
+    }
+    for (size_t idx = 0; idx < incoming.size(); idx++) {
+      Session *session = new Session;
+      session->socket = incoming[idx];
+      session->id = nextSession++;
+      session->running = false;
+      session->closed = false;
+      session->wantWrite = false;
+      session->frame = 0;
+      session->workNs = 0;
+      session->width = 0;
+      session->height = 0;
+      session->keyframe = true;
+      session->loads = 0;
+      session->outPos = 0;
+      memset(session->screen, 0, sizeof(session->screen));
+
+      WelcomeMessage welcome;
+      welcome.session = session->id;
+      welcome.workers = static_cast<uint32_t>(workers.size());
+      memcpy(AppendMessage(session->out, MsgWelcome, sizeof(welcome)), &welcome, sizeof(welcome));
+
+      sessions.push_back(session);
+      poller.Add(session->socket, session);
+      Flush(worker, poller, session);
+    }
+    incoming.clear();
+
+    // socket events until the next frame is due
+    uint64_t now = NowNs();
+    int timeoutMs = now < deadline ? static_cast<int>((deadline - now + 999999) / 1000000) : 0;
+    int n = poller.Wait(timeoutMs, events, 64);
+    uint64_t busyStart = NowNs();
+    Metrics::Add(MetricSleepNs, busyStart - now);
+    for (int idx = 0; idx < n; idx++) {
+      Session *session = static_cast<Session *>(events[idx].data);
+      if (events[idx].readable && !Receive(session))
+        session->closed = true;
+      if (events[idx].writable && !Flush(worker, poller, session))
+        session->closed = true;
+      if (events[idx].error && !events[idx].readable)
+        session->closed = true;
+    }
+
+    if (NowNs() >= deadline) {
+      for (size_t idx = 0; idx < sessions.size(); idx++) {
+        Session *session = sessions[idx];
+        if (session->closed)
+          continue;
+        uint64_t frameStart = NowNs();
+        RunFrame(worker, session, scratch);
+        if (!Flush(worker, poller, session))
+          session->closed = true;
+        session->workNs += NowNs() - frameStart;
+      }
+      worker->frames += sessions.size();
+      Metrics::Add(MetricFrames, sessions.size());
+
+      deadline += frameNs;
+      now = NowNs();
+      if (now > deadline + frameNs) {
+        // too slow for all sessions: drop the frames, do not try to catch up
+        worker->missed++;
+        deadline = now + frameNs;
+      }
+    }
+
+    for (size_t idx = sessions.size(); idx-- > 0;)
+      if (sessions[idx]->closed)
+        Close(worker, poller, sessions, idx);
+
+    uint64_t busyNs = NowNs() - busyStart;
+    worker->busyNs += busyNs;
+    Metrics::Add(MetricEmulationNs, busyNs);
+  }
+
+  while (!sessions.empty())
+    Close(worker, poller, sessions, sessions.size() - 1);
+}
+
+void SessionServer::RunFrame(Worker *worker, Session *session, std::vector<uint8_t> &scratch)
+{
+  if (!session->running)
+    return;
+
+  Emulator &emu = session->emu;
+  Metrics::Add(MetricInstructions, emu.DoFrame());
+  session->frame++;
+
+  if (emu.ErrorOccured()) {
+    *AppendMessage(session->out, MsgError, 1) = static_cast<uint8_t>(emu.GetErrorType());
+    session->running = false;
+    return;
+  }
+
+  // the client is behind: keep the last frame it got, so the next delta
+  // covers the skipped frames
+  if (session->out.size() - session->outPos > maxPending || !emu.ScreenIsInvalidated(false))
+    return;
+  emu.ScreenIsInvalidated(true);
+
+  uint8_t cur[frameSize];
+  size_t width = emu.SCR.Width(), height = emu.SCR.Height();
+  emu.SCR.Render(cur, width);
+  bool keyframe = session->keyframe || width != session->width || height != session->height;
+  if (keyframe) {
+    // new rom or resolution: the delta is against an empty screen
+    memset(session->screen, 0, sizeof(session->screen));
+    session->width = width;
+    session->height = height;
+  }
+  size_t size = width * height;
+  size_t len = EncodeDelta(session->screen, cur, size, &scratch[0]);
+  if (len == 0 && !keyframe)
+    return;                         // drawn, but the same as before
+  memcpy(session->screen, cur, size);
+  session->keyframe = false;
+
+  FrameMessage frame;
+  frame.frame = session->frame;
+  frame.width = static_cast<uint16_t>(width);
+  frame.height = static_cast<uint16_t>(height);
+  frame.stamp = NowNs();
+  frame.workNs = session->workNs;
+  frame.flags = keyframe ? FrameKeyframe : 0;
+  frame.load = session->loads;
+  session->workNs = 0;
+  uint8_t *payload = AppendMessage(session->out, MsgFrame, sizeof(frame) + len);
+  memcpy(payload, &frame, sizeof(frame));
+  memcpy(payload + sizeof(frame), &scratch[0], len);
+  worker->framesSent++;
+}
+
+bool SessionServer::Receive(Session *session)
+{
+  for (;;) {
+    size_t pos = session->in.size();
+    session->in.resize(pos + 4096);
+    int n = NetReceive(session->socket, &session->in[pos], 4096);
+    session->in.resize(pos + (n > 0 ? n : 0));
+    if (n < 0)
+      return false;
+    if (n == 0)
+      break;
+  }
+
+  size_t pos = 0;
+  MessageHeader header;
+  const uint8_t *payload;
+  while (NextMessage(session->in, pos, header, payload)) {
+    switch (header.type) {
+    case MsgLoad:
+      if (header.size < 2 || payload[0] > Emulator::XOCHIP)
+        return false;
+      session->emu.Init(static_cast<Emulator::ChipMode>(payload[0]));
+      session->emu.storeProgram(const_cast<uint8_t *>(payload + 1), header.size - 1);
+      session->running = true;
+      session->frame = 0;
+      session->width = 0;
+      session->height = 0;
+      // frames of the old rom may still be on their way, the client
+      // cannot clear its screen until the first frame of the new one
+      session->keyframe = true;
+      session->loads++;
+      break;
+    case MsgKey:
+      if (header.size < 2)
+        return false;
+      session->emu.SetKey(payload[0] & 0xF, payload[1] != 0);
+      break;
+    default:
+      return false;
+    }
+  }
+  if (session->in.size() - pos >= sizeof(header)) {
+    memcpy(&header, &session->in[pos], sizeof(header));
+    if (header.size > maxMessageSize)
+      return false;
+  }
+  session->in.erase(session->in.begin(), session->in.begin() + pos);
+  return true;
+}
+
+bool SessionServer::Flush(Worker *worker, Poller &poller, Session *session)
+{
+  while (session->outPos < session->out.size()) {
+    int n = NetSend(session->socket, &session->out[session->outPos], session->out.size() - session->outPos);
+    if (n < 0)
+      return false;
+    if (n == 0)
+      break;
+    session->outPos += n;
+    worker->bytesSent += n;
+  }
+
+  bool pending = session->outPos < session->out.size();
+  if (!pending) {
+    session->out.clear();
+    session->outPos = 0;
+  }
+  if (pending != session->wantWrite) {
+    session->wantWrite = pending;
+    poller.SetWrite(session->socket, session, pending);
+  }
+  return true;
+}
+
+void SessionServer::Close(Worker *worker, Poller &poller, std::vector<Session *> &sessions, size_t idx)
+{
+  Session *session = sessions[idx];
+  poller.Remove(session->socket);
+  NetClose(session->socket);
+  delete session;
+  sessions[idx] = sessions.back();
+  sessions.pop_back();
+  worker->sessions--;
+}
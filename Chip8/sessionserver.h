@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+#include "netsession.h"
+
+///////////////////////////////////////////////////////////////////////////
+//
+// SessionServer. Runs many emulator sessions in one process. Every client
+// connection is a session; sessions are spread over a small pool of worker
+// threads, and a worker runs all frames and socket i/o of its sessions, so
+// sessions never move between threads and need no locking.
+//
+// Workers run their sessions in lock step at 60 frames per second. A frame
+// is only sent when the screen changed, as a delta to the last frame sent
+// to that client. A client that does not keep up skips frames.
+
+class SessionServer
+{
+public:
+  SessionServer(int nrWorkers);
+  ~SessionServer();
+
+  bool Listen(uint16_t port);
+  void Run(double seconds, FILE *stats);      // accepts clients, prints stats every second. seconds <= 0 runs forever.
+  void Stop() { stopping = true; }
+
+private:
+  struct Session;
+
+  struct Worker {
+    std::thread thread;
+    std::mutex lock;
+    std::vector<SocketHandle> incoming;       // accepted sockets, not yet picked up by the worker
+
+    // statistics, written by the worker
+    std::atomic<int> sessions;
+    std::atomic<uint64_t> frames;
+    std::atomic<uint64_t> framesSent;
+    std::atomic<uint64_t> bytesSent;
+    std::atomic<uint64_t> busyNs;
+    std::atomic<uint64_t> missed;             // frame deadlines missed by more than a frame
+  };
+
+  std::vector<Worker *> workers;
+  SocketHandle listener;
+  std::atomic<bool> stopping;
+  std::atomic<uint32_t> nextSession;
+
+  void WorkerLoop(Worker *worker);
+  void RunFrame(Worker *worker, Session *session, std::vector<uint8_t> &scratch);
+  bool Receive(Session *session);
+  bool Flush(Worker *worker, Poller &poller, Session *session);
+  void Close(Worker *worker, Poller &poller, std::vector<Session *> &sessions, size_t idx);
+};
@@ -0,0 +1,75 @@
+#include "sharedpage.h"
+
+#include <string.h>
+
+// freed pages are kept per thread and reused, so forking and writing in a
+// search loop does not go to the heap for every page.
+static const int maxFreePages = 4096;
+
+struct FreeList {
+  SharedPage *head;
+  int count;
+  FreeList() : head(NULL), count(0) {}
+  ~FreeList();
+};
+
+static thread_local FreeList freeList;
+static std::atomic<int64_t> inUse(0);
+
+// static storage is zero initialized
+SharedPage SharedPage::zeroPage;
+
+SharedPage *SharedPage::Alloc()
+{
+  SharedPage *page = freeList.head;
+  if (page != NULL) {
+    freeList.head = page->nextFree;
+    freeList.count--;
+  }
+  else {
+    page = new SharedPage;
+  }
+  page->refs.store(1, std::memory_order_relaxed);
+  inUse.fetch_add(1, std::memory_order_relaxed);
+  return page;
+}
+
+void SharedPage::Release()
+{
+  if (this == Zero())
+    return;
+  if (refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+    return;
+  inUse.fetch_sub(1, std::memory_order_relaxed);
+
+  if (freeList.count < maxFreePages) {
+    nextFree = freeList.head;
+    freeList.head = this;
+    freeList.count++;
+  }
+  else {
+    delete this;
+  }
+}
+
+SharedPage *SharedPage::Copy(SharedPage *page)
+{
+  SharedPage *copy = Alloc();
+  memcpy(copy->bytes, page->bytes, size);
+  page->Release();
+  return copy;
+}
+
+int64_t SharedPage::InUse()
+{
+  return inUse.load(std::memory_order_relaxed);
+}
+
+FreeList::~FreeList()
+{
+  while (head != NULL) {
+    SharedPage *next = head->nextFree;
+    delete head;
+    head = next;
+  }
+}
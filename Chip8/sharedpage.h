@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// a 1k block of emulator memory or screen, shared between forked emulators.
+// a shared page is copied when it is written (copy-on-write). the all-zero
+// page is a static page that is never counted or freed.
+class SharedPage
+{
+public:
+  static const size_t size = 1024;
+  static const int shift = 10;
+
+  union {
+    uint8_t bytes[size];
+    uint64_t words[size / 8];
+  };
+
+  static SharedPage *Zero() { return &zeroPage; }
+  static SharedPage *Alloc();       // new page with one reference, contents undefined
+  static int64_t InUse();           // pages currently referenced, for statistics
+
+  SharedPage *AddRef()
+  {
+    if (this != Zero())
+      refs.fetch_add(1, std::memory_order_relaxed);
+    return this;
+  }
+  void Release();
+
+  // returns a page that may be written: the page itself if it is not
+  // shared, otherwise a private copy. the reference to page moves to the
+  // returned page.
+  static SharedPage *MakeWritable(SharedPage *page)
+  {
+    if (page != Zero() && page->refs.load(std::memory_order_acquire) == 1)
+      return page;
+    return Copy(page);
+  }
+
+private:
+  std::atomic<int> refs;
+  SharedPage *nextFree;             // link in the free list of a thread
+
+  static SharedPage zeroPage;
+  static SharedPage *Copy(SharedPage *page);
+  friend struct FreeList;
+};
@@ -0,0 +1,254 @@
+#include "stateexport.h"
+
+#include <string.h>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "Emulator.h"
+
+///////////////////////////////////////////////////////////////////////////
+//
+// SharedSegment class
+
+SharedSegment::SharedSegment()
+: address(NULL), size(0), handle(NULL)
+{
+}
+
+SharedSegment::~SharedSegment()
+{
+  Close();
+}
+
+#ifdef _WIN32
+
+bool SharedSegment::Create(const std::string &name, size_t sz)
+{
+  Close();
+  std::string fullName = "Local\\" + name;
+  HANDLE map = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+    0, static_cast<DWORD>(sz), fullName.c_str());
+  if (map == NULL)
+    return false;
+  address = MapViewOfFile(map, FILE_MAP_ALL_ACCESS, 0, 0, sz);
+  if (address == NULL) {
+    CloseHandle(map);
+    return false;
+  }
+  handle = map;
+  size = sz;
+  return true;
+}
+
+bool SharedSegment::Open(const std::string &name, size_t sz)
+{
+  Close();
+  std::string fullName = "Local\\" + name;
+  HANDLE map = OpenFileMappingA(FILE_MAP_READ, FALSE, fullName.c_str());
+  if (map == NULL)
+    return false;
+  address = MapViewOfFile(map, FILE_MAP_READ, 0, 0, sz);
+  if (address == NULL) {
+    CloseHandle(map);
+    return false;
+  }
+  handle = map;
+  size = sz;
+  return true;
+}
+
+void SharedSegment::Close()
+{
+  if (address != NULL)
+    UnmapViewOfFile(address);
+  if (handle != NULL)
+    CloseHandle(static_cast<HANDLE>(handle));
+  address = NULL;
+  handle = NULL;
+  size = 0;
+}
+
+#else
+
+bool SharedSegment::Create(const std::string &name, size_t sz)
+{
+  Close();
+  std::string fullName = "/" + name;
+  int fd = shm_open(fullName.c_str(), O_CREAT | O_RDWR, 0644);
+  if (fd < 0)
+    return false;
+  void *addr = MAP_FAILED;
+  if (ftruncate(fd, sz) == 0)
+    addr = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return false;
+  address = addr;
+  size = sz;
+  unlinkName = fullName;
+  return true;
+}
+
+bool SharedSegment::Open(const std::string &name, size_t sz)
+{
+  Close();
+  std::string fullName = "/" + name;
+  int fd = shm_open(fullName.c_str(), O_RDONLY, 0);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  void *addr = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sz)
+    addr = mmap(NULL, sz, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return false;
+  address = addr;
+  size = sz;
+  return true;
+}
+
+void SharedSegment::Close()
+{
+  if (address != NULL)
+    munmap(address, size);
+  if (!unlinkName.empty())
+    shm_unlink(unlinkName.c_str());
+  address = NULL;
+  size = 0;
+  unlinkName.clear();
+}
+
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////
+//
+// StateExporter class
+
+const char *StateExporter::defaultName = "chip8-state";
+
+StateExporter::StateExporter()
+: state(NULL), frame(0)
+{
+}
+
+bool StateExporter::Start(const std::string &name)
+{
+  Stop();
+  if (!segment.Create(name, sizeof(SharedState)))
+    return false;
+  state = static_cast<SharedState *>(segment.Address());
+
+  // readers check the header, so it is written last
+  state->sequence.store(0, std::memory_order_relaxed);
+  memset(&state->data, 0, sizeof(state->data));
+  state->size = sizeof(SharedState);
+  state->version = sharedStateVersion;
+  std::atomic_thread_fence(std::memory_order_release);
+  state->magic = sharedStateMagic;
+  frame = 0;
+  return true;
+}
+
+void StateExporter::Stop()
+{
+  segment.Close();
+  state = NULL;
+}
+
+void StateExporter::Publish(const Emulator &emu)
+{
+  if (state == NULL)
+    return;
+
+  uint32_t sequence = state->sequence.load(std::memory_order_relaxed);
+  state->sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  SharedStateData &data = state->data;
+  data.frame = ++frame;
+  data.mode = static_cast<uint8_t>(emu.mode);
+  data.sp = static_cast<uint8_t>(emu.GetSP());
+  data.dt = static_cast<uint8_t>(emu.GetDT());
+  data.st = static_cast<uint8_t>(emu.GetST());
+  data.i = emu.GetI();
+  data.pc = emu.GetPC();
+  data.keys = emu.GetKeys();
+  data.width = static_cast<uint16_t>(emu.SCR.Width());
+  data.height = static_cast<uint16_t>(emu.SCR.Height());
+  for (int idx = 0; idx < 16; idx++) {
+    data.v[idx] = emu.GetV(idx);
+    data.stack[idx] = emu.GetStack(idx);
+  }
+  // megachip memory is exported up to 64k
+  size_t memorySize = emu.MemorySize() < sizeof(data.memory) ? emu.MemorySize() : sizeof(data.memory);
+  data.memorySize = static_cast<uint32_t>(memorySize);
+  emu.SCR.Render(data.screen, emu.SCR.Width());
+  emu.CopyMemory(data.memory, 0, memorySize);
+
+  state->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+//
+// StateReader class
+
+StateReader::StateReader()
+: state(NULL)
+{
+}
+
+bool StateReader::Open(const std::string &name)
+{
+  Close();
+  if (!segment.Open(name, sizeof(SharedState)))
+    return false;
+  const SharedState *s = static_cast<const SharedState *>(segment.Address());
+  if (s->magic != sharedStateMagic || s->version != sharedStateVersion || s->size != sizeof(SharedState)) {
+    segment.Close();
+    return false;
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  state = s;
+  return true;
+}
+
+void StateReader::Close()
+{
+  segment.Close();
+  state = NULL;
+}
+
+bool StateReader::Read(SharedStateData &snapshot) const
+{
+  if (state == NULL)
+    return false;
+  for (int tries = 0; tries < 1000; tries++) {
+    uint32_t before = state->sequence.load(std::memory_order_acquire);
+    if (before & 1) {
+      std::this_thread::yield();    // the writer is busy, it never takes long
+      continue;
+    }
+    memcpy(&snapshot, &state->data, sizeof(snapshot));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (state->sequence.load(std::memory_order_relaxed) == before)
+      return true;
+  }
+  return false;
+}
+
+uint64_t StateReader::Frame() const
+{
+  // every publish adds 2 to the sequence
+  return state != NULL ? state->sequence.load(std::memory_order_acquire) / 2 : 0;
+}
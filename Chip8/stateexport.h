@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <string>
+
+class Emulator;
+
+///////////////////////////////////////////////////////////////////////////
+//
+// live state export. the emulator thread publishes the machine state into
+// a named shared memory segment once per frame, readers in other processes
+// map it and take snapshots.
+//
+// the segment is guarded by a seqlock: the writer makes the sequence odd,
+// writes, and makes it even again, without ever waiting. a reader copies
+// the state and retries if the sequence was odd or changed meanwhile. so
+// readers cost the emulator nothing, and need no system calls after
+// mapping the segment.
+
+static const uint32_t sharedStateMagic = 0x53543843;     // 'C8TS'
+static const uint32_t sharedStateVersion = 2;      // 2: I of 32 bits, for megachip
+
+struct SharedStateData
+{
+  uint64_t frame;                   // frames published since the exporter started
+  uint8_t mode;                     // Emulator::ChipMode
+  uint8_t sp;
+  uint8_t dt;
+  uint8_t st;
+  uint32_t i;                       // 24 bits in megachip mode
+  uint16_t pc;
+  uint16_t keys;
+  uint16_t width;                   // screen size
+  uint16_t height;
+  uint8_t v[16];
+  uint16_t stack[16];
+  uint32_t memorySize;              // 4096, or 65536 for xo-chip and megachip
+  uint8_t screen[128 * 64];         // one palette index per pixel, width x height
+  uint8_t memory[65536];
+};
+
+struct SharedState
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size;                    // sizeof(SharedState) of the writer
+  std::atomic<uint32_t> sequence;   // odd while the writer is busy
+  SharedStateData data;
+};
+
+// platform part: a named shared memory segment of a fixed size
+class SharedSegment
+{
+public:
+  SharedSegment();
+  ~SharedSegment();
+  bool Create(const std::string &name, size_t size);       // for the writer
+  bool Open(const std::string &name, size_t size);         // for readers, read only
+  void Close();
+  void *Address() const { return address; }
+
+private:
+  void *address;
+  size_t size;
+  void *handle;
+  std::string unlinkName;           // posix: removed by the writer on close
+
+  SharedSegment(const SharedSegment &);
+  SharedSegment &operator=(const SharedSegment &);
+};
+
+///////////////////////////////////////////////////////////////////////////
+//
+// StateExporter. Writer side, called by the emulator thread.
+
+class StateExporter
+{
+public:
+  static const char *defaultName;
+
+  StateExporter();
+  bool Start(const std::string &name);
+  void Stop();
+  bool IsStarted() const { return state != NULL; }
+  void Publish(const Emulator &emu);
+
+private:
+  SharedSegment segment;
+  SharedState *state;
+  uint64_t frame;
+};
+
+///////////////////////////////////////////////////////////////////////////
+//
+// StateReader. Reader side, for external tools.
+
+class StateReader
+{
+public:
+  StateReader();
+  bool Open(const std::string &name);
+  void Close();
+  bool IsOpen() const { return state != NULL; }
+
+  // copies a consistent snapshot. fails if the writer kept changing the
+  // state for too many tries, which only happens if the reader is very slow.
+  bool Read(SharedStateData &snapshot) const;
+
+  // reads only the frame counter, to see if there is something new
+  uint64_t Frame() const;
+
+private:
+  SharedSegment segment;
+  const SharedState *state;
+};
@@ -0,0 +1,305 @@
+#include "terminal.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <conio.h>
+#ifndef ENABLE_VIRTUAL_TERMINAL_PROCESSING
+#define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+#endif
+#else
+#include <termios.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+// sgr colour codes of the palette: black, white, light and dark grey, as
+// in the window
+static const int foregroundCodes[4] = { 30, 97, 37, 90 };
+static const int backgroundCodes[4] = { 40, 107, 47, 100 };
+
+static void AppendUtf8(uint32_t code, std::string &out)
+{
+  // only the three byte range is used: block elements and braille
+  out += static_cast<char>(0xE0 | (code >> 12));
+  out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+  out += static_cast<char>(0x80 | (code & 0x3F));
+}
+
+static void AppendNumber(int value, std::string &out)
+{
+  // escape sequences are most of the output, snprintf would be most of the time
+  char digits[12];
+  int len = 0;
+  do {
+    digits[len++] = static_cast<char>('0' + value % 10);
+    value /= 10;
+  } while (value > 0);
+  while (len > 0)
+    out += digits[--len];
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// TerminalRenderer class
+
+TerminalRenderer::TerminalRenderer(Mode mode, int top)
+: mode(mode), top(top), columns(0), rows(0), valid(false)
+{
+  ForgetCursor();
+}
+
+void TerminalRenderer::SetMode(Mode m)
+{
+  mode = m;
+  valid = false;
+}
+
+void TerminalRenderer::Invalidate()
+{
+  valid = false;
+  ForgetCursor();
+}
+
+void TerminalRenderer::ForgetCursor()
+{
+  foreground = background = -1;
+  cursorRow = cursorColumn = -1;
+}
+
+void TerminalRenderer::MoveTo(int row, int column, std::string &out)
+{
+  if (row == cursorRow && column == cursorColumn)
+    return;
+  out += "\x1b[";
+  if (row == cursorRow && cursorColumn >= 0 && column > cursorColumn) {
+    // forward on the same line is shorter than an absolute position
+    if (column > cursorColumn + 1)
+      AppendNumber(column - cursorColumn, out);
+    out += 'C';
+  }
+  else {
+    AppendNumber(top + row, out);
+    out += ';';
+    AppendNumber(column + 1, out);
+    out += 'H';
+  }
+  cursorRow = row;
+  cursorColumn = column;
+}
+
+void TerminalRenderer::SetColours(int fg, int bg, std::string &out)
+{
+  // a negative colour keeps the current one
+  bool setFg = fg >= 0 && fg != foreground;
+  bool setBg = bg >= 0 && bg != background;
+  if (!setFg && !setBg)
+    return;
+  out += "\x1b[";
+  if (setFg)
+    AppendNumber(foregroundCodes[fg], out);
+  if (setFg && setBg)
+    out += ';';
+  if (setBg)
+    AppendNumber(backgroundCodes[bg], out);
+  out += 'm';
+  if (setFg)
+    foreground = fg;
+  if (setBg)
+    background = bg;
+}
+
+void TerminalRenderer::DrawCell(uint8_t cell, std::string &out)
+{
+  if (mode == Braille) {
+    SetColours(1, 0, out);
+    if (cell == 0)
+      out += ' ';
+    else
+      AppendUtf8(0x2800 + cell, out);
+    return;
+  }
+
+  // of the ways to draw a cell, the one that changes the fewest colours
+  int upper = cell & 3, lower = cell >> 2;
+  if (upper == lower) {
+    if (background == upper)
+      out += ' ';
+    else if (foreground == upper)
+      AppendUtf8(0x2588, out);        // full block
+    else {
+      SetColours(-1, upper, out);
+      out += ' ';
+    }
+  }
+  else if ((foreground != upper) + (background != lower) <= (foreground != lower) + (background != upper)) {
+    SetColours(upper, lower, out);
+    AppendUtf8(0x2580, out);          // upper half block
+  }
+  else {
+    SetColours(lower, upper, out);
+    AppendUtf8(0x2584, out);          // lower half block
+  }
+}
+
+size_t TerminalRenderer::Render(const uint8_t *frame, size_t width, size_t height, std::string &out)
+{
+  size_t start = out.size();
+  size_t newColumns = mode == Braille ? width / 2 : width;
+  size_t newRows = mode == Braille ? height / 4 : height / 2;
+  if (newColumns * newRows > maxCells)
+    return 0;
+  if (newColumns != columns || newRows != rows) {
+    // the old frame may be larger, clear it with the default colours
+    out += "\x1b[";
+    AppendNumber(top, out);
+    out += ";1H\x1b[0m\x1b[J";
+    ForgetCursor();
+    columns = newColumns;
+    rows = newRows;
+    valid = false;
+  }
+
+  for (size_t row = 0; row < rows; row++) {
+    for (size_t column = 0; column < columns; column++) {
+      uint8_t cell;
+      if (mode == Braille) {
+        // dots 1-3 and 7 down the left column, 4-6 and 8 down the right
+        static const uint8_t dots[4][2] = { { 0x01, 0x08 }, { 0x02, 0x10 }, { 0x04, 0x20 }, { 0x40, 0x80 } };
+        const uint8_t *px = frame + 4 * row * width + 2 * column;
+        cell = 0;
+        for (int dy = 0; dy < 4; dy++, px += width) {
+          if (px[0] != 0)
+            cell |= dots[dy][0];
+          if (px[1] != 0)
+            cell |= dots[dy][1];
+        }
+      }
+      else {
+        const uint8_t *px = frame + 2 * row * width + column;
+        cell = static_cast<uint8_t>((px[0] & 3) | ((px[width] & 3) << 2));
+      }
+
+      uint8_t &shown = cells[row * columns + column];
+      if (valid && shown == cell)
+        continue;
+      MoveTo(static_cast<int>(row), static_cast<int>(column), out);
+      DrawCell(cell, out);
+      cursorColumn++;
+      shown = cell;
+    }
+  }
+  valid = true;
+  return out.size() - start;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+//
+// Terminal class
+
+Terminal::Terminal()
+: open(false), raw(false)
+{
+#ifdef _WIN32
+  savedMode = 0;
+  savedCodePage = 0;
+#else
+  saved = new termios;
+#endif
+}
+
+Terminal::~Terminal()
+{
+  Close();
+#ifndef _WIN32
+  delete saved;
+#endif
+}
+
+bool Terminal::Open()
+{
+  if (open)
+    return raw;
+#ifdef _WIN32
+  // escape sequences and utf-8 need switching on in the windows console.
+  // conio reads the console keyboard without echo.
+  HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
+  DWORD mode;
+  if (GetConsoleMode(out, &mode)) {
+    savedMode = mode;
+    SetConsoleMode(out, mode | ENABLE_PROCESSED_OUTPUT | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+    raw = true;
+  }
+  savedCodePage = GetConsoleOutputCP();
+  SetConsoleOutputCP(CP_UTF8);
+  setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+#else
+  if (isatty(STDIN_FILENO) && tcgetattr(STDIN_FILENO, saved) == 0) {
+    // no line buffering, echo or signals: ctrl-c arrives as a key. reads
+    // return at once, with or without a byte.
+    termios mode = *saved;
+    mode.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    mode.c_iflag &= ~(IXON | ICRNL);
+    mode.c_cc[VMIN] = 0;
+    mode.c_cc[VTIME] = 0;
+    raw = tcsetattr(STDIN_FILENO, TCSANOW, &mode) == 0;
+  }
+#endif
+  open = true;
+  Write("\x1b[?25l\x1b[2J");
+  return raw;
+}
+
+void Terminal::Close()
+{
+  if (!open)
+    return;
+  Write("\x1b[0m\x1b[?25h");
+#ifdef _WIN32
+  if (raw)
+    SetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), savedMode);
+  SetConsoleOutputCP(savedCodePage);
+#else
+  if (raw)
+    tcsetattr(STDIN_FILENO, TCSANOW, saved);
+#endif
+  open = false;
+  raw = false;
+}
+
+int Terminal::ReadKey()
+{
+  if (!raw)
+    return -1;
+#ifdef _WIN32
+  return _kbhit() ? _getch() : -1;
+#else
+  unsigned char key;
+  return read(STDIN_FILENO, &key, 1) == 1 ? key : -1;
+#endif
+}
+
+bool Terminal::Write(const std::string &data)
+{
+#ifdef _WIN32
+  // stdout is fully buffered with room for a frame, the flush is the write
+  bool ok = fwrite(data.data(), 1, data.size(), stdout) == data.size();
+  return fflush(stdout) == 0 && ok;
+#else
+  const char *pos = data.data();
+  size_t left = data.size();
+  while (left > 0) {
+    ssize_t written = write(STDOUT_FILENO, pos, left);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return false;
+    pos += written;
+    left -= written;
+  }
+  return true;
+#endif
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+struct termios;
+
+///////////////////////////////////////////////////////////////////////////
+//
+// TerminalRenderer. Draws rendered frames (palette indices, as
+// Screen::Render writes them) on an ANSI terminal, for running over ssh
+// without the window. A character cell shows 1x2 pixels as a half block in
+// the colours of both, or 2x4 pixels as a braille pattern, lit or not, so
+// the super chip screen fits in 64x16 cells.
+//
+// The renderer remembers what the terminal shows and only writes the cells
+// that changed, with as few cursor moves and colour changes as it can. A
+// frame that changes nothing writes nothing.
+
+class TerminalRenderer
+{
+public:
+  enum Mode {
+    HalfBlock,                      // 1x2 pixels per cell, four colours
+    Braille                         // 2x4 pixels per cell, lit or dark
+  };
+
+  static const size_t maxCells = 128 * 32;
+
+  TerminalRenderer(Mode mode = HalfBlock, int top = 1);
+
+  void SetMode(Mode mode);          // redraws everything with the next frame
+  Mode GetMode() const { return mode; }
+  void Invalidate();                // the terminal was cleared: redraw everything
+  void ForgetCursor();              // something else was written: cursor and colours are unknown
+
+  // appends the escape sequences that change the terminal from the last
+  // frame to this one, and returns their size. a frame of another size
+  // than the last clears the screen below the top line first.
+  size_t Render(const uint8_t *frame, size_t width, size_t height, std::string &out);
+
+  int Columns() const { return static_cast<int>(columns); }   // cells of the last frame
+  int Rows() const { return static_cast<int>(rows); }
+
+private:
+  Mode mode;
+  int top;                          // terminal line of the first row, from 1
+  size_t columns;
+  size_t rows;
+  bool valid;                       // cells is what the terminal shows
+  uint8_t cells[maxCells];          // half block: top | bottom << 2, braille: the dot pattern
+  int foreground;                   // palette index of the current colours, -1 if unknown
+  int background;
+  int cursorRow;                    // cell of the cursor, -1 if unknown
+  int cursorColumn;
+
+  void MoveTo(int row, int column, std::string &out);
+  void SetColours(int fg, int bg, std::string &out);
+  void DrawCell(uint8_t cell, std::string &out);
+};
+
+///////////////////////////////////////////////////////////////////////////
+//
+// Terminal. The console of the process, with the keyboard in raw mode:
+// keys arrive one byte at a time, without waiting and without echo, and
+// every Write is a single write to the terminal.
+
+class Terminal
+{
+public:
+  Terminal();
+  ~Terminal();                      // restores the terminal
+
+  // raw mode, hidden cursor and a cleared screen. returns false if input
+  // is not a terminal; output still works then.
+  bool Open();
+  void Close();
+  int ReadKey();                    // next input byte, or -1 if there is none
+  bool Write(const std::string &data);
+
+private:
+  bool open;
+  bool raw;
+#ifdef _WIN32
+  unsigned long savedMode;          // console output mode
+  unsigned int savedCodePage;
+#else
+  termios *saved;
+#endif
+
+  Terminal(const Terminal &);
+  Terminal &operator=(const Terminal &);
+};
@@ -0,0 +1,246 @@
+#include "timeline.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <mutex>
+
+// the writer side. only the writer thread, Flush and Stop touch these,
+// under writerLock.
+static std::mutex writerLock;
+static std::thread writer;
+static std::atomic<bool> stopping(false);
+static FILE *out = NULL;
+static bool firstEvent = true;
+static uint64_t startTicks = 0;
+static double ticksPerMicrosecond = 1000.0;
+static std::atomic<uint64_t> written(0);
+static std::atomic<uint64_t> lost(0);
+static std::atomic<int> nextTid(1);
+
+static uint64_t ClockNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void WriteString(const char *text)
+{
+  // names are literals of the source, but keep the json valid whatever they are
+  fputc('"', out);
+  for (const char *pos = text; *pos != 0; pos++) {
+    if (*pos == '"' || *pos == '\\')
+      fputc('\\', out);
+    if (static_cast<unsigned char>(*pos) >= ' ')
+      fputc(*pos, out);
+  }
+  fputc('"', out);
+}
+
+static void BeginEvent()
+{
+  fputs(firstEvent ? "\n" : ",\n", out);
+  firstEvent = false;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// Timeline class
+
+std::atomic<bool> Timeline::recording(false);
+thread_local Timeline::BufferOwner Timeline::owner;
+std::atomic<Timeline::Buffer *> Timeline::buffers(NULL);
+
+Timeline::BufferOwner::~BufferOwner()
+{
+  // the events stay for the writer, the next thread continues in this ring
+  if (buffer != NULL)
+    buffer->inUse.store(false, std::memory_order_release);
+}
+
+Timeline::Buffer *Timeline::AttachBuffer()
+{
+  // reuse the ring of a thread that ended, or add a new one. rings are
+  // never freed, so the writer can walk the list without locking.
+  for (Buffer *buffer = buffers.load(std::memory_order_acquire); buffer != NULL; buffer = buffer->next) {
+    bool expected = false;
+    if (!buffer->inUse.load(std::memory_order_relaxed) &&
+        buffer->inUse.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+      buffer->name.store(NULL, std::memory_order_relaxed);
+      owner.buffer = buffer;
+      return buffer;
+    }
+  }
+
+  Buffer *buffer = new Buffer;
+  buffer->head.store(0, std::memory_order_relaxed);
+  buffer->tail = 0;
+  buffer->tid = nextTid.fetch_add(1, std::memory_order_relaxed);
+  buffer->name.store(NULL, std::memory_order_relaxed);
+  buffer->writtenName = NULL;
+  buffer->inUse.store(true, std::memory_order_relaxed);
+  buffer->next = buffers.load(std::memory_order_relaxed);
+  while (!buffers.compare_exchange_weak(buffer->next, buffer, std::memory_order_release))
+    ;
+  owner.buffer = buffer;
+  return buffer;
+}
+
+void Timeline::SetThreadName(const char *name)
+{
+  // the ring is attached even when not recording, so the name is there
+  // when recording starts
+  Buffer *buffer = owner.buffer;
+  if (buffer == NULL)
+    buffer = AttachBuffer();
+  buffer->name.store(name, std::memory_order_release);
+}
+
+bool Timeline::Start(const std::string &file)
+{
+  std::lock_guard<std::mutex> guard(writerLock);
+  if (out != NULL)
+    return false;
+  out = fopen(file.c_str(), "wb");
+  if (out == NULL)
+    return false;
+  fputs("[", out);
+  firstEvent = true;
+
+#ifdef TIMELINE_TSC
+  // the rate of the time stamp counter, against the clock over 10 ms
+  uint64_t clock = ClockNs(), ticks = Ticks();
+  uint64_t now;
+  while ((now = ClockNs()) - clock < 10000000)
+    ;
+  ticksPerMicrosecond = (Ticks() - ticks) * 1000.0 / (now - clock);
+#else
+  ticksPerMicrosecond = 1000.0;
+#endif
+
+  // what was recorded before is not part of this file
+  for (Buffer *buffer = buffers.load(std::memory_order_acquire); buffer != NULL; buffer = buffer->next) {
+    buffer->tail = buffer->head.load(std::memory_order_acquire);
+    buffer->writtenName = NULL;
+  }
+  written.store(0, std::memory_order_relaxed);
+  lost.store(0, std::memory_order_relaxed);
+  startTicks = Ticks();
+  stopping = false;
+  recording.store(true, std::memory_order_release);
+  writer = std::thread(&Timeline::Run);
+  return true;
+}
+
+bool Timeline::StartFromEnvironment()
+{
+#ifdef CHIP8_TIMELINE
+  const char *file = getenv("CHIP8_TIMELINE");
+  if (file == NULL || *file == 0)
+    return false;
+  return Start(file);
+#else
+  return false;
+#endif
+}
+
+void Timeline::Stop()
+{
+  recording.store(false, std::memory_order_release);
+  stopping = true;
+  if (writer.joinable())
+    writer.join();
+
+  std::lock_guard<std::mutex> guard(writerLock);
+  if (out == NULL)
+    return;
+  for (Buffer *buffer = buffers.load(std::memory_order_acquire); buffer != NULL; buffer = buffer->next)
+    Drain(buffer);
+  fputs("\n]\n", out);
+  fclose(out);
+  out = NULL;
+}
+
+void Timeline::Flush()
+{
+  std::lock_guard<std::mutex> guard(writerLock);
+  if (out == NULL)
+    return;
+  for (Buffer *buffer = buffers.load(std::memory_order_acquire); buffer != NULL; buffer = buffer->next)
+    Drain(buffer);
+  fflush(out);
+}
+
+uint64_t Timeline::Written()
+{
+  return written.load(std::memory_order_relaxed);
+}
+
+uint64_t Timeline::Lost()
+{
+  return lost.load(std::memory_order_relaxed);
+}
+
+void Timeline::Drain(Buffer *buffer)
+{
+  const char *name = buffer->name.load(std::memory_order_acquire);
+  if (name != NULL && name != buffer->writtenName) {
+    BeginEvent();
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", buffer->tid);
+    WriteString(name);
+    fputs("}}", out);
+    buffer->writtenName = name;
+  }
+
+  // the owner may lap the writer. what it overwrote before the copy, or
+  // while copying, is counted as lost rather than written half new.
+  uint32_t head = buffer->head.load(std::memory_order_acquire);
+  uint32_t tail = buffer->tail;
+  if (head - tail > Buffer::size) {
+    lost.fetch_add(head - tail - Buffer::size, std::memory_order_relaxed);
+    tail = head - Buffer::size;
+  }
+  uint32_t count = head - tail;
+  if (count == 0)
+    return;
+  static Event copy[Buffer::size];
+  for (uint32_t idx = 0; idx < count; idx++)
+    copy[idx] = buffer->events[(tail + idx) % Buffer::size];
+  std::atomic_thread_fence(std::memory_order_acquire);
+  uint32_t newHead = buffer->head.load(std::memory_order_relaxed);
+  uint32_t first = 0;
+  if (newHead - tail > Buffer::size) {
+    first = newHead - tail - Buffer::size;
+    if (first > count)
+      first = count;
+    lost.fetch_add(first, std::memory_order_relaxed);
+  }
+  buffer->tail = head;
+
+  for (uint32_t idx = first; idx < count; idx++) {
+    const Event &event = copy[idx];
+    double ts = event.ticks > startTicks ? (event.ticks - startTicks) / ticksPerMicrosecond : 0.0;
+    BeginEvent();
+    fputs("{\"name\":", out);
+    WriteString(event.name);
+    fprintf(out, ",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d", event.phase, ts, buffer->tid);
+    if (event.phase == 'i')
+      fputs(",\"s\":\"t\"", out);
+    if (event.hasValue)
+      fprintf(out, ",\"args\":{\"value\":%d}", event.value);
+    fputc('}', out);
+  }
+  written.fetch_add(count - first, std::memory_order_relaxed);
+}
+
+void Timeline::Run()
+{
+  int slices = 0;
+  while (!stopping) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    if (++slices < 10)
+      continue;
+    slices = 0;
+    Flush();
+  }
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <atomic>
+#include <chrono>
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define TIMELINE_TSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TIMELINE_TSC
+#endif
+
+///////////////////////////////////////////////////////////////////////////
+//
+// Timeline. Spans and instant events of the threads of the application,
+// written as chrome trace-event json, to be opened in perfetto or
+// chrome://tracing. It shows how frames on the emulator thread, waits for
+// the window, timer ticks, paints and key events interleave.
+//
+// Each thread records into a ring of its own, with a plain store and a
+// release of its head, never a lock or a shared cache line. A writer
+// thread drains the rings into the file every 100 ms. Names are string
+// literals; only the pointer is recorded.
+//
+// The TIMELINE_ macros are the instrumentation. They compile to nothing
+// unless CHIP8_TIMELINE is defined; then recording starts when
+// CHIP8_TIMELINE=file.json is set in the environment.
+
+#ifdef CHIP8_TIMELINE
+#define TIMELINE_JOIN2(a, b) a##b
+#define TIMELINE_JOIN(a, b) TIMELINE_JOIN2(a, b)
+#define TIMELINE_SPAN(name) TimelineSpan TIMELINE_JOIN(timelineSpan, __LINE__)(name)
+#define TIMELINE_BEGIN(name) Timeline::Begin(name)
+#define TIMELINE_END(name) Timeline::End(name)
+#define TIMELINE_INSTANT(name) Timeline::Instant(name)
+#define TIMELINE_VALUE(name, value) Timeline::Instant(name, value)
+#define TIMELINE_THREAD(name) Timeline::SetThreadName(name)
+#else
+#define TIMELINE_SPAN(name)
+#define TIMELINE_BEGIN(name)
+#define TIMELINE_END(name)
+#define TIMELINE_INSTANT(name)
+#define TIMELINE_VALUE(name, value)
+#define TIMELINE_THREAD(name)
+#endif
+
+class Timeline
+{
+public:
+  static bool Start(const std::string &file);
+  static void Stop();                       // writes what is left, and closes the file
+  static bool StartFromEnvironment();       // CHIP8_TIMELINE, if compiled in
+  static bool IsRecording() { return recording.load(std::memory_order_relaxed); }
+  static void Flush();                      // drains the rings now
+
+  static void Begin(const char *name) { if (IsRecording()) Record(name, 'B', 0, false); }
+  static void End(const char *name) { if (IsRecording()) Record(name, 'E', 0, false); }
+  static void Instant(const char *name) { if (IsRecording()) Record(name, 'i', 0, false); }
+  static void Instant(const char *name, int32_t value) { if (IsRecording()) Record(name, 'i', value, true); }
+  static void SetThreadName(const char *name);   // shown as the name of the track of this thread
+
+  static uint64_t Written();                // events in the file
+  static uint64_t Lost();                   // events overwritten before the writer came by
+
+private:
+  struct Event {
+    uint64_t ticks;
+    const char *name;
+    int32_t value;
+    char phase;                             // 'B', 'E' or 'i'
+    bool hasValue;
+  };
+
+  // one per thread, reused when its thread ends. never freed, so the
+  // writer walks the list without locking.
+  struct Buffer {
+    static const uint32_t size = 1 << 16;
+    Event events[size];
+    std::atomic<uint32_t> head;             // written by the owner
+    uint32_t tail;                          // written by the writer
+    int tid;
+    std::atomic<const char *> name;
+    const char *writtenName;                // the name in the file
+    std::atomic<bool> inUse;
+    Buffer *next;
+  };
+
+  struct BufferOwner {
+    Buffer *buffer;
+    BufferOwner() : buffer(NULL) {}
+    ~BufferOwner();
+  };
+
+  static std::atomic<bool> recording;
+  static thread_local BufferOwner owner;
+  static std::atomic<Buffer *> buffers;
+
+  // the time stamp counter where there is one: a few nanoseconds, where
+  // reading the clock takes twenty. the writer converts it to time.
+  static uint64_t Ticks()
+  {
+#ifdef TIMELINE_TSC
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+  }
+  static Buffer *AttachBuffer();
+  static void Record(const char *name, char phase, int32_t value, bool hasValue)
+  {
+    Buffer *buffer = owner.buffer;
+    if (buffer == NULL)
+      buffer = AttachBuffer();
+    uint32_t head = buffer->head.load(std::memory_order_relaxed);
+    Event &event = buffer->events[head % Buffer::size];
+    event.ticks = Ticks();
+    event.name = name;
+    event.value = value;
+    event.phase = phase;
+    event.hasValue = hasValue;
+    buffer->head.store(head + 1, std::memory_order_release);
+  }
+  static void Drain(Buffer *buffer);
+  static void Run();
+};
+
+// a span for the lifetime of the object, see TIMELINE_SPAN
+class TimelineSpan
+{
+public:
+  explicit TimelineSpan(const char *name)
+  : name(Timeline::IsRecording() ? name : NULL)
+  {
+    if (this->name != NULL)
+      Timeline::Begin(name);
+  }
+  ~TimelineSpan()
+  {
+    if (name != NULL)
+      Timeline::End(name);
+  }
+
+private:
+  const char *name;
+
+  TimelineSpan(const TimelineSpan &);
+  TimelineSpan &operator=(const TimelineSpan &);
+};
@@ -0,0 +1,1505 @@
+#include "tools.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "Emulator.h"
+#include "tracer.h"
+#include "sharedpage.h"
+#include "chip8env.h"
+#include "sessionserver.h"
+#include "sessionclient.h"
+#include "analysis.h"
+#include "metrics.h"
+#include "frameblend.h"
+#include "stateexport.h"
+#include "netplay.h"
+#include "quirks.h"
+#include "scheduler.h"
+#include "terminal.h"
+#include "blitter.h"
+#include "timeline.h"
+#include "runahead.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static double SecondsSince(Clock::time_point start)
+{
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+bool ReadRom(const char *fileName, std::vector<uint8_t> &rom)
+{
+  FILE *f = fopen(fileName, "rb");
+  if (f == NULL)
+    return false;
+  rom.clear();
+  uint8_t buf[4096];
+  size_t len;
+  while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+    rom.insert(rom.end(), buf, buf + len);
+  fclose(f);
+  return !rom.empty();
+}
+
+int RomMode(const char *fileName)
+{
+  // same extensions as the open dialog of the ui
+  size_t len = strlen(fileName);
+  if (len >= 4) {
+    const char *ext = fileName + len - 4;
+    if (_stricmp(ext, ".xo8") == 0)
+      return Emulator::XOCHIP;
+    if (_stricmp(ext, ".sc8") == 0)
+      return Emulator::SCHIP;
+    if (_stricmp(ext, ".mc8") == 0)
+      return Emulator::MEGACHIP;
+  }
+  return Emulator::CHIP8;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --trace rom output [instructions]
+// runs a rom headless and records an execution trace.
+
+static int ToolTrace(int argc, char *argv[])
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: --trace rom.ch8 out.c8t [instructions]\n");
+    return 2;
+  }
+  uint64_t instructions = argc > 2 ? strtoull(argv[2], NULL, 10) : 1000000;
+
+  std::vector<uint8_t> rom;
+  if (!ReadRom(argv[0], rom)) {
+    fprintf(stderr, "cannot read %s\n", argv[0]);
+    return 2;
+  }
+
+  Emulator emu;
+  emu.Init(static_cast<Emulator::ChipMode>(RomMode(argv[0])));
+  emu.storeProgram(&rom[0], rom.size());
+
+  TraceWriter trace;
+  if (!trace.Open(argv[1], emu.mode)) {
+    fprintf(stderr, "cannot write %s\n", argv[1]);
+    return 2;
+  }
+
+  Clock::time_point start = Clock::now();
+  emu.SetTracer(&trace);
+  for (uint64_t count = 0; count < instructions && !emu.ErrorOccured(); count++) {
+    emu.DoInstruction();
+    if (count % Emulator::instructionsPerFrame == 0)
+      emu.DecreaseTimers();
+  }
+  emu.SetTracer(NULL);
+  trace.Close();
+  double secs = SecondsSince(start);
+
+  printf("%llu instructions traced in %.3f s (%.1f MIPS)\n",
+    static_cast<unsigned long long>(trace.Count()), secs, trace.Count() / secs / 1e6);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --trace-diff a.c8t b.c8t [context]
+// reports the first instruction where two traces differ.
+
+static int ToolTraceDiff(int argc, char *argv[])
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: --trace-diff a.c8t b.c8t [context]\n");
+    return 2;
+  }
+  size_t context = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+  return TraceDiff(argv[0], argv[1], context, stdout);
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --bench-fork rom [forks]
+// measures forking, as used by tree search: forks into a set of live
+// branches, then runs every branch for a frame with its own input.
+
+static int ToolBenchFork(int argc, char *argv[])
+{
+  if (argc < 1) {
+    fprintf(stderr, "usage: --bench-fork rom.ch8 [forks]\n");
+    return 2;
+  }
+  uint64_t forks = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+  const size_t liveBranches = 4096;
+
+  std::vector<uint8_t> rom;
+  if (!ReadRom(argv[0], rom)) {
+    fprintf(stderr, "cannot read %s\n", argv[0]);
+    return 2;
+  }
+
+  Emulator root;
+  root.Init(static_cast<Emulator::ChipMode>(RomMode(argv[0])));
+  root.storeProgram(&rom[0], rom.size());
+  for (int frame = 0; frame < 60; frame++)
+    root.DoFrame();
+
+  std::vector<Emulator> branches(liveBranches);
+
+  Clock::time_point start = Clock::now();
+  for (uint64_t count = 0; count < forks; count++)
+    root.Fork(branches[count % liveBranches]);
+  double forkSecs = SecondsSince(start);
+  int64_t pagesShared = SharedPage::InUse();
+
+  start = Clock::now();
+  for (size_t br = 0; br < liveBranches; br++) {
+    branches[br].SetKey(br % 16, true);
+    branches[br].DoFrame();
+  }
+  double runSecs = SecondsSince(start);
+  int64_t pagesCopied = SharedPage::InUse() - pagesShared;
+
+  printf("%llu forks in %.3f s: %.1f ns per fork\n",
+    static_cast<unsigned long long>(forks), forkSecs, forkSecs * 1e9 / forks);
+  printf("%u live branches use %lld pages (%.1f KB)\n",
+    static_cast<unsigned>(liveBranches), static_cast<long long>(pagesShared),
+    pagesShared * SharedPage::size / 1024.0);
+  printf("one frame per branch: %.1f us per branch, %lld pages copied on write (%.2f per branch)\n",
+    runSecs * 1e6 / liveBranches, static_cast<long long>(pagesCopied),
+    static_cast<double>(pagesCopied) / liveBranches);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --check-hash rom [frames]
+// runs a rom with scripted keys and the state hash check on, and reports
+// the first instruction that left a wrong hash. then times reading the
+// hash against computing it.
+
+static int ToolCheckHash(int argc, char *argv[])
+{
+  if (argc < 1) {
+    fprintf(stderr, "usage: --check-hash rom.ch8 [frames]\n");
+    return 2;
+  }
+  int frames = argc > 1 ? atoi(argv[1]) : 3000;
+
+  std::vector<uint8_t> rom;
+  if (!ReadRom(argv[0], rom)) {
+    fprintf(stderr, "cannot read %s\n", argv[0]);
+    return 2;
+  }
+  Emulator::ChipMode mode = static_cast<Emulator::ChipMode>(RomMode(argv[0]));
+
+  // instruction by instruction, so a mismatch points at its instruction
+  Emulator emu;
+  emu.Init(mode);
+  emu.storeProgram(&rom[0], rom.size());
+  emu.SetHashCheck(true);
+  uint64_t mismatches = Metrics::Get(MetricStateHashMismatches);
+  uint64_t instructions = 0;
+  int frame;
+  for (frame = 0; frame < frames && !emu.ErrorOccured(); frame++) {
+    emu.SetKeys(QuirkDetector::ScriptKeys(frame));
+    for (int idx = 0; idx < Emulator::instructionsPerFrame && !emu.ErrorOccured(); idx++) {
+      uint16_t pc = emu.GetPC();
+      emu.DoInstruction();
+      instructions++;
+      if (Metrics::Get(MetricStateHashMismatches) != mismatches) {
+        printf("wrong hash after %04X at PC=%03X, frame %d\n",
+          (emu.PeekMemory(pc) << 8) | emu.PeekMemory(pc + 1), pc, frame);
+        return 1;
+      }
+    }
+    emu.DecreaseTimers();
+  }
+  if (Metrics::Get(MetricStateHashMismatches) != mismatches) {
+    printf("wrong hash after the timers of frame %d\n", frame);
+    return 1;
+  }
+  printf("%d frames, %llu instructions: state hash %016llx, always right\n", frame,
+    static_cast<unsigned long long>(instructions), static_cast<unsigned long long>(emu.StateHash()));
+
+  // the same run without the check, for the cost of the upkeep
+  Emulator plain;
+  plain.Init(mode);
+  plain.storeProgram(&rom[0], rom.size());
+  Clock::time_point start = Clock::now();
+  for (int idx = 0; idx < frame; idx++) {
+    plain.SetKeys(QuirkDetector::ScriptKeys(idx));
+    plain.DoFrame();
+  }
+  double runSecs = SecondsSince(start);
+
+  const int reads = 10000000, computes = 10000;
+  uint64_t sum = 0;
+  start = Clock::now();
+  for (int idx = 0; idx < reads; idx++) {
+    plain.SetKey(idx & 0xF, (idx & 0x10) != 0);
+    sum ^= plain.StateHash();
+  }
+  double readSecs = SecondsSince(start);
+  start = Clock::now();
+  for (int idx = 0; idx < computes; idx++) {
+    plain.SetKey(idx & 0xF, (idx & 0x10) != 0);
+    sum ^= plain.ComputeStateHash();
+  }
+  double computeSecs = SecondsSince(start);
+
+  printf("%.1f ns per frame, key change and hash read %.1f ns, full hash %.2f us (%llx)\n",
+    runSecs * 1e9 / frame, readSecs * 1e9 / reads, computeSecs * 1e6 / computes,
+    static_cast<unsigned long long>(sum & 0xF));
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --bench-env rom [envs] [threads] [steps]
+// steps a vector environment with pseudo random keys, through the c
+// interface. runs twice with the same seed to check that runs repeat.
+
+static uint64_t RunEnvironments(c8env_vec *vec, int nrEnvs, int steps,
+  std::vector<uint8_t> &obs, std::vector<uint16_t> &keys,
+  std::vector<float> &rewards, std::vector<int> &dones)
+{
+  // fnv-1a over everything the environments return
+  uint64_t hash = 14695981039346656037ULL;
+  uint32_t random = 12345;
+  c8env_vec_reset(vec, 1, &obs[0]);
+  for (int step = 0; step < steps; step++) {
+    for (int env = 0; env < nrEnvs; env++) {
+      random = random * 1103515245 + 12345;
+      keys[env] = static_cast<uint16_t>(1 << ((random >> 16) & 15));
+    }
+    c8env_vec_step(vec, &keys[0], &obs[0], &rewards[0], &dones[0]);
+    for (size_t idx = 0; idx < obs.size(); idx += 61)
+      hash = (hash ^ obs[idx]) * 1099511628211ULL;
+    for (int env = 0; env < nrEnvs; env++)
+      hash = (hash ^ static_cast<uint64_t>(rewards[env] * 16.0f) ^ (dones[env] << 8)) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+static int ToolBenchEnv(int argc, char *argv[])
+{
+  if (argc < 1) {
+    fprintf(stderr, "usage: --bench-env rom.ch8 [envs] [threads] [steps]\n");
+    return 2;
+  }
+  int nrEnvs = argc > 1 ? atoi(argv[1]) : 64;
+  int nrThreads = argc > 2 ? atoi(argv[2]) : static_cast<int>(std::thread::hardware_concurrency());
+  int steps = argc > 3 ? atoi(argv[3]) : 1000;
+  const int framesPerStep = 4;
+
+  std::vector<uint8_t> rom;
+  if (!ReadRom(argv[0], rom)) {
+    fprintf(stderr, "cannot read %s\n", argv[0]);
+    return 2;
+  }
+
+  c8env_vec *vec = c8env_vec_create(&rom[0], rom.size(), RomMode(argv[0]), framesPerStep, nrEnvs, nrThreads);
+  if (vec == NULL) {
+    fprintf(stderr, "%s: the environment has no megachip mode\n", argv[0]);
+    return 2;
+  }
+
+  // all buffers are allocated once, steps do not allocate
+  std::vector<uint8_t> obs(static_cast<size_t>(nrEnvs) * C8ENV_OBS_SIZE);
+  std::vector<uint16_t> keys(nrEnvs);
+  std::vector<float> rewards(nrEnvs);
+  std::vector<int> dones(nrEnvs);
+
+  Clock::time_point start = Clock::now();
+  uint64_t first = RunEnvironments(vec, nrEnvs, steps, obs, keys, rewards, dones);
+  double secs = SecondsSince(start);
+  uint64_t second = RunEnvironments(vec, nrEnvs, steps, obs, keys, rewards, dones);
+  c8env_vec_destroy(vec);
+
+  double totalSteps = static_cast<double>(nrEnvs) * steps;
+  printf("%d environments, %d threads, %d frames per step\n", nrEnvs, nrThreads, framesPerStep);
+  printf("%.0f steps per second, %.0f frames per second\n",
+    totalSteps / secs, totalSteps * framesPerStep / secs);
+  printf("repeatable: %s\n", first == second ? "yes" : "NO");
+  return first == second ? 0 : 1;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --analyze rom [cachedir] [frames]
+// analyzes a rom through the analysis cache, and times loading it up to
+// the first frame with an empty (cold) and a filled (warm) cache. then
+// runs it with and without the analysis, which must give the same result.
+
+static double LoadToFirstFrame(const char *fileName, AnalysisCache &cache, CodeAnalysis &analysis,
+  Emulator &emu, bool &warm)
+{
+  Clock::time_point start = Clock::now();
+  std::vector<uint8_t> rom;
+  ReadRom(fileName, rom);
+  int mode = RomMode(fileName);
+  emu.Init(static_cast<Emulator::ChipMode>(mode));
+  emu.storeProgram(&rom[0], rom.size());
+  warm = cache.Load(analysis, &rom[0], rom.size(), mode);
+  emu.SetAnalysis(&analysis);
+  emu.DoFrame();
+  return SecondsSince(start);
+}
+
+static uint64_t MachineChecksum(const Emulator &emu)
+{
+  uint8_t screen[128 * 64];
+  emu.SCR.Render(screen, emu.SCR.Width());
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t idx = 0; idx < emu.SCR.Width() * emu.SCR.Height(); idx++)
+    hash = (hash ^ screen[idx]) * 1099511628211ULL;
+  for (uint32_t addr = 0; addr < emu.MemorySize(); addr++)
+    hash = (hash ^ emu.PeekMemory(addr)) * 1099511628211ULL;
+  return hash;
+}
+
+static int ToolAnalyze(int argc, char *argv[])
+{
+  if (argc < 1) {
+    fprintf(stderr, "usage: --analyze rom.ch8 [cachedir] [frames]\n");
+    return 2;
+  }
+  std::string directory = argc > 1 ? argv[1] : ".";
+  int frames = argc > 2 ? atoi(argv[2]) : 6000;
+
+  std::vector<uint8_t> rom;
+  if (!ReadRom(argv[0], rom)) {
+    fprintf(stderr, "cannot read %s\n", argv[0]);
+    return 2;
+  }
+  int mode = RomMode(argv[0]);
+  AnalysisCache cache(directory);
+  remove(cache.FileName(CodeAnalysis::Hash(&rom[0], rom.size(), mode), mode).c_str());
+
+  CodeAnalysis analysis;
+  Emulator emu;
+  bool warm;
+  double cold = LoadToFirstFrame(argv[0], cache, analysis, emu, warm);
+  double mapped = LoadToFirstFrame(argv[0], cache, analysis, emu, warm);
+  printf("load to first frame: cold %.1f us, warm %.1f us (%s)\n",
+    cold * 1e6, mapped * 1e6, warm ? "mapped from cache" : "cache not written");
+
+  printf("%u instructions, %u basic blocks, %u subroutines, %u idle loops, %u bytes\n",
+    static_cast<unsigned>(analysis.NrInstructions()), static_cast<unsigned>(analysis.NrBlocks()),
+    static_cast<unsigned>(analysis.NrSubroutines()), static_cast<unsigned>(analysis.NrIdleLoops()),
+    static_cast<unsigned>(analysis.DataSize()));
+  for (size_t idx = 0; idx < analysis.NrIdleLoops(); idx++) {
+    const CodeAnalysis::IdleLoop &loop = analysis.IdleLoops()[idx];
+    printf("  idle loop %03X-%03X, %d instructions\n", loop.start, loop.end, loop.length);
+  }
+
+  // the idle loop skipping must not change the outcome
+  Emulator plain;
+  plain.Init(static_cast<Emulator::ChipMode>(mode));
+  plain.storeProgram(&rom[0], rom.size());
+  Clock::time_point start = Clock::now();
+  for (int frame = 0; frame < frames; frame++)
+    plain.DoFrame();
+  double plainSecs = SecondsSince(start);
+
+  emu.Init(static_cast<Emulator::ChipMode>(mode));
+  emu.storeProgram(&rom[0], rom.size());
+  emu.SetAnalysis(&analysis);
+  start = Clock::now();
+  for (int frame = 0; frame < frames; frame++)
+    emu.DoFrame();
+  double analyzedSecs = SecondsSince(start);
+
+  bool same = MachineChecksum(plain) == MachineChecksum(emu);
+  printf("%d frames: %.2f ms without analysis, %.2f ms with, %s\n",
+    frames, plainSecs * 1e3, analyzedSecs * 1e3, same ? "same result" : "DIFFERENT RESULT");
+  return same ? 0 : 1;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --bench-blend rom [frames]
+// times the anti-flicker blend modes on the frames of a rom, scaled up to
+// the super chip resolution if needed.
+
+static int ToolBenchBlend(int argc, char *argv[])
+{
+  if (argc < 1) {
+    fprintf(stderr, "usage: --bench-blend rom.ch8 [frames]\n");
+    return 2;
+  }
+  int frames = argc > 1 ? atoi(argv[1]) : 2000;
+
+  std::vector<uint8_t> rom;
+  if (!ReadRom(argv[0], rom)) {
+    fprintf(stderr, "cannot read %s\n", argv[0]);
+    return 2;
+  }
+  Emulator emu;
+  emu.Init(static_cast<Emulator::ChipMode>(RomMode(argv[0])));
+  emu.storeProgram(&rom[0], rom.size());
+
+  // render all frames first, so only the blending is timed
+  const size_t width = 128, height = 64;
+  std::vector<uint8_t> rendered(frames * width * height);
+  uint8_t lores[64 * 32];
+  for (int frame = 0; frame < frames; frame++) {
+    emu.DoFrame();
+    uint8_t *dst = &rendered[frame * width * height];
+    if (emu.SCR.IsHires()) {
+      emu.SCR.Render(dst, width);
+      continue;
+    }
+    emu.SCR.Render(lores, 64);
+    for (size_t y = 0; y < height; y++)
+      for (size_t x = 0; x < width; x++)
+        dst[y * width + x] = lores[(y / 2) * 64 + x / 2];
+  }
+
+  static const char *names[FrameBlender::nrBlendModes] = { "off", "max", "phosphor", "majority" };
+  FrameBlender *blender = new FrameBlender;     // large, keep it off the stack
+  std::vector<uint8_t> out(width * height);
+  for (int mode = 0; mode < FrameBlender::nrBlendModes; mode++) {
+    for (int nrFrames = 2; nrFrames <= FrameBlender::maxFrames; nrFrames *= 2) {
+      blender->SetMode(static_cast<FrameBlender::Mode>(mode));
+      blender->SetFrames(nrFrames);
+      Clock::time_point start = Clock::now();
+      for (int frame = 0; frame < frames; frame++)
+        blender->Blend(&rendered[frame * width * height], width, height, &out[0], width);
+      double secs = SecondsSince(start);
+      printf("%-8s %d frames: %.2f us per frame\n", names[mode], nrFrames, secs * 1e6 / frames);
+      if (mode == FrameBlender::BlendOff || mode == FrameBlender::BlendPhosphor)
+        break;                                  // the frame count does not matter
+    }
+  }
+  delete blender;
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --bench-megachip [blits]
+// times colour sprite blits of several sizes on the megachip screen, with
+// the vector kernels and with the plain ones, then a full redraw: a
+// screen sized sprite, two scrolls and the 00E0 that shows the frame.
+
+static int ToolBenchMegaChip(int argc, char *argv[])
+{
+  uint64_t blits = argc > 0 ? strtoull(argv[0], NULL, 10) : 200000;
+
+  // random colours, a quarter of them transparent
+  std::vector<uint8_t> sprite(256 * 192);
+  uint32_t seed = 1;
+  for (size_t idx = 0; idx < sprite.size(); idx++) {
+    seed = seed * 1103515245 + 12345;
+    uint8_t px = static_cast<uint8_t>(seed >> 24);
+    sprite[idx] = (px & 3) == 0 ? 0 : px;
+  }
+
+  Emulator emu;
+  emu.Init(Emulator::MEGACHIP);
+  emu.SCR.SetColour(true);
+  static const int sizes[][2] = { { 8, 8 }, { 16, 16 }, { 32, 32 }, { 64, 64 }, { 256, 192 } };
+  uint64_t collisions = 0;
+  for (int vector = Blitter::HasVector() ? 1 : 0; vector >= 0; vector--) {
+    Blitter::SetVector(vector != 0);
+    const char *name = vector ? "vector" : "plain";
+    for (size_t sz = 0; sz < _countof(sizes); sz++) {
+      int w = sizes[sz][0], h = sizes[sz][1];
+      // the same number of pixels for every size
+      uint64_t count = blits * 64 / (w * h) + 1;
+      Clock::time_point start = Clock::now();
+      for (uint64_t n = 0; n < count; n++) {
+        int x = static_cast<int>((n * 37) % (257 - w)), y = static_cast<int>((n * 23) % (193 - h));
+        for (int line = 0; line < h; line++)
+          collisions += emu.SCR.BlitColourLine(x, y + line, &sprite[line * w], w, 0x81);
+        // a frame every 64 sprites, so pages are copied on write again
+        if (n % 64 == 63)
+          emu.SCR.Present();
+      }
+      double secs = SecondsSince(start);
+      printf("%-6s %3dx%-3d %12.0f blits/s %8.2f gpixels/s\n", name, w, h,
+        count / secs, count * w * h / secs / 1e9);
+    }
+
+    int frames = static_cast<int>(blits / 100) + 1;
+    Clock::time_point start = Clock::now();
+    for (int frame = 0; frame < frames; frame++) {
+      for (int line = 0; line < 192; line++)
+        collisions += emu.SCR.BlitColourLine(0, line, &sprite[line * 256], 256, 0x81);
+      emu.SCR.ScrollColour(0, -1);
+      emu.SCR.ScrollColour(4, 0);
+      emu.SCR.Present();
+    }
+    double secs = SecondsSince(start);
+    printf("%-6s full redraw %.2f us per frame, %.3f%% of a 60 Hz frame\n", name,
+      secs * 1e6 / frames, secs * 60 * 100 / frames);
+  }
+  Blitter::SetVector(true);
+  printf("(%llu collisions)\n", static_cast<unsigned long long>(collisions));
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --bench-timeline [spans] [file]
+// times a timeline span, begin and end, while not recording and while
+// recording into file. the rings are drained between batches, outside the
+// timing, so no event is lost.
+
+static int ToolBenchTimeline(int argc, char *argv[])
+{
+  uint64_t spans = argc > 0 ? strtoull(argv[0], NULL, 10) : 1000000;
+  std::string file = argc > 1 ? argv[1] : "timeline.json";
+  static const uint64_t batch = 16384;     // two events each, half a ring
+
+#ifdef CHIP8_TIMELINE
+  printf("instrumentation compiled in\n");
+#else
+  printf("instrumentation compiled out, the spans below are called directly\n");
+#endif
+
+  Clock::time_point start = Clock::now();
+  for (uint64_t n = 0; n < spans; n++) {
+    TimelineSpan span("bench");
+  }
+  double secs = SecondsSince(start);
+  printf("not recording: %.2f ns per span\n", secs * 1e9 / spans);
+
+  if (!Timeline::Start(file)) {
+    fprintf(stderr, "cannot write %s\n", file.c_str());
+    return 1;
+  }
+  Timeline::SetThreadName("bench");
+  double recorded = 0;
+  for (uint64_t done = 0; done < spans; done += batch) {
+    uint64_t count = spans - done < batch ? spans - done : batch;
+    start = Clock::now();
+    for (uint64_t n = 0; n < count; n++) {
+      TimelineSpan span("bench");
+    }
+    recorded += SecondsSince(start);
+    Timeline::Flush();
+  }
+  Timeline::Instant("bench done", static_cast<int32_t>(spans % 1000000));
+  Timeline::Stop();
+  printf("recording:     %.2f ns per span\n", recorded * 1e9 / spans);
+  printf("%llu events written to %s, %llu lost\n", static_cast<unsigned long long>(Timeline::Written()),
+    file.c_str(), static_cast<unsigned long long>(Timeline::Lost()));
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --bench-runahead rom [frames] [ahead]
+// runs a rom with scripted keys, plain and with 1 to ahead frames of
+// run-ahead, and prints the cost of a frame run ahead, of saving and
+// restoring, and the share of a 60 Hz frame it takes. the runs must end in
+// the same state: running ahead does not change the game.
+
+static int ToolBenchRunAhead(int argc, char *argv[])
+{
+  if (argc < 1) {
+    fprintf(stderr, "usage: --bench-runahead rom.ch8 [frames] [ahead]\n");
+    return 2;
+  }
+  int frames = argc > 1 ? atoi(argv[1]) : 3000;
+  int maxAhead = argc > 2 ? atoi(argv[2]) : 4;
+  if (maxAhead < 1 || maxAhead > RunAhead::maxFrames) {
+    fprintf(stderr, "ahead is 1 to %d frames\n", RunAhead::maxFrames);
+    return 2;
+  }
+  std::vector<uint8_t> rom;
+  if (!ReadRom(argv[0], rom)) {
+    fprintf(stderr, "cannot read %s\n", argv[0]);
+    return 2;
+  }
+  Emulator::ChipMode mode = static_cast<Emulator::ChipMode>(RomMode(argv[0]));
+
+  Emulator plain;
+  plain.Init(mode);
+  plain.storeProgram(&rom[0], rom.size());
+  Clock::time_point start = Clock::now();
+  for (int frame = 0; frame < frames; frame++) {
+    plain.SetKeys(QuirkDetector::ScriptKeys(frame));
+    plain.DoFrame();
+  }
+  double plainSecs = SecondsSince(start);
+  uint64_t checksum = MachineChecksum(plain);
+  printf("plain: %.2f us per frame, checksum %016llx\n", plainSecs * 1e6 / frames,
+    static_cast<unsigned long long>(checksum));
+
+  int result = 0;
+  for (int ahead = 1; ahead <= maxAhead; ahead++) {
+    Emulator emu;
+    emu.Init(mode);
+    emu.storeProgram(&rom[0], rom.size());
+    RunAhead runAhead(emu);
+    runAhead.SetFrames(ahead);
+    int shown = 0;
+    for (int frame = 0; frame < frames; frame++) {
+      emu.SetKeys(QuirkDetector::ScriptKeys(frame));
+      emu.DoFrame();
+      if (runAhead.Advance())
+        shown++;
+      runAhead.Restore();
+    }
+    const RunAheadStats &stats = runAhead.Stats();
+    bool same = MachineChecksum(emu) == checksum;
+    printf("ahead %d: %.2f us per frame ahead, save %.0f ns, restore %.0f ns, "
+      "%.3f%% of a 60 Hz frame, max %.1f us, %d screens changed, %s\n",
+      ahead, stats.aheadNs / 1e3 / stats.aheadFrames, static_cast<double>(stats.saveNs) / stats.frames,
+      static_cast<double>(stats.restoreNs) / stats.frames,
+      (stats.saveNs + stats.aheadNs + stats.restoreNs) / (stats.frames * 1e9 / 60) * 100,
+      stats.maxNs / 1e3, shown, same ? "same state" : "DIFFERENT STATE");
+    if (!same)
+      result = 1;
+  }
+  return result;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --quirks rom [frames] [threads] [cachedir]
+// detects the quirks a rom needs, prints the score of every profile, then
+// loads the result through the cache twice.
+
+static int ToolQuirks(int argc, char *argv[])
+{
+  if (argc < 1) {
+    fprintf(stderr, "usage: --quirks rom.ch8 [frames] [threads] [cachedir]\n");
+    return 2;
+  }
+  int frames = argc > 1 ? atoi(argv[1]) : QuirkDetector::defaultFrames;
+  int nrThreads = argc > 2 ? atoi(argv[2]) : 0;
+  std::string cacheDir = argc > 3 ? argv[3] : ".";
+
+  std::vector<uint8_t> rom;
+  if (!ReadRom(argv[0], rom)) {
+    fprintf(stderr, "cannot read %s\n", argv[0]);
+    return 2;
+  }
+  Emulator::ChipMode mode = static_cast<Emulator::ChipMode>(RomMode(argv[0]));
+
+  QuirkRun runs[Emulator::nrQuirkProfiles];
+  Clock::time_point start = Clock::now();
+  int best = QuirkDetector::Detect(&rom[0], rom.size(), mode, runs, frames, nrThreads);
+  double seconds = SecondsSince(start);
+
+  printf("quirks  score     error frame  changed frames  pixels used\n");
+  for (int idx = 0; idx < Emulator::nrQuirkProfiles; idx++) {
+    const QuirkRun &run = runs[idx];
+    printf("%2d %s %10lld  %11d  %14d  %11d  %s\n", idx, idx == best ? "*" : " ",
+      static_cast<long long>(run.score), run.errorFrame, run.changedFrames, run.pixelsUsed,
+      QuirkDetector::Names(idx).c_str());
+  }
+  printf("best: %s, %d frames per profile in %.1f ms\n", QuirkDetector::Names(best).c_str(), frames, seconds * 1e3);
+
+  QuirkCache cache(cacheDir);
+  for (int pass = 0; pass < 2; pass++) {
+    bool cached = false;
+    start = Clock::now();
+    int quirks = cache.Load(&rom[0], rom.size(), mode, &cached);
+    printf("%s load: %s in %.1f ms\n", cached ? "cached" : "detected", QuirkDetector::Names(quirks).c_str(),
+      SecondsSince(start) * 1e3);
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --export-state rom [seconds] [name]
+// runs a rom headless at normal speed and publishes its state every frame,
+// like the window does when CHIP8_STATE_EXPORT is set.
+
+static int ToolExportState(int argc, char *argv[])
+{
+  if (argc < 1) {
+    fprintf(stderr, "usage: --export-state rom.ch8 [seconds] [name]\n");
+    return 2;
+  }
+  double seconds = argc > 1 ? atof(argv[1]) : 10;
+  std::string name = argc > 2 ? argv[2] : StateExporter::defaultName;
+
+  std::vector<uint8_t> rom;
+  if (!ReadRom(argv[0], rom)) {
+    fprintf(stderr, "cannot read %s\n", argv[0]);
+    return 2;
+  }
+  Emulator emu;
+  emu.Init(static_cast<Emulator::ChipMode>(RomMode(argv[0])));
+  emu.storeProgram(&rom[0], rom.size());
+
+  StateExporter exporter;
+  if (!exporter.Start(name)) {
+    fprintf(stderr, "cannot create shared memory %s\n", name.c_str());
+    return 2;
+  }
+
+  Clock::time_point start = Clock::now();
+  Clock::time_point deadline = start;
+  double publishSecs = 0;
+  int frames = 0;
+  while (SecondsSince(start) < seconds) {
+    emu.DoFrame();
+    Clock::time_point publishStart = Clock::now();
+    exporter.Publish(emu);
+    publishSecs += SecondsSince(publishStart);
+    frames++;
+    deadline += std::chrono::microseconds(16667);
+    std::this_thread::sleep_until(deadline);
+  }
+  printf("%d frames published as %s, %.2f us per publish\n", frames, name.c_str(), publishSecs * 1e6 / frames);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --state-viewer [name] [seconds]
+// sample reader: shows the published state in the terminal.
+
+static int ToolStateViewer(int argc, char *argv[])
+{
+  std::string name = argc > 0 ? argv[0] : StateExporter::defaultName;
+  double seconds = argc > 1 ? atof(argv[1]) : 0;
+
+  StateReader reader;
+  if (!reader.Open(name)) {
+    fprintf(stderr, "no state published as %s\n", name.c_str());
+    return 2;
+  }
+
+  SharedStateData *state = new SharedStateData;  // too large for the stack
+  Clock::time_point start = Clock::now();
+  uint64_t shown = 0;
+  int failed = 0;
+  printf("\x1b[2J");
+  while (seconds <= 0 || SecondsSince(start) < seconds) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(33));
+    if (reader.Frame() == shown)
+      continue;
+    if (!reader.Read(*state)) {
+      failed++;
+      continue;
+    }
+    shown = reader.Frame();
+
+    std::string out = "\x1b[H";
+    char line[256];
+    snprintf(line, sizeof(line), "frame %-8llu PC %04X  I %04X  SP %2d  DT %3d  ST %3d  keys %04X\n",
+      static_cast<unsigned long long>(state->frame), state->pc, state->i, state->sp, state->dt, state->st, state->keys);
+    out += line;
+    out += "V ";
+    for (int idx = 0; idx < 16; idx++) {
+      snprintf(line, sizeof(line), " %02X", state->v[idx]);
+      out += line;
+    }
+    out += "\nS ";
+    for (int idx = 0; idx < 16; idx++) {
+      snprintf(line, sizeof(line), idx < state->sp ? " %03X" : " ---", state->stack[idx]);
+      out += line;
+    }
+    out += "\n@PC";
+    for (int idx = 0; idx < 16; idx++) {
+      snprintf(line, sizeof(line), " %02X", state->memory[(state->pc + idx) % state->memorySize]);
+      out += line;
+    }
+    out += "\n@I ";
+    for (int idx = 0; idx < 16; idx++) {
+      // megachip memory above 64k is not exported
+      if (state->mode != Emulator::MEGACHIP || state->i + idx < state->memorySize)
+        snprintf(line, sizeof(line), " %02X", state->memory[(state->i + idx) % state->memorySize]);
+      else
+        snprintf(line, sizeof(line), " --");
+      out += line;
+    }
+    out += "\n";
+
+    // one character per 1x2 pixels, or 2x4 in high resolution
+    int sx = state->width / 64, sy = 2 * sx;
+    for (int y = 0; y < state->height; y += sy) {
+      for (int x = 0; x < state->width; x += sx) {
+        bool lit = false;
+        for (int dy = 0; dy < sy; dy++)
+          for (int dx = 0; dx < sx; dx++)
+            lit = lit || state->screen[(y + dy) * state->width + x + dx] != 0;
+        out += lit ? '#' : ' ';
+      }
+      out += '\n';
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+  }
+  delete state;
+  printf("%d reads gave up\n", failed);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --terminal rom [half|braille] [seconds]
+// plays a rom in the terminal, for machines without a display. keys 0-9
+// and a-f are the keypad, q or ctrl-c quits. the line below the screen
+// shows the bytes written per frame and the render time.
+
+static int ToolTerminal(int argc, char *argv[])
+{
+  if (argc < 1) {
+    fprintf(stderr, "usage: --terminal rom.ch8 [half|braille] [seconds]\n");
+    return 2;
+  }
+  TerminalRenderer::Mode mode = argc > 1 && strcmp(argv[1], "braille") == 0 ?
+    TerminalRenderer::Braille : TerminalRenderer::HalfBlock;
+  double seconds = argc > 2 ? atof(argv[2]) : 0;
+
+  std::vector<uint8_t> rom;
+  if (!ReadRom(argv[0], rom)) {
+    fprintf(stderr, "cannot read %s\n", argv[0]);
+    return 2;
+  }
+  Emulator::ChipMode chipMode = static_cast<Emulator::ChipMode>(RomMode(argv[0]));
+  Emulator emu;
+  emu.Init(chipMode);
+  emu.SetQuirks(QuirkDetector::Detect(&rom[0], rom.size(), chipMode));
+  emu.storeProgram(&rom[0], rom.size());
+
+  // a terminal only reports key presses. a key counts as held for a few
+  // frames after each press; auto repeat keeps it down once it starts.
+  const int holdFrames = 8;
+  int held[16] = { 0 };
+
+  Terminal term;
+  term.Open();
+  TerminalRenderer renderer(mode);
+  std::string out;
+  out.reserve(1 << 16);
+  uint8_t frame[128 * 64];
+
+  uint64_t frames = 0, rendered = 0, screenBytes = 0, written = 0;
+  double renderSecs = 0;
+  uint64_t secondFrames = 0, secondRendered = 0, secondBytes = 0;
+  double secondRenderSecs = 0, renderUs = 0;
+  int statusRow = 0;
+  bool stillShown = false;          // the status already says nothing changes
+  Clock::time_point start = Clock::now();
+  Clock::time_point deadline = start, lastStatus = start;
+  bool quit = false;
+  while (!quit && (seconds <= 0 || SecondsSince(start) < seconds)) {
+    int key;
+    while ((key = term.ReadKey()) >= 0) {
+      if (key == 'q' || key == 'Q' || key == 3)
+        quit = true;
+      else if (key >= '0' && key <= '9')
+        held[key - '0'] = holdFrames;
+      else if (key >= 'a' && key <= 'f')
+        held[key - 'a' + 10] = holdFrames;
+      else if (key >= 'A' && key <= 'F')
+        held[key - 'A' + 10] = holdFrames;
+    }
+    uint16_t keys = 0;
+    for (int idx = 0; idx < 16; idx++) {
+      if (held[idx] > 0) {
+        keys |= 1 << idx;
+        held[idx]--;
+      }
+    }
+    emu.SetKeys(keys);
+    emu.DoFrame();
+    if (emu.ErrorOccured())
+      break;
+    frames++;
+
+    out.clear();
+    if (emu.ScreenIsInvalidated()) {
+      Clock::time_point renderStart = Clock::now();
+      emu.SCR.Render(frame, emu.SCR.Width());
+      renderer.Render(frame, emu.SCR.Width(), emu.SCR.Height(), out);
+      secondRenderSecs += SecondsSince(renderStart);
+      secondRendered++;
+    }
+    secondBytes += out.size();
+    secondFrames++;
+
+    // the status line, once a second. it is left alone while the screen
+    // stands still, so a still screen writes nothing at all.
+    if (renderer.Rows() != statusRow) {
+      statusRow = renderer.Rows();            // moved, and cleared by the renderer
+      stillShown = false;
+    }
+    if (SecondsSince(lastStatus) >= 1) {
+      if (secondRendered > 0)
+        renderUs = secondRenderSecs * 1e6 / secondRendered;
+      if (secondBytes > 0 || !stillShown) {
+        char line[128];
+        snprintf(line, sizeof(line), "\x1b[%d;1H\x1b[0m%.1f bytes/frame, render %.1f us\x1b[K",
+          statusRow + 1, static_cast<double>(secondBytes) / secondFrames, renderUs);
+        out += line;
+        renderer.ForgetCursor();
+        stillShown = secondBytes == 0;
+      }
+      rendered += secondRendered;
+      screenBytes += secondBytes;
+      renderSecs += secondRenderSecs;
+      secondFrames = secondRendered = secondBytes = 0;
+      secondRenderSecs = 0;
+      lastStatus = Clock::now();
+    }
+
+    // everything of a frame in one write
+    if (!out.empty()) {
+      term.Write(out);
+      written += out.size();
+    }
+
+    deadline += std::chrono::microseconds(16667);
+    if (Clock::now() > deadline + std::chrono::milliseconds(100))
+      deadline = Clock::now();          // fell behind, for example while suspended
+    std::this_thread::sleep_until(deadline);
+  }
+
+  char line[32];
+  snprintf(line, sizeof(line), "\x1b[%d;1H\n", statusRow + 1);
+  term.Write(line);
+  term.Close();
+  rendered += secondRendered;
+  screenBytes += secondBytes;
+  renderSecs += secondRenderSecs;
+  if (emu.ErrorOccured())
+    printf("%ls\n", emu.ErrorMessage().c_str());
+  printf("%llu frames, %llu rendered: %.1f screen bytes per frame, %.1f us per render, %llu bytes written\n",
+    static_cast<unsigned long long>(frames), static_cast<unsigned long long>(rendered),
+    frames > 0 ? static_cast<double>(screenBytes) / frames : 0.0, rendered > 0 ? renderSecs * 1e6 / rendered : 0.0,
+    static_cast<unsigned long long>(written));
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --bench-scheduler rom sessions [workers] [seconds] [paused %]
+// runs many sessions of a rom at 60Hz on the frame scheduler, some of them
+// paused, and reports the cpu time and missed deadlines.
+
+static int ToolBenchScheduler(int argc, char *argv[])
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: --bench-scheduler rom.ch8 sessions [workers] [seconds] [paused %%]\n");
+    return 2;
+  }
+  int nrSessions = atoi(argv[1]);
+  int nrWorkers = argc > 2 ? atoi(argv[2]) : 0;
+  double seconds = argc > 3 ? atof(argv[3]) : 5;
+  int pausedPercent = argc > 4 ? atoi(argv[4]) : 0;
+
+  std::vector<uint8_t> rom;
+  if (!ReadRom(argv[0], rom) || nrSessions < 1) {
+    fprintf(stderr, "cannot read %s\n", argv[0]);
+    return 2;
+  }
+
+  FrameScheduler scheduler(nrWorkers);
+  std::vector<ScheduledSession *> sessions;
+  int nrPaused = nrSessions * pausedPercent / 100;
+  for (int idx = 0; idx < nrSessions; idx++) {
+    ScheduledSession *session = new ScheduledSession;
+    Emulator &emu = session->GetEmulator();
+    emu.Init(static_cast<Emulator::ChipMode>(RomMode(argv[0])));
+    emu.storeProgram(&rom[0], rom.size());
+    scheduler.Add(session);
+    sessions.push_back(session);
+  }
+
+  clock_t cpuStart = clock();
+  Clock::time_point start = Clock::now();
+  for (int idx = nrPaused; idx < nrSessions; idx++)
+    scheduler.Resume(sessions[idx]);
+  std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int>(seconds * 1000)));
+  for (int idx = nrPaused; idx < nrSessions; idx++)
+    scheduler.Pause(sessions[idx]);
+  double wall = SecondsSince(start);
+  double cpu = static_cast<double>(clock() - cpuStart) / CLOCKS_PER_SEC;
+
+  uint64_t frames = 0, cpuNs = 0, missed = 0, worstMissed = 0, pausedFrames = 0;
+  double worstFrameUs = 0;
+  for (int idx = 0; idx < nrSessions; idx++) {
+    ScheduledSession *session = sessions[idx];
+    if (idx < nrPaused) {
+      pausedFrames += session->Frames();
+      continue;
+    }
+    frames += session->Frames();
+    cpuNs += session->CpuNs();
+    missed += session->MissedDeadlines();
+    if (session->MissedDeadlines() > worstMissed)
+      worstMissed = session->MissedDeadlines();
+    double frameUs = session->Frames() > 0 ? session->CpuNs() / 1e3 / session->Frames() : 0;
+    if (frameUs > worstFrameUs)
+      worstFrameUs = frameUs;
+    if (nrSessions <= 16)
+      printf("session %2d: %llu frames, %.1f ms cpu, %.2f us per frame, %llu deadlines missed\n", idx,
+        static_cast<unsigned long long>(session->Frames()), session->CpuNs() / 1e6, frameUs,
+        static_cast<unsigned long long>(session->MissedDeadlines()));
+  }
+  int running = nrSessions - nrPaused;
+  printf("%d sessions (%d paused) on %d workers for %.1f s\n", nrSessions, nrPaused, scheduler.NrWorkers(), wall);
+  printf("%.1f frames/s per running session (60 wanted), %llu frames of paused sessions\n",
+    running > 0 ? frames / wall / running : 0.0, static_cast<unsigned long long>(pausedFrames));
+  printf("frames: %.2f cores busy, %.2f us per frame on average, worst session %.2f us\n",
+    cpuNs / 1e9 / wall, frames > 0 ? cpuNs / 1e3 / frames : 0.0, worstFrameUs);
+  printf("process: %.2f cores used, scheduling overhead %.2f us per frame\n",
+    cpu / wall, frames > 0 ? (cpu - cpuNs / 1e9) * 1e6 / frames : 0.0);
+  printf("missed deadlines: %llu of %llu frames (%.3f%%), worst session %llu\n",
+    static_cast<unsigned long long>(missed), static_cast<unsigned long long>(frames),
+    frames > 0 ? missed * 100.0 / frames : 0.0, static_cast<unsigned long long>(worstMissed));
+
+  for (int idx = 0; idx < nrSessions; idx++) {
+    scheduler.Remove(sessions[idx]);
+    delete sessions[idx];
+  }
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --server [port] [workers] [seconds]
+// runs the session server on 127.0.0.1, printing statistics every second.
+// exports metrics if CHIP8_METRICS_FILE or CHIP8_METRICS_PORT is set.
+
+static const uint16_t defaultPort = 8642;
+
+static int ToolServer(int argc, char *argv[])
+{
+  uint16_t port = static_cast<uint16_t>(argc > 0 ? atoi(argv[0]) : defaultPort);
+  int nrWorkers = argc > 1 ? atoi(argv[1]) : static_cast<int>(std::thread::hardware_concurrency());
+  double seconds = argc > 2 ? atof(argv[2]) : 0;
+
+  SessionServer server(nrWorkers);
+  if (!server.Listen(port)) {
+    fprintf(stderr, "cannot listen on port %d\n", port);
+    return 2;
+  }
+  printf("listening on 127.0.0.1:%d\n", port);
+  fflush(stdout);
+  MetricsExporter exporter;
+  exporter.StartFromEnvironment();
+  server.Run(seconds, stdout);
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --session-client port rom [frames] [reloads]
+// reference client: runs a rom on the server without input, and checks
+// every frame it receives against a local emulator. with reloads, the rom
+// is loaded again that many times on the same connection, each after
+// frames frames, and the check starts over with it.
+
+struct ReferenceCheck {
+  Emulator emu;
+  uint32_t load;                    // load of the rom the reference runs
+  uint32_t frame;
+  uint64_t verified;
+  uint64_t mismatches;
+};
+
+static void CheckFrame(SessionClient *client, void *user)
+{
+  ReferenceCheck *check = static_cast<ReferenceCheck *>(user);
+  if (client->LoadNumber() != check->load)
+    return;                         // a frame of the rom before the reload
+  while (check->frame < client->Frame()) {
+    check->emu.DoFrame();
+    check->frame++;
+  }
+  uint8_t local[frameSize];
+  check->emu.SCR.Render(local, check->emu.SCR.Width());
+  size_t size = check->emu.SCR.Width() * check->emu.SCR.Height();
+  if (client->Width() * client->Height() == size && memcmp(local, client->Screen(), size) == 0)
+    check->verified++;
+  else
+    check->mismatches++;
+}
+
+static int ToolSessionClient(int argc, char *argv[])
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: --session-client port rom.ch8 [frames] [reloads]\n");
+    return 2;
+  }
+  uint16_t port = static_cast<uint16_t>(atoi(argv[0]));
+  uint32_t frames = argc > 2 ? atoi(argv[2]) : 600;
+  int reloads = argc > 3 ? atoi(argv[3]) : 0;
+
+  std::vector<uint8_t> rom;
+  if (!ReadRom(argv[1], rom)) {
+    fprintf(stderr, "cannot read %s\n", argv[1]);
+    return 2;
+  }
+  int mode = RomMode(argv[1]);
+
+  ReferenceCheck check;
+  check.emu.Init(static_cast<Emulator::ChipMode>(mode));
+  check.emu.storeProgram(&rom[0], rom.size());
+  check.load = 1;
+  check.frame = 0;
+  check.verified = 0;
+  check.mismatches = 0;
+
+  SessionClient client;
+  LatencyHistogram latency;
+  client.latency = &latency;
+  client.onFrame = CheckFrame;
+  client.user = &check;
+  if (!client.Connect("127.0.0.1", port) || !client.Load(&rom[0], rom.size(), mode)) {
+    fprintf(stderr, "cannot connect to port %d\n", port);
+    return 2;
+  }
+
+  // frames are only sent on changes, so stop after the frame count of
+  // real time, even if the last frame number is lower
+  Poller poller;
+  poller.Add(client.Socket(), &client);
+  bool open = true;
+  for (int round = 0; round <= reloads && open; round++) {
+    if (round > 0) {
+      // the same rom again, at the same resolution: the first frame of it
+      // must not be applied to the screen of the last one
+      check.emu.Init(static_cast<Emulator::ChipMode>(mode));
+      check.emu.storeProgram(&rom[0], rom.size());
+      check.load++;
+      check.frame = 0;
+      if (!client.Load(&rom[0], rom.size(), mode))
+        break;
+    }
+    Clock::time_point start = Clock::now();
+    double limit = frames / 60.0 + 1.0;
+    while (open && (client.LoadNumber() != check.load || client.Frame() < frames) &&
+           client.Error() == 0 && SecondsSince(start) < limit) {
+      Poller::Event event;
+      if (poller.Wait(100, &event, 1) > 0)
+        open = client.Receive();
+    }
+  }
+
+  printf("session %u, frame %u, %llu frames received, %llu bytes, %.1f bytes per frame\n",
+    client.Session(), client.Frame(), static_cast<unsigned long long>(client.framesReceived),
+    static_cast<unsigned long long>(client.bytesReceived),
+    client.framesReceived > 0 ? static_cast<double>(client.bytesReceived) / client.framesReceived : 0.0);
+  printf("latency p50 %.1f ms, p99 %.1f ms\n", latency.PercentileMs(50), latency.PercentileMs(99));
+  if (client.Error() != 0)
+    printf("emulator error %d\n", client.Error());
+  printf("%llu frames verified, %llu mismatches\n",
+    static_cast<unsigned long long>(check.verified), static_cast<unsigned long long>(check.mismatches));
+  return open && check.mismatches == 0 && client.framesReceived > 0 ? 0 : 1;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --session-load port rom sessions [seconds]
+// load generator: opens many sessions from one thread, presses random keys
+// and measures frame latency. server cpu time comes with the frames.
+
+static int ToolSessionLoad(int argc, char *argv[])
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: --session-load port rom.ch8 sessions [seconds]\n");
+    return 2;
+  }
+  uint16_t port = static_cast<uint16_t>(atoi(argv[0]));
+  int nrSessions = atoi(argv[2]);
+  double seconds = argc > 3 ? atof(argv[3]) : 10;
+
+  std::vector<uint8_t> rom;
+  if (!ReadRom(argv[1], rom)) {
+    fprintf(stderr, "cannot read %s\n", argv[1]);
+    return 2;
+  }
+  int mode = RomMode(argv[1]);
+
+  LatencyHistogram latency;
+  Poller poller;
+  std::vector<SessionClient *> clients;
+  for (int idx = 0; idx < nrSessions; idx++) {
+    SessionClient *client = new SessionClient;
+    client->latency = &latency;
+    clients.push_back(client);
+    if (!client->Connect("127.0.0.1", port) || !client->Load(&rom[0], rom.size(), mode)) {
+      fprintf(stderr, "cannot open session %d\n", idx);
+      for (size_t c = 0; c < clients.size(); c++)
+        delete clients[c];
+      return 2;
+    }
+    poller.Add(client->Socket(), client);
+  }
+
+  // every session changes its key about twice a second
+  uint32_t random = 12345;
+  Clock::time_point start = Clock::now();
+  Clock::time_point nextKeys = start;
+  int closed = 0;
+  Poller::Event events[64];
+  while (SecondsSince(start) < seconds) {
+    int n = poller.Wait(10, events, 64);
+    for (int idx = 0; idx < n; idx++) {
+      SessionClient *client = static_cast<SessionClient *>(events[idx].data);
+      if (!client->Receive()) {
+        poller.Remove(client->Socket());
+        closed++;
+      }
+    }
+    if (Clock::now() >= nextKeys) {
+      for (size_t idx = 0; idx < clients.size(); idx++) {
+        random = random * 1103515245 + 12345;
+        if (((random >> 16) & 31) == 0)
+          clients[idx]->SendKey((random >> 8) & 15, ((random >> 12) & 1) != 0);
+      }
+      nextKeys += std::chrono::milliseconds(16);
+    }
+  }
+  double secs = SecondsSince(start);
+
+  uint64_t frames = 0, bytes = 0, workNs = 0;
+  uint32_t workers = 0;
+  for (size_t idx = 0; idx < clients.size(); idx++) {
+    frames += clients[idx]->framesReceived;
+    bytes += clients[idx]->bytesReceived;
+    workNs += clients[idx]->serverWorkNs;
+    if (clients[idx]->Workers() > workers)
+      workers = clients[idx]->Workers();
+    delete clients[idx];
+  }
+
+  double cores = workNs / 1e9 / secs;
+  printf("%d sessions on %u server workers, %d closed\n", nrSessions, workers, closed);
+  printf("%.0f frames/s received, %.0f KB/s, %.1f bytes per frame\n",
+    frames / secs, bytes / secs / 1024, frames > 0 ? static_cast<double>(bytes) / frames : 0.0);
+  printf("server cpu %.3f cores, %.0f sessions per core\n", cores, cores > 0 ? nrSessions / cores : 0.0);
+  printf("frame latency p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+    latency.PercentileMs(50), latency.PercentileMs(99), latency.maxNs / 1e6);
+  return closed == 0 ? 0 : 1;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// --netplay-loopback rom [latency ms] [loss %] [frames] [delay]
+// two netplay peers in one process over a loopback link, with scripted
+// keys. both must end in the state of a local run with the same keys.
+//
+// --netplay rom localport host remoteport [frames] [delay]
+// one peer over udp, with scripted keys. start it on both machines with
+// the ports swapped; both print the same checksum at the end.
+
+// scripted keys: player 0 presses keys 0..7, player 1 keys 8..F, changing
+// every few frames
+static uint16_t ScriptKeys(int player, int frame)
+{
+  uint32_t x = static_cast<uint32_t>(frame / 7 + 1) * 2654435761u ^ static_cast<uint32_t>(player + 1) * 40503u;
+  x ^= x >> 15;
+  x *= 2246822519u;
+  x ^= x >> 13;
+  uint16_t keys = static_cast<uint16_t>((x & 3) != 0 ? 1 << ((x >> 2) & 7) : 0);
+  return player == 0 ? keys : static_cast<uint16_t>(keys << 8);
+}
+
+static void PrintNetplayStats(const char *name, const NetplayStats &stats)
+{
+  printf("%s: %llu frames, %llu stalls, %llu rollbacks, depth avg %.1f max %d, "
+    "resimulation avg %.1f us max %.1f us, %llu packets sent, %llu received\n",
+    name, static_cast<unsigned long long>(stats.frames), static_cast<unsigned long long>(stats.stalls),
+    static_cast<unsigned long long>(stats.rollbacks),
+    stats.rollbacks > 0 ? static_cast<double>(stats.rollbackFrames) / stats.rollbacks : 0.0, stats.maxDepth,
+    stats.rollbacks > 0 ? stats.resimNs / 1e3 / stats.rollbacks : 0.0, stats.maxResimNs / 1e3,
+    static_cast<unsigned long long>(stats.packetsSent), static_cast<unsigned long long>(stats.packetsReceived));
+}
+
+static bool LoadRom(const char *fileName, Emulator &emu)
+{
+  std::vector<uint8_t> rom;
+  if (!ReadRom(fileName, rom)) {
+    fprintf(stderr, "cannot read %s\n", fileName);
+    return false;
+  }
+  emu.Init(static_cast<Emulator::ChipMode>(RomMode(fileName)));
+  emu.storeProgram(&rom[0], rom.size());
+  return true;
+}
+
+static int ToolNetplayLoopback(int argc, char *argv[])
+{
+  if (argc < 1) {
+    fprintf(stderr, "usage: --netplay-loopback rom.ch8 [latency ms] [loss %%] [frames] [delay]\n");
+    return 2;
+  }
+  int latency = argc > 1 ? atoi(argv[1]) : 50;
+  double loss = argc > 2 ? atof(argv[2]) / 100 : 0.05;
+  int nrFrames = argc > 3 ? atoi(argv[3]) : 3600;
+  int delay = argc > 4 ? atoi(argv[4]) : 0;
+
+  Emulator emu[2];
+  if (!LoadRom(argv[0], emu[0]))
+    return 2;
+  emu[0].Fork(emu[1]);
+  LoopbackLink link(latency, latency / 5, loss);
+  NetplaySession *peers[2];
+  for (int idx = 0; idx < 2; idx++) {
+    peers[idx] = new NetplaySession(emu[idx], link.End(idx));
+    peers[idx]->Start(delay);
+  }
+
+  // 60Hz host frames in simulated time. a peer that is done only polls,
+  // until both have the real keys of all frames.
+  uint64_t now = 0;
+  Clock::time_point start = Clock::now();
+  while (peers[0]->ConfirmedFrames() < nrFrames || peers[1]->ConfirmedFrames() < nrFrames) {
+    link.SetTime(now);
+    for (int idx = 0; idx < 2; idx++) {
+      if (peers[idx]->Frame() < nrFrames)
+        peers[idx]->AdvanceFrame(ScriptKeys(idx, peers[idx]->Frame()));
+      else
+        peers[idx]->Poll();
+    }
+    now += 16666667;
+  }
+  double seconds = SecondsSince(start);
+
+  // the same keys without the network. local keys given in frame f apply
+  // to frame f + delay.
+  Emulator reference;
+  LoadRom(argv[0], reference);
+  for (int f = 0; f < nrFrames; f++) {
+    uint16_t keys = 0;
+    if (f >= delay)
+      keys = ScriptKeys(0, f - delay) | ScriptKeys(1, f - delay);
+    reference.SetKeys(keys);
+    reference.DoFrame();
+  }
+
+  printf("%d frames at %d ms latency, %.0f%% loss, input delay %d, in %.2f s\n",
+    nrFrames, latency, loss * 100, delay, seconds);
+  PrintNetplayStats("peer 0", peers[0]->Stats());
+  PrintNetplayStats("peer 1", peers[1]->Stats());
+  uint64_t sums[3] = { MachineChecksum(emu[0]), MachineChecksum(emu[1]), MachineChecksum(reference) };
+  printf("checksums %016llx %016llx, reference %016llx: %s\n",
+    static_cast<unsigned long long>(sums[0]), static_cast<unsigned long long>(sums[1]),
+    static_cast<unsigned long long>(sums[2]), sums[0] == sums[2] && sums[1] == sums[2] ? "match" : "MISMATCH");
+  delete peers[0];
+  delete peers[1];
+  return sums[0] == sums[2] && sums[1] == sums[2] ? 0 : 1;
+}
+
+static int ToolNetplay(int argc, char *argv[])
+{
+  if (argc < 4) {
+    fprintf(stderr, "usage: --netplay rom.ch8 localport host remoteport [frames] [delay]\n");
+    return 2;
+  }
+  uint16_t localPort = static_cast<uint16_t>(atoi(argv[1]));
+  uint16_t remotePort = static_cast<uint16_t>(atoi(argv[3]));
+  int nrFrames = argc > 4 ? atoi(argv[4]) : 1800;
+  int delay = argc > 5 ? atoi(argv[5]) : 2;
+
+  Emulator emu;
+  if (!LoadRom(argv[0], emu))
+    return 2;
+  UdpTransport transport;
+  if (!transport.Open(localPort, argv[2], remotePort)) {
+    fprintf(stderr, "cannot open udp port %d to %s:%d\n", localPort, argv[2], remotePort);
+    return 2;
+  }
+  // the lower port is player 0
+  int player = localPort < remotePort ? 0 : 1;
+  NetplaySession session(emu, &transport);
+  session.Start(delay);
+
+  Clock::time_point deadline = Clock::now();
+  Clock::time_point lastReport = deadline;
+  int lastFrame = 0;
+  while (session.ConfirmedFrames() < nrFrames) {
+    if (session.Frame() < nrFrames)
+      session.AdvanceFrame(ScriptKeys(player, session.Frame()));
+    else
+      session.Poll();
+    deadline += std::chrono::microseconds(16667);
+    std::this_thread::sleep_until(deadline);
+
+    if (SecondsSince(lastReport) >= 1) {
+      const NetplayStats &stats = session.Stats();
+      printf("frame %d, confirmed %d, %d fps, %llu rollbacks, max depth %d, max resimulation %.1f us\n",
+        session.Frame(), session.ConfirmedFrames(), session.Frame() - lastFrame,
+        static_cast<unsigned long long>(stats.rollbacks), stats.maxDepth, stats.maxResimNs / 1e3);
+      fflush(stdout);
+      lastFrame = session.Frame();
+      lastReport = Clock::now();
+    }
+  }
+
+  // keep answering for a moment, the other peer may still miss our last keys
+  for (int idx = 0; idx < 60; idx++) {
+    session.Poll();
+    std::this_thread::sleep_for(std::chrono::milliseconds(16));
+  }
+  PrintNetplayStats(player == 0 ? "player 0" : "player 1", session.Stats());
+  printf("checksum at frame %d: %016llx\n", nrFrames, static_cast<unsigned long long>(MachineChecksum(emu)));
+  return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////
+//
+// dispatch
+
+struct Tool {
+  const char *name;
+  int(*run)(int argc, char *argv[]);
+};
+
+static const Tool tools[] = {
+  { "--trace", ToolTrace },
+  { "--trace-diff", ToolTraceDiff },
+  { "--bench-fork", ToolBenchFork },
+  { "--check-hash", ToolCheckHash },
+  { "--bench-env", ToolBenchEnv },
+  { "--analyze", ToolAnalyze },
+  { "--bench-blend", ToolBenchBlend },
+  { "--bench-megachip", ToolBenchMegaChip },
+  { "--bench-timeline", ToolBenchTimeline },
+  { "--bench-runahead", ToolBenchRunAhead },
+  { "--quirks", ToolQuirks },
+  { "--export-state", ToolExportState },
+  { "--state-viewer", ToolStateViewer },
+  { "--terminal", ToolTerminal },
+  { "--bench-scheduler", ToolBenchScheduler },
+  { "--server", ToolServer },
+  { "--session-client", ToolSessionClient },
+  { "--session-load", ToolSessionLoad },
+  { "--netplay-loopback", ToolNetplayLoopback },
+  { "--netplay", ToolNetplay },
+};
+
+int RunTool(int argc, char *argv[])
+{
+  if (argc < 2)
+    return -1;
+
+  for (size_t idx = 0; idx < _countof(tools); idx++) {
+    if (strcmp(argv[1], tools[idx].name) == 0) {
+#ifdef _WIN32
+      // the application is built for the windows subsystem, so it has no
+      // console of its own. use the one of the shell that started it.
+      if (AttachConsole(ATTACH_PARENT_PROCESS)) {
+        freopen("CONOUT$", "w", stdout);
+        freopen("CONOUT$", "w", stderr);
+      }
+#endif
+      return tools[idx].run(argc - 2, argv + 2);
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+class Emulator;
+
+// command line tools, for running the emulator without the UI.
+// returns the exit code of the tool, or -1 if the command line does not
+// select a tool and the UI should start.
+int RunTool(int argc, char *argv[]);
+
+// helpers shared by the tools
+bool ReadRom(const char *fileName, std::vector<uint8_t> &rom);
+int RomMode(const char *fileName);       // Emulator::ChipMode, from the file extension
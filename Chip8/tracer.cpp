@@ -0,0 +1,481 @@
+#include "tracer.h"
+
+#include <string.h>
+#include <QByteArray>
+
+///////////////////////////////////////////////////////////////////////////
+//
+// encoding helpers
+
+static inline uint8_t *PutVarint(uint8_t *out, uint32_t v)
+{
+  while (v >= 0x80) {
+    *out++ = static_cast<uint8_t>(v | 0x80);
+    v >>= 7;
+  }
+  *out++ = static_cast<uint8_t>(v);
+  return out;
+}
+
+static inline void PutVarint(std::vector<uint8_t> &buf, uint32_t v)
+{
+  uint8_t tmp[5];
+  buf.insert(buf.end(), tmp, PutVarint(tmp, v));
+}
+
+static inline uint32_t ZigZag(int32_t v)
+{
+  return (static_cast<uint32_t>(v) << 1) ^ static_cast<uint32_t>(v >> 31);
+}
+
+static inline int32_t UnZigZag(uint32_t v)
+{
+  return static_cast<int32_t>(v >> 1) ^ -static_cast<int32_t>(v & 1);
+}
+
+// bounds-checked decoding. on a truncated block, decoding stops at the end
+// of the block instead of reading past it.
+static inline bool GetByte(const std::vector<uint8_t> &buf, size_t &pos, uint8_t &v)
+{
+  if (pos >= buf.size())
+    return false;
+  v = buf[pos++];
+  return true;
+}
+
+static inline bool GetVarint(const std::vector<uint8_t> &buf, size_t &pos, uint32_t &v)
+{
+  v = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    uint8_t b;
+    if (!GetByte(buf, pos, b))
+      return false;
+    v |= static_cast<uint32_t>(b & 0x7F) << shift;
+    if ((b & 0x80) == 0)
+      return true;
+  }
+  return false;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+//
+// TraceWriter class
+
+TraceWriter::TraceWriter()
+: file(NULL), count(0), blockLen(0), prevI(0), prevPC(0), blockStart(true), stopping(false)
+{
+  memset(prevV, 0, sizeof(prevV));
+}
+
+TraceWriter::~TraceWriter()
+{
+  Close();
+}
+
+bool TraceWriter::Open(const char *fileName, int mode)
+{
+  Close();
+
+  file = fopen(fileName, "wb");
+  if (file == NULL)
+    return false;
+
+  TraceFileHeader hdr;
+  hdr.magic = traceMagic;
+  hdr.version = traceVersion;
+  hdr.mode = static_cast<uint16_t>(mode);
+  fwrite(&hdr, sizeof(hdr), 1, file);
+
+  count = 0;
+  block.resize(blockSize);
+  blockLen = 0;
+  blockStart = true;
+  stopping = false;
+  worker = std::thread(&TraceWriter::WorkerLoop, this);
+  return true;
+}
+
+void TraceWriter::Close()
+{
+  if (file == NULL)
+    return;
+
+  FlushBlock();
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  cond.notify_all();
+  worker.join();
+
+  fclose(file);
+  file = NULL;
+  spare.clear();
+}
+
+void TraceWriter::BeginInstruction(const uint8_t *V, uint32_t I)
+{
+  memcpy(prevV, V, sizeof(prevV));
+  prevI = I;
+  memWrites.clear();
+}
+
+void TraceWriter::MemoryWrite(uint32_t addr, const uint8_t *data, size_t len)
+{
+  if (len == 0)
+    return;
+  PutVarint(memWrites, addr);
+  PutVarint(memWrites, static_cast<uint32_t>(len));
+  memWrites.insert(memWrites.end(), data, data + len);
+}
+
+void TraceWriter::EndInstruction(uint16_t pc, uint16_t opcode, const uint8_t *V, uint32_t I)
+{
+  if (blockLen + maxRecordSize + memWrites.size() > block.size())
+    FlushBlock();
+
+  // find changed registers, eight at a time
+  uint16_t regMask = 0;
+  uint64_t now[2], before[2];
+  memcpy(now, V, 16);
+  memcpy(before, prevV, 16);
+  if (now[0] != before[0] || now[1] != before[1]) {
+    for (int idx = 0; idx < 16; idx++) {
+      if (V[idx] != prevV[idx])
+        regMask |= (1 << idx);
+    }
+  }
+
+  uint8_t flags = 0;
+  if (blockStart)
+    flags |= TRACE_SYNC;
+  else if (pc == static_cast<uint16_t>(prevPC + 2))
+    flags |= TRACE_PC_NEXT;
+  if (regMask)
+    flags |= TRACE_REGS;
+  if (I != prevI)
+    flags |= TRACE_I;
+  if (!memWrites.empty())
+    flags |= TRACE_MEM;
+
+  uint8_t *out = &block[blockLen];
+  *out++ = flags;
+  if (blockStart) {
+    memcpy(out, prevV, 16);
+    out += 16;
+    *out++ = static_cast<uint8_t>(prevI >> 16);
+    *out++ = static_cast<uint8_t>(prevI >> 8);
+    *out++ = static_cast<uint8_t>(prevI);
+    prevPC = 0;
+    blockStart = false;
+  }
+  if (!(flags & TRACE_PC_NEXT))
+    out = PutVarint(out, ZigZag(static_cast<int32_t>(pc) - prevPC));
+  *out++ = static_cast<uint8_t>(opcode >> 8);
+  *out++ = static_cast<uint8_t>(opcode);
+  if (regMask) {
+    out = PutVarint(out, regMask);
+    for (int idx = 0; idx < 16; idx++) {
+      if (regMask & (1 << idx))
+        *out++ = V[idx];
+    }
+  }
+  if (flags & TRACE_I)
+    out = PutVarint(out, ZigZag(static_cast<int32_t>(I) - prevI));
+  if (flags & TRACE_MEM) {
+    memcpy(out, &memWrites[0], memWrites.size());
+    out += memWrites.size();
+    *out++ = 0;                       // address
+    *out++ = 0;                       // length 0 terminates the list
+  }
+
+  blockLen = out - &block[0];
+  prevPC = pc;
+  count++;
+}
+
+void TraceWriter::FlushBlock()
+{
+  if (blockLen == 0)
+    return;
+
+  std::vector<uint8_t> next;
+  {
+    // wait if the compressor is falling behind, so memory use stays bounded.
+    std::unique_lock<std::mutex> guard(lock);
+    cond.wait(guard, [this] { return pending.size() < maxPendingBlocks; });
+    block.resize(blockLen);
+    pending.push_back(std::vector<uint8_t>());
+    pending.back().swap(block);
+    if (!spare.empty()) {
+      next.swap(spare.back());
+      spare.pop_back();
+    }
+  }
+  cond.notify_all();
+
+  next.resize(blockSize);
+  block.swap(next);
+  blockLen = 0;
+  blockStart = true;
+}
+
+void TraceWriter::WorkerLoop()
+{
+  for (;;) {
+    std::vector<uint8_t> raw;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      cond.wait(guard, [this] { return stopping || !pending.empty(); });
+      if (pending.empty())
+        return;                       // stopping, and everything is written
+      raw.swap(pending.front());
+      pending.pop_front();
+    }
+    cond.notify_all();
+
+    // level 1: the compressor has to keep up with the interpreter.
+    QByteArray packed = qCompress(&raw[0], static_cast<int>(raw.size()), 1);
+    uint32_t sizes[2] = { static_cast<uint32_t>(raw.size()), static_cast<uint32_t>(packed.size()) };
+    fwrite(sizes, sizeof(sizes), 1, file);
+    fwrite(packed.constData(), 1, packed.size(), file);
+
+    std::lock_guard<std::mutex> guard(lock);
+    spare.push_back(std::vector<uint8_t>());
+    spare.back().swap(raw);
+  }
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+//
+// TraceReader class
+
+TraceReader::TraceReader()
+: file(NULL), pos(0), index(0), pc(0), I(0)
+{
+  memset(&header, 0, sizeof(header));
+  memset(V, 0, sizeof(V));
+}
+
+TraceReader::~TraceReader()
+{
+  Close();
+}
+
+bool TraceReader::Open(const char *fileName)
+{
+  Close();
+
+  file = fopen(fileName, "rb");
+  if (file == NULL)
+    return false;
+
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+    header.magic != traceMagic || header.version < 1 || header.version > traceVersion)
+  {
+    Close();
+    return false;
+  }
+
+  block.clear();
+  pos = 0;
+  index = 0;
+  return true;
+}
+
+void TraceReader::Close()
+{
+  if (file != NULL) {
+    fclose(file);
+    file = NULL;
+  }
+}
+
+bool TraceReader::ReadBlock()
+{
+  uint32_t sizes[2];
+  if (file == NULL || fread(sizes, sizeof(sizes), 1, file) != 1)
+    return false;
+
+  QByteArray packed(static_cast<int>(sizes[1]), Qt::Uninitialized);
+  if (fread(packed.data(), 1, sizes[1], file) != sizes[1])
+    return false;
+
+  QByteArray raw = qUncompress(packed);
+  if (static_cast<uint32_t>(raw.size()) != sizes[0])
+    return false;
+
+  block.assign(raw.constData(), raw.constData() + raw.size());
+  pos = 0;
+  return true;
+}
+
+bool TraceReader::Next(TraceRecord &rec)
+{
+  if (pos >= block.size() && !ReadBlock())
+    return false;
+
+  uint8_t flags, hi, lo;
+  uint32_t value;
+  if (!GetByte(block, pos, flags))
+    return false;
+
+  if (flags & TRACE_SYNC) {
+    for (int idx = 0; idx < 16; idx++) {
+      if (!GetByte(block, pos, V[idx]))
+        return false;
+    }
+    uint8_t top = 0;
+    if (header.version >= 2 && !GetByte(block, pos, top))
+      return false;
+    if (!GetByte(block, pos, hi) || !GetByte(block, pos, lo))
+      return false;
+    I = (static_cast<uint32_t>(top) << 16) | (hi << 8) | lo;
+    pc = 0;
+  }
+
+  if (flags & TRACE_PC_NEXT) {
+    pc += 2;
+  }
+  else {
+    if (!GetVarint(block, pos, value))
+      return false;
+    pc = static_cast<uint16_t>(pc + UnZigZag(value));
+  }
+
+  if (!GetByte(block, pos, hi) || !GetByte(block, pos, lo))
+    return false;
+
+  rec.index = index++;
+  rec.pc = pc;
+  rec.opcode = static_cast<uint16_t>((hi << 8) | lo);
+  rec.regMask = 0;
+  rec.iChanged = false;
+  rec.memAddr.clear();
+  rec.memData.clear();
+
+  if (flags & TRACE_REGS) {
+    if (!GetVarint(block, pos, value))
+      return false;
+    rec.regMask = static_cast<uint16_t>(value);
+    for (int idx = 0; idx < 16; idx++) {
+      if ((rec.regMask & (1 << idx)) && !GetByte(block, pos, V[idx]))
+        return false;
+    }
+  }
+
+  if (flags & TRACE_I) {
+    if (!GetVarint(block, pos, value))
+      return false;
+    I = static_cast<uint32_t>(I + UnZigZag(value));
+    rec.iChanged = true;
+  }
+
+  if (flags & TRACE_MEM) {
+    for (;;) {
+      uint32_t addr, len;
+      if (!GetVarint(block, pos, addr) || !GetVarint(block, pos, len))
+        return false;
+      if (len == 0)
+        break;
+      if (pos + len > block.size())
+        return false;
+      rec.memAddr.push_back(addr);
+      rec.memData.push_back(std::vector<uint8_t>(&block[pos], &block[pos] + len));
+      pos += len;
+    }
+  }
+
+  memcpy(rec.V, V, sizeof(V));
+  rec.I = I;
+  return true;
+}
+
+
+///////////////////////////////////////////////////////////////////////////
+//
+// trace diff
+
+static bool SameRecord(const TraceRecord &a, const TraceRecord &b)
+{
+  return a.pc == b.pc && a.opcode == b.opcode &&
+    memcmp(a.V, b.V, sizeof(a.V)) == 0 && a.I == b.I &&
+    a.memAddr == b.memAddr && a.memData == b.memData;
+}
+
+static void PrintRecord(FILE *out, const char *tag, const TraceRecord &rec)
+{
+  fprintf(out, "%s %10llu  PC=%03X  %04X  I=%03X  V=", tag,
+    static_cast<unsigned long long>(rec.index), rec.pc, rec.opcode, rec.I);
+  for (int idx = 0; idx < 16; idx++)
+    fprintf(out, (rec.regMask & (1 << idx)) ? "[%02X]" : " %02X ", rec.V[idx]);
+  for (size_t w = 0; w < rec.memAddr.size(); w++) {
+    fprintf(out, "  M(%03X)=", rec.memAddr[w]);
+    for (size_t b = 0; b < rec.memData[w].size(); b++)
+      fprintf(out, "%02X", rec.memData[w][b]);
+  }
+  fprintf(out, "\n");
+}
+
+int TraceDiff(const char *fileA, const char *fileB, size_t context, FILE *out)
+{
+  TraceReader ra, rb;
+  if (!ra.Open(fileA)) {
+    fprintf(out, "cannot read trace %s\n", fileA);
+    return 2;
+  }
+  if (!rb.Open(fileB)) {
+    fprintf(out, "cannot read trace %s\n", fileB);
+    return 2;
+  }
+
+  // the traces are aligned on instruction index. identical records are
+  // kept in a ring buffer, so the lead-up to a divergence can be shown.
+  std::deque<TraceRecord> history;
+  TraceRecord a, b;
+  uint64_t compared = 0;
+  for (;;) {
+    bool hasA = ra.Next(a);
+    bool hasB = rb.Next(b);
+
+    if (!hasA && !hasB) {
+      fprintf(out, "traces are identical (%llu instructions)\n",
+        static_cast<unsigned long long>(compared));
+      return 0;
+    }
+
+    if (hasA && hasB && SameRecord(a, b)) {
+      compared++;
+      if (context > 0) {
+        history.push_back(a);
+        if (history.size() > context)
+          history.pop_front();
+      }
+      continue;
+    }
+
+    // first divergence
+    if (!hasA || !hasB) {
+      const TraceRecord &rest = hasA ? a : b;
+      fprintf(out, "trace %s ends at instruction %llu\n", hasA ? fileB : fileA,
+        static_cast<unsigned long long>(rest.index));
+    }
+    else {
+      fprintf(out, "first divergence at instruction %llu\n",
+        static_cast<unsigned long long>(a.index));
+    }
+    for (size_t idx = 0; idx < history.size(); idx++)
+      PrintRecord(out, "  ", history[idx]);
+    for (size_t line = 0; line <= context; line++) {
+      if (hasA)
+        PrintRecord(out, "A ", a);
+      if (hasB)
+        PrintRecord(out, "B ", b);
+      hasA = hasA && ra.Next(a);
+      hasB = hasB && rb.Next(b);
+    }
+    return 1;
+  }
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+///////////////////////////////////////////////////////////////////////////
+//
+// Execution trace file format
+//
+// A trace file starts with a TraceFileHeader, followed by any number of
+// blocks. Each block is [uint32 rawSize][uint32 packedSize][packed data],
+// where the packed data is qCompress'ed. Within a block, records are
+// variable length and delta encoded against the previous record in the
+// same block, so every block can be decoded on its own.
+//
+// record layout:
+//   uint8  flags                       (TraceFlags)
+//   uint8  V[16], uint24 I             only if TRACE_SYNC, state before the
+//                                      instruction. first record of a block.
+//                                      I is msb first, a uint16 in version 1.
+//   varint pc delta (zigzag)           only if !TRACE_PC_NEXT
+//   uint16 opcode (msb first)
+//   varint register mask               only if TRACE_REGS, followed by one
+//   uint8  value per set bit           byte per changed register
+//   varint I delta (zigzag)            only if TRACE_I
+//   varint address, varint length,     only if TRACE_MEM, repeated for
+//   uint8  data[length]                every write, ends with length 0
+
+static const uint32_t traceMagic = 0x52543843;   // 'C8TR'
+static const uint16_t traceVersion = 2;       // 2: 24 bit I, for megachip
+
+#pragma pack(push, 1)
+struct TraceFileHeader {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t mode;                    // Emulator::ChipMode at start of trace
+};
+#pragma pack(pop)
+
+enum TraceFlags {
+  TRACE_PC_NEXT = 0x01,             // pc is previous pc + 2
+  TRACE_REGS    = 0x02,             // one or more of V0..VF changed
+  TRACE_I       = 0x04,             // I changed
+  TRACE_MEM     = 0x08,             // instruction wrote to memory
+  TRACE_SYNC    = 0x10              // full register state follows
+};
+
+// one decoded instruction
+struct TraceRecord {
+  uint64_t index;                   // instruction number, starting at 0
+  uint16_t pc;
+  uint16_t opcode;
+  uint16_t regMask;                 // registers changed by this instruction
+  uint8_t V[16];                    // register file after the instruction
+  uint32_t I;                       // I after the instruction
+  bool iChanged;
+  std::vector<uint32_t> memAddr;    // memory writes, one entry per write
+  std::vector<std::vector<uint8_t> > memData;
+};
+
+///////////////////////////////////////////////////////////////////////////
+//
+// TraceWriter. Called by the emulator for every instruction while tracing.
+// Records are appended to an in-memory block; full blocks are compressed
+// and written by a background thread.
+
+class TraceWriter
+{
+public:
+  TraceWriter();
+  ~TraceWriter();
+
+  bool Open(const char *fileName, int mode);
+  void Close();
+  bool IsOpen() const { return file != NULL; }
+  uint64_t Count() const { return count; }
+
+  // emulator hooks. MemoryWrite must be called between BeginInstruction
+  // and EndInstruction.
+  void BeginInstruction(const uint8_t *V, uint32_t I);
+  void MemoryWrite(uint32_t addr, const uint8_t *data, size_t len);
+  void EndInstruction(uint16_t pc, uint16_t opcode, const uint8_t *V, uint32_t I);
+
+private:
+  static const size_t blockSize = 1 << 20;
+  static const size_t maxRecordSize = 64;   // record size without memory writes
+  static const size_t maxPendingBlocks = 8;
+
+  FILE *file;
+  uint64_t count;
+
+  // current block and delta state. block is allocated at full size,
+  // blockLen is the part in use.
+  std::vector<uint8_t> block;
+  size_t blockLen;
+  std::vector<uint8_t> memWrites;   // pending memory writes of current instruction
+  uint8_t prevV[16];
+  uint32_t prevI;
+  uint16_t prevPC;
+  bool blockStart;
+
+  // background compression
+  std::thread worker;
+  std::mutex lock;
+  std::condition_variable cond;
+  std::deque<std::vector<uint8_t> > pending;
+  std::vector<std::vector<uint8_t> > spare;
+  bool stopping;
+
+  void FlushBlock();
+  void WorkerLoop();
+};
+
+///////////////////////////////////////////////////////////////////////////
+//
+// TraceReader. Decodes a trace file record by record.
+
+class TraceReader
+{
+public:
+  TraceReader();
+  ~TraceReader();
+
+  bool Open(const char *fileName);
+  void Close();
+  int Mode() const { return header.mode; }
+  bool Next(TraceRecord &rec);      // returns false at end of trace
+
+private:
+  FILE *file;
+  TraceFileHeader header;
+  std::vector<uint8_t> block;
+  size_t pos;
+  uint64_t index;
+  uint16_t pc;
+  uint8_t V[16];
+  uint32_t I;
+
+  bool ReadBlock();
+};
+
+// compare two traces and report the first divergence, with some context.
+// returns 0 if the traces are identical, 1 if they differ, 2 on error.
+int TraceDiff(const char *fileA, const char *fileB, size_t context, FILE *out);